@@ -1,19 +1,100 @@
+// sched_setaffinity and friends
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+// 64-bit off_t for fseeko on 32-bit Linux, the rewind spill file gets big
+#if defined(__linux__) && !defined(_FILE_OFFSET_BITS)
+#define _FILE_OFFSET_BITS 64
+#endif
+
+// -DCHIP8_CORE builds just the interpreter for embedding: no SDL, no heap and
+// no main. Everything from the input queue down is the SDL frontend.
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <math.h>
+
+#ifdef _MSC_VER
+#define FORCE_INLINE __forceinline
+#define UNUSED
+#else
+#define FORCE_INLINE inline __attribute__((always_inline))
+#define UNUSED __attribute__((unused))
+#endif
+
+#ifndef CHIP8_CORE
 #include <SDL2/SDL.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
+
+// Only when the compiler's been told it can use it (-mavx2, /arch:AVX2)
+#ifdef __AVX2__
+#include <immintrin.h>
+#define HAVE_AVX2 1
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#endif
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+
+// Raw syscalls, so no liburing needed
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+#endif
+
 const int WINDOW_WIDTH = 1280;
 const int WINDOW_HEIGHT = 640;
 
 const size_t MEMORY_SIZE = 0x1000;
+// MegaChip ROMs address 24 bits through LDHI
+const size_t MEGACHIP_MEMORY_SIZE = 0x1000000;
+const int MEGACHIP_WIDTH = 256;
+const int MEGACHIP_HEIGHT = 192;
 const size_t PROGRAM_START = 0x200;
+// Where hi-res CHIP-8 programs begin once their setup stub is skipped
+const uint16_t HIRES_START = 0x2C0;
 const size_t STACK_START = 0x52;
 const size_t FONT_START = 0x50;
+// Big enough for the largest geometry, 2 planes of 128x64
+const size_t VIDEO_BUFFER_WORDS = 2 * 64 * 2;
 const int AUDIO_SAMPLE_RATE = 44100;
 const float FRAME_TIME = 1000.0 / 60.0;
+// Instructions run per 60Hz frame (~660Hz)
+const int CYCLES_PER_FRAME = 11;
+const uint32_t DEFAULT_KEYFRAME_INTERVAL = 600;
+// One byte of COVERAGE_* flags for every address pc can hold
+const size_t COVERAGE_SIZE = 0x10000;
+
+enum CoverageFlags {
+	COVERAGE_EXECUTED = 0x1,
+	// Skip instructions that did and didn't skip
+	COVERAGE_TAKEN = 0x2,
+	COVERAGE_NOT_TAKEN = 0x4
+};
 
 const uint8_t FONTS[16 * 5] = {
 	0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
@@ -34,6 +115,37 @@ const uint8_t FONTS[16 * 5] = {
 	0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
+// Packed 1-bit rows, leftmost pixel in the top bit. The video buffer holds
+// planes * height * words_per_row words, plane by plane.
+struct Framebuffer {
+	int width;
+	int height;
+	int words_per_row;
+	int planes;
+};
+
+enum FramebufferMode {
+	FRAMEBUFFER_64X32 = 0,
+	// Hi-res CHIP-8 (ROMs starting with 0x1260)
+	FRAMEBUFFER_64X64 = 1,
+	// SUPER-CHIP 00FF
+	FRAMEBUFFER_128X64 = 2,
+	// XO-CHIP, two bitplanes
+	FRAMEBUFFER_XO_64X32 = 3,
+	FRAMEBUFFER_XO_128X64 = 4
+};
+
+const struct Framebuffer FRAMEBUFFERS[] = {
+	{ 64, 32, 1, 1 },
+	{ 64, 64, 1, 1 },
+	{ 128, 64, 2, 1 },
+	{ 64, 32, 1, 2 },
+	{ 128, 64, 2, 2 }
+};
+
+// Plane bits -> RGBA8888
+const uint32_t PLANE_COLORS[4] = { 0x00000000, 0xFFFFFFFF, 0xAAAAAAFF, 0x555555FF };
+
 struct State {
 	uint8_t* memory;
 	uint8_t regs_v[16];
@@ -42,13 +154,132 @@ struct State {
 	uint8_t keycode;
 	uint16_t pc;
 	uint16_t sp;
-	uint16_t reg_i;
+	// 24 bit in MegaChip mode
+	uint32_t reg_i;
 	bool end_of_program;
 	bool waiting_for_key;
 	uint64_t* video_buffer;
+	uint8_t framebuffer_mode;
+	// XO-CHIP planes that drawing and clearing apply to
+	uint8_t plane_mask;
+	// Per instance so snapshots and replays are deterministic
+	uint32_t rng_state;
+	// MEMORY_SIZE, or MEGACHIP_MEMORY_SIZE once a big ROM is loaded
+	size_t memory_size;
+	bool megachip_mode;
+	// Allocated the first time MegaChip mode is switched on
+	struct MegaChip* megachip;
+	// COVERAGE_SIZE flags when collecting coverage, otherwise NULL
+	uint8_t* coverage;
+	// Set when tracing input latency, otherwise NULL
+	struct LatencyProbe* latency;
+	// Set when 0FNN host calls are enabled, otherwise NULL
+	struct HostCalls* host_calls;
+	// Instructions run since the last reset
+	uint64_t cycles;
+	// Since the last reset too, only the first is printed
+	uint32_t unknown_opcodes;
+	// Set when running state_frame_cached, otherwise NULL
+	struct DecodeCache* decode_cache;
+};
+
+enum LatencyStage {
+	LATENCY_IDLE = 0,
+	// Key event seen, waiting for the frame that applies it
+	LATENCY_EVENT,
+	// Applied at applied_cycle, waiting for the ROM to read it
+	LATENCY_APPLIED,
+	LATENCY_OBSERVED,
+	LATENCY_DRAWN
+};
+
+// The part of a latency trace that happens inside the interpreter, in
+// emulated cycles. One key press is followed at a time.
+struct LatencyProbe {
+	uint8_t stage;
+	uint8_t key;
+	uint64_t applied_cycle;
+	uint64_t observed_cycle;
+	uint64_t drawn_cycle;
+	// The framebuffer before the current draw, to tell if it changed anything
+	uint64_t video_before[2 * 64 * 2];
+};
+
+enum MegaChipBlend {
+	BLEND_NORMAL = 0,
+	BLEND_25 = 1,
+	BLEND_50 = 2,
+	BLEND_75 = 3,
+	BLEND_ADD = 4,
+	BLEND_MULTIPLY = 5
+};
+
+// Key transitions to apply during one frame, at the cycle they happened.
+// Fixed size so recordings can find a frame's input without scanning.
+struct FrameInput {
+	uint8_t count;
+	// Offset into the frame's CYCLES_PER_FRAME instruction slice
+	uint8_t cycles[2];
+	uint8_t keycodes[2];
+};
+
+// 256x192 indexed colour display. Sprites are blended into pixels as they are
+// drawn, indices is kept alongside for collision checks.
+struct MegaChip {
+	uint8_t indices[256 * 192];
+	uint32_t pixels[256 * 192];
+	// ARGB, index 0 is transparent
+	uint32_t palette[256];
+	int sprite_width;
+	int sprite_height;
+	uint8_t alpha;
+	uint8_t blend_mode;
+	uint8_t collision_color;
+
+	// Digitised sound, 8 bit unsigned samples read straight out of memory
+	bool sample_playing;
+	bool sample_loop;
+	uint32_t sample_address;
+	uint32_t sample_length;
+	uint32_t sample_rate;
+	double sample_position;
+};
+
+// Flat copy of everything in struct State, used for keyframes
+struct Snapshot {
+	uint8_t memory[0x1000];
+	uint64_t video_buffer[2 * 64 * 2];
+	uint8_t framebuffer_mode;
+	uint8_t plane_mask;
+	uint8_t regs_v[16];
+	uint8_t delay_timer;
+	uint8_t sound_timer;
+	uint8_t keycode;
+	uint16_t pc;
+	uint16_t sp;
+	uint32_t reg_i;
+	uint32_t rng_state;
+	bool end_of_program;
+	bool waiting_for_key;
+};
+
+#ifdef CHIP8_CORE
+// Everything one machine needs in a single object, so the core never touches
+// the heap
+struct CoreMachine {
+	struct State state;
+	// MEMORY_SIZE, the stack lives in here too
+	uint8_t memory[0x1000];
+	// VIDEO_BUFFER_WORDS
+	uint64_t video_buffer[2 * 64 * 2];
 };
 
-bool read_rom(const char* path, uint8_t** data, size_t* size) {
+// Size regression check, boards running the core have 8K of RAM
+_Static_assert(sizeof(struct CoreMachine) <= 8192, "The core build no longer fits in 8K of RAM");
+
+static struct CoreMachine core_machine;
+#else
+bool read_rom(const char* path, uint8_t** data, size_t* size, size_t max_size) {
 	FILE* file = NULL;
 	
 	if (fopen_s(&file, path, "rb") != 0) {
@@ -66,7 +297,7 @@ bool read_rom(const char* path, uint8_t** data, size_t* size) {
 		return false;
 	}
 
-	if (*size >= MEMORY_SIZE - PROGRAM_START) {
+	if (*size >= max_size) {
 		fprintf(stderr, "Program %s is too big to load into memory\n", path);
 		fclose(file);
 		return false;
@@ -94,22 +325,93 @@ bool read_rom(const char* path, uint8_t** data, size_t* size) {
 	return true;
 }
 
+#endif
+
+// Hi-res CHIP-8 programs all start by jumping over the 64x64 setup code.
+// That stub is for the original interpreter, the program proper starts at
+// HIRES_START.
+void state_detect_framebuffer(struct State* state, size_t size) {
+	if (size >= 2 && state->memory[PROGRAM_START] == 0x12 && state->memory[PROGRAM_START + 1] == 0x60) {
+		state->framebuffer_mode = FRAMEBUFFER_64X64;
+		state->pc = HIRES_START;
+	}
+}
+
+// Copies an already read ROM image into memory. name is only for errors.
+bool load_program(struct State* state, const uint8_t* data, size_t size, const char* name) {
+#ifdef CHIP8_CORE
+	if (PROGRAM_START + size > state->memory_size) {
+		fprintf(stderr, "Program %s is too big to load into memory\n", name);
+		return false;
+	}
+#else
+	// Anything too big for a normal CHIP-8 is assumed to be a MegaChip ROM
+	if (PROGRAM_START + size > state->memory_size) {
+		uint8_t* memory = realloc(state->memory, MEGACHIP_MEMORY_SIZE);
+
+		if (memory == NULL) {
+			fprintf(stderr, "Failed to allocate MegaChip memory for %s\n", name);
+			return false;
+		}
+
+		memset(&memory[state->memory_size], 0, MEGACHIP_MEMORY_SIZE - state->memory_size);
+
+		state->memory = memory;
+		state->memory_size = MEGACHIP_MEMORY_SIZE;
+	}
+#endif
+
+	memcpy(&state->memory[PROGRAM_START], data, size);
+	state_detect_framebuffer(state, size);
+
+	return true;
+}
+
+#ifdef CHIP8_CORE
+// Straight into memory, there's nowhere else to put it
+bool load_rom(struct State* state, const char* path) {
+	// Plain fopen, fopen_s is MSVC only and the core has to build anywhere
+	FILE* file = fopen(path, "rb");
+
+	if (file == NULL) {
+		fprintf(stderr, "Failed to open ROM file %s\n", path);
+		return false;
+	}
+
+	size_t size = fread(&state->memory[PROGRAM_START], 1, state->memory_size - PROGRAM_START, file);
+	bool too_big = fgetc(file) != EOF;
+
+	fclose(file);
+
+	if (size == 0 || too_big) {
+		fprintf(stderr, "Program %s is empty or too big to load into memory\n", path);
+		return false;
+	}
+
+	state_detect_framebuffer(state, size);
+
+	return true;
+}
+#else
 bool load_rom(struct State* state, const char* path) {
 	uint8_t* data = NULL;
 	size_t size = 0;
 	
-	if (read_rom(path, &data, &size) == false) {
+	if (read_rom(path, &data, &size, MEGACHIP_MEMORY_SIZE - PROGRAM_START) == false) {
 		return false;
 	}
 
-	memcpy(&state->memory[PROGRAM_START], data, size);
+	bool loaded = load_program(state, data, size, path);
 
 	free(data);
 
-	return true;
+	return loaded;
 }
+#endif
 
-bool init_sdl(SDL_Window** window, SDL_Renderer** renderer, SDL_Texture** texture, SDL_AudioDeviceID* audio_device) {
+#ifndef CHIP8_CORE
+// callback is NULL to queue audio, or pulls samples on SDL's audio thread
+bool init_sdl(SDL_Window** window, SDL_Renderer** renderer, SDL_AudioDeviceID* audio_device, SDL_AudioCallback callback, void* userdata) {
 	if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
 		fprintf(stderr, "Failed to initialise SDL: %s\n", SDL_GetError());
 		return false;
@@ -138,19 +440,6 @@ bool init_sdl(SDL_Window** window, SDL_Renderer** renderer, SDL_Texture** textur
 		return false;
 	}
 
-	*texture = SDL_CreateTexture(
-		*renderer,
-		SDL_PIXELFORMAT_RGBA8888,
-		SDL_TEXTUREACCESS_STREAMING,
-		64,
-		32
-	);
-
-	if (*texture == NULL) {
-		fprintf(stderr, "Failed to create SDL texture: %s\n", SDL_GetError());
-		return false;
-	}
-
 	SDL_AudioSpec audio_spec;
 	SDL_zero(audio_spec);
 
@@ -158,7 +447,8 @@ bool init_sdl(SDL_Window** window, SDL_Renderer** renderer, SDL_Texture** textur
 	audio_spec.format = AUDIO_S16SYS;
 	audio_spec.channels = 1;
 	audio_spec.samples = 1024;
-	audio_spec.callback = NULL;
+	audio_spec.callback = callback;
+	audio_spec.userdata = userdata;
 
 	*audio_device = SDL_OpenAudioDevice(
 		NULL,			// device name,
@@ -176,46 +466,88 @@ bool init_sdl(SDL_Window** window, SDL_Renderer** renderer, SDL_Texture** textur
 	return true;
 }
 
-uint32_t* convert_video_to_sdl(uint64_t* video) {
-	// 4 channels, even though it's only really greyscale
-	uint32_t* result = calloc(64 * 32, sizeof(uint32_t));
+SDL_Texture* create_video_texture(SDL_Renderer* renderer, const struct Framebuffer* framebuffer) {
+	SDL_Texture* texture = SDL_CreateTexture(
+		renderer,
+		SDL_PIXELFORMAT_RGBA8888,
+		SDL_TEXTUREACCESS_STREAMING,
+		framebuffer->width,
+		framebuffer->height
+	);
 
-	if (result == NULL) {
-		fprintf(stderr, "Failed to allocate video buffer when converting.\n");
-		return NULL;
+	if (texture == NULL) {
+		fprintf(stderr, "Failed to create SDL texture: %s\n", SDL_GetError());
 	}
-	
-	for (int y = 0; y < 32; y++) {
-		uint64_t row = video[y];
 
-		for (int x = 0; x < 64; x++) {
-			uint64_t mask = (1ULL << 63) >> x;
+	return texture;
+}
+
+// Geometry is passed as constants by the wrappers below so each one compiles
+// down to a loop with fixed bounds and no plane handling when there is one plane.
+// Writes colours to result, or PLANE_COLORS indices to indices if result is NULL.
+static FORCE_INLINE void convert_video_geometry(const uint64_t* video, uint32_t* result, uint8_t* indices,
+	const int width, const int height, const int words, const int planes) {
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			uint64_t mask = (1ULL << 63) >> (x % 64);
+			int color = 0;
+
+			for (int plane = 0; plane < planes; plane++) {
+				uint64_t row = video[(plane * height + y) * words + x / 64];
+
+				if ((row & mask) == mask) {
+					color |= 1 << plane;
+				}
+			}
 
-			if ((row & mask) == mask) {
-				result[y * 64 + x] = 0xFFFFFFFF;
+			if (result != NULL) {
+				result[y * width + x] = PLANE_COLORS[color];
+			}
+			else {
+				indices[y * width + x] = color;
 			}
 		}
 	}
-
-	return result;
 }
 
-struct State* state_init() {
-	struct State* state = malloc(sizeof(struct State));
+// result needs room for width * height pixels. 4 channels, even though it's
+// only really greyscale.
+void convert_video_to_sdl(const struct Framebuffer* framebuffer, uint8_t mode, const uint64_t* video, uint32_t* result) {
+	switch (mode) {
+	case FRAMEBUFFER_64X32: convert_video_geometry(video, result, NULL, 64, 32, 1, 1); break;
+	case FRAMEBUFFER_64X64: convert_video_geometry(video, result, NULL, 64, 64, 1, 1); break;
+	case FRAMEBUFFER_128X64: convert_video_geometry(video, result, NULL, 128, 64, 2, 1); break;
+	case FRAMEBUFFER_XO_64X32: convert_video_geometry(video, result, NULL, 64, 32, 1, 2); break;
+	case FRAMEBUFFER_XO_128X64: convert_video_geometry(video, result, NULL, 128, 64, 2, 2); break;
 
-	if (state == NULL) {
-		fprintf(stderr, "Failed to allocate struct state.\n");
-		return NULL;
+	default:
+		convert_video_geometry(video, result, NULL, framebuffer->width, framebuffer->height,
+			framebuffer->words_per_row, framebuffer->planes);
+		break;
 	}
+}
 
-	// All 8 bit -> size of 1
-	state->memory = calloc(MEMORY_SIZE, 1);
+// One byte per pixel, a quarter of what convert_video_to_sdl writes
+void convert_video_to_indices(const struct Framebuffer* framebuffer, uint8_t mode, const uint64_t* video, uint8_t* indices) {
+	switch (mode) {
+	case FRAMEBUFFER_64X32: convert_video_geometry(video, NULL, indices, 64, 32, 1, 1); break;
+	case FRAMEBUFFER_64X64: convert_video_geometry(video, NULL, indices, 64, 64, 1, 1); break;
+	case FRAMEBUFFER_128X64: convert_video_geometry(video, NULL, indices, 128, 64, 2, 1); break;
+	case FRAMEBUFFER_XO_64X32: convert_video_geometry(video, NULL, indices, 64, 32, 1, 2); break;
+	case FRAMEBUFFER_XO_128X64: convert_video_geometry(video, NULL, indices, 128, 64, 2, 2); break;
 
-	if (state->memory == NULL) {
-		fprintf(stderr, "Failed to allocate state memory buffer\n");
-		return NULL;
+	default:
+		convert_video_geometry(video, NULL, indices, framebuffer->width, framebuffer->height,
+			framebuffer->words_per_row, framebuffer->planes);
+		break;
 	}
+}
 
+#endif
+
+// Back to power-on, keeping the allocations
+void state_reset(struct State* state) {
+	memset(state->memory, 0, state->memory_size);
 	memcpy(&state->memory[FONT_START], &FONTS, sizeof(FONTS));
 
 	memset(state->regs_v, 0, sizeof(state->regs_v));
@@ -229,20 +561,92 @@ struct State* state_init() {
 	state->sp = STACK_START;
 	state->reg_i = 0;
 
-	// For fun, use malloc
-	state->video_buffer = calloc(32, sizeof(uint64_t));
+	memset(state->video_buffer, 0, sizeof(uint64_t) * VIDEO_BUFFER_WORDS);
+	state->framebuffer_mode = FRAMEBUFFER_64X32;
+	state->plane_mask = 0x1;
 
 	state->end_of_program = false;
 	state->waiting_for_key = false;
 
+	// Any non-zero seed works for xorshift
+	state->rng_state = 0x2545F491;
+	state->cycles = 0;
+	state->unknown_opcodes = 0;
+
+	state->megachip_mode = false;
+#ifndef CHIP8_CORE
+	free(state->megachip);
+#endif
+	state->megachip = NULL;
+}
+
+#ifdef CHIP8_CORE
+// There's only the one machine
+struct State* state_init() {
+	struct State* state = &core_machine.state;
+
+	state->memory = core_machine.memory;
+	state->memory_size = sizeof(core_machine.memory);
+	state->video_buffer = core_machine.video_buffer;
+	state->megachip = NULL;
+	state->coverage = NULL;
+	state->latency = NULL;
+	state->host_calls = NULL;
+	state->decode_cache = NULL;
+
+	state_reset(state);
+
+	return state;
+}
+
+void state_destroy(struct State* state) {
+	(void)state;
+}
+#else
+struct State* state_init() {
+	struct State* state = malloc(sizeof(struct State));
+
+	if (state == NULL) {
+		fprintf(stderr, "Failed to allocate struct state.\n");
+		return NULL;
+	}
+
+	// All 8 bit -> size of 1
+	state->memory = calloc(MEMORY_SIZE, 1);
+
+	if (state->memory == NULL) {
+		fprintf(stderr, "Failed to allocate state memory buffer\n");
+		return NULL;
+	}
+
+	state->memory_size = MEMORY_SIZE;
+
+	// For fun, use malloc
+	state->video_buffer = calloc(VIDEO_BUFFER_WORDS, sizeof(uint64_t));
+
+	if (state->video_buffer == NULL) {
+		fprintf(stderr, "Failed to allocate state video buffer\n");
+		return NULL;
+	}
+
+	state->megachip = NULL;
+	state->coverage = NULL;
+	state->latency = NULL;
+	state->host_calls = NULL;
+	state->decode_cache = NULL;
+
+	state_reset(state);
+
 	return state;
 }
 
 void state_destroy(struct State* state) {
 	free(state->memory);
 	free(state->video_buffer);
+	free(state->megachip);
 	free(state);
 }
+#endif
 
 void state_push_to_stack(struct State* state, uint16_t value) {
 	// Flip endianness
@@ -263,39 +667,154 @@ uint16_t state_pop_from_stack(struct State* state) {
 	return address;
 }
 
+void state_save(const struct State* state, struct Snapshot* snapshot) {
+	// Zero padding between the small fields too, so snapshots can be compared
+	// and hashed bytewise. The arrays are overwritten anyway.
+	size_t fields = offsetof(struct Snapshot, framebuffer_mode);
+	memset((uint8_t*)snapshot + fields, 0, sizeof(struct Snapshot) - fields);
+
+	memcpy(snapshot->memory, state->memory, sizeof(snapshot->memory));
+	memcpy(snapshot->video_buffer, state->video_buffer, sizeof(snapshot->video_buffer));
+	snapshot->framebuffer_mode = state->framebuffer_mode;
+	snapshot->plane_mask = state->plane_mask;
+	memcpy(snapshot->regs_v, state->regs_v, sizeof(snapshot->regs_v));
+
+	snapshot->delay_timer = state->delay_timer;
+	snapshot->sound_timer = state->sound_timer;
+	snapshot->keycode = state->keycode;
+	snapshot->pc = state->pc;
+	snapshot->sp = state->sp;
+	snapshot->reg_i = state->reg_i;
+	snapshot->rng_state = state->rng_state;
+	snapshot->end_of_program = state->end_of_program;
+	snapshot->waiting_for_key = state->waiting_for_key;
+}
+
+void state_load(struct State* state, const struct Snapshot* snapshot) {
+	memcpy(state->memory, snapshot->memory, sizeof(snapshot->memory));
+	memcpy(state->video_buffer, snapshot->video_buffer, sizeof(snapshot->video_buffer));
+	state->framebuffer_mode = snapshot->framebuffer_mode;
+	state->plane_mask = snapshot->plane_mask;
+	memcpy(state->regs_v, snapshot->regs_v, sizeof(snapshot->regs_v));
+
+	state->delay_timer = snapshot->delay_timer;
+	state->sound_timer = snapshot->sound_timer;
+	state->keycode = snapshot->keycode;
+	state->pc = snapshot->pc;
+	state->sp = snapshot->sp;
+	state->reg_i = snapshot->reg_i;
+	state->rng_state = snapshot->rng_state;
+	state->end_of_program = snapshot->end_of_program;
+	state->waiting_for_key = snapshot->waiting_for_key;
+}
+
+uint8_t state_random(struct State* state) {
+	// xorshift32
+	uint32_t x = state->rng_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	state->rng_state = x;
+
+	return x >> 24;
+}
+
+const struct Framebuffer* state_framebuffer(const struct State* state) {
+	return &FRAMEBUFFERS[state->framebuffer_mode];
+}
+
+// Switching geometry always starts from a blank screen
+void state_set_framebuffer(struct State* state, uint8_t mode) {
+	state->framebuffer_mode = mode;
+	memset(state->video_buffer, 0, sizeof(uint64_t) * VIDEO_BUFFER_WORDS);
+}
+
 void instruction_clear_video(struct State* state) {
-	memset(state->video_buffer, 0, sizeof(uint64_t) * 32);
+	const struct Framebuffer* framebuffer = state_framebuffer(state);
+	size_t plane_words = framebuffer->height * framebuffer->words_per_row;
+
+	for (int plane = 0; plane < framebuffer->planes; plane++) {
+		if (state->plane_mask & (1 << plane)) {
+			memset(&state->video_buffer[plane * plane_words], 0, sizeof(uint64_t) * plane_words);
+		}
+	}
 }
 
-void instruction_draw_sprite(struct State* state, int regx, int regy, int height) {
+static FORCE_INLINE void draw_sprite_geometry(struct State* state, int regx, int regy, int height,
+	const int width, const int rows, const int words, const int planes) {
 	// Wraps starting position around
-	uint8_t start_x = state->regs_v[regx] % 64;
-	uint8_t start_y = state->regs_v[regy] % 32;
+	int start_x = state->regs_v[regx] % width;
+	int start_y = state->regs_v[regy] % rows;
 
-	state->regs_v[0xF] = 0;
+	// DXY0 is a 16x16 sprite on the SUPER-CHIP display
+	int sprite_bits = 8;
 
-	for (uint8_t row = 0; row < height; row++) {
-		uint8_t y = start_y + row;
+	if (height == 0 && width == 128) {
+		height = 16;
+		sprite_bits = 16;
+	}
 
-		if (y >= 32) {
-			break;
+	int word = start_x / 64;
+	int shift = start_x % 64;
+	uint32_t address = state->reg_i;
+
+	state->regs_v[0xF] = 0;
+
+	// Each selected plane takes the next block of sprite data
+	for (int plane = 0; plane < planes; plane++) {
+		if ((state->plane_mask & (1 << plane)) == 0) {
+			continue;
 		}
 
-		// For each row, progress another byte
-		uint64_t sprite_mask = (uint64_t)state->memory[state->reg_i + row];
-		
-		// Move sprite into place horizontally using bitshift
-		// 55 = 64 - 1 - 8
-		sprite_mask = (sprite_mask << 55) >> start_x;
+		uint64_t* video = &state->video_buffer[plane * rows * words];
 
-		uint64_t row_data = state->video_buffer[y];
+		for (int row = 0; row < height; row++) {
+			int y = start_y + row;
 
-		state->video_buffer[y] = row_data ^ sprite_mask;
-	
-		// Set reg F if any flips occur
-		if ((row_data & sprite_mask) != 0) {
-			state->regs_v[0xF] = 1;
+			if (y >= rows) {
+				break;
+			}
+
+			// For each row, progress another byte (or two)
+			const uint8_t* data = &state->memory[address + row * sprite_bits / 8];
+			uint64_t sprite_mask = sprite_bits == 16 ? (uint64_t)(data[0] << 8 | data[1]) : data[0];
+
+			// Left align, then move into place horizontally. Anything past the right edge is clipped.
+			sprite_mask <<= 64 - sprite_bits;
+
+			uint64_t* line = &video[y * words];
+			uint64_t first = sprite_mask >> shift;
+
+			// Set reg F if any flips occur
+			if ((line[word] & first) != 0) {
+				state->regs_v[0xF] = 1;
+			}
+
+			line[word] ^= first;
+
+			if (words > 1 && shift != 0 && word + 1 < words) {
+				uint64_t second = sprite_mask << (64 - shift);
+
+				if ((line[word + 1] & second) != 0) {
+					state->regs_v[0xF] = 1;
+				}
+
+				line[word + 1] ^= second;
+			}
 		}
+
+		address += height * sprite_bits / 8;
+	}
+}
+
+void instruction_draw_sprite(struct State* state, int regx, int regy, int height) {
+	switch (state->framebuffer_mode) {
+	case FRAMEBUFFER_64X32: draw_sprite_geometry(state, regx, regy, height, 64, 32, 1, 1); break;
+	case FRAMEBUFFER_64X64: draw_sprite_geometry(state, regx, regy, height, 64, 64, 1, 1); break;
+	case FRAMEBUFFER_128X64: draw_sprite_geometry(state, regx, regy, height, 128, 64, 2, 1); break;
+	case FRAMEBUFFER_XO_64X32: draw_sprite_geometry(state, regx, regy, height, 64, 32, 1, 2); break;
+	case FRAMEBUFFER_XO_128X64: draw_sprite_geometry(state, regx, regy, height, 128, 64, 2, 2); break;
+	default: break;
 	}
 }
 
@@ -305,253 +824,7646 @@ void instruction_decimal_digits(struct State* state, uint8_t value) {
 	state->memory[state->reg_i + 2] = value % 10;			// ones
 }
 
-// TODO: Annonate instructions
-void state_step(struct State* state) {
-	// Reached end of program, or there are less than 2 bytes to read
-	if (state->pc >= MEMORY_SIZE - 1) {
-		state->end_of_program;
-		return;
-	}
+#ifdef CHIP8_CORE
+// No MegaChip on the core build, it needs 16MB of memory
+bool instruction_megachip(struct State* state, uint16_t opcode) {
+	(void)state;
+	(void)opcode;
+	return false;
+}
 
-	uint16_t opcode = state->memory[state->pc] << 8 | state->memory[state->pc + 1];
+void instruction_clear_megachip(struct State* state) {
+	(void)state;
+}
 
-	uint8_t nibble1 = opcode >> 12;
-	uint8_t nibble2 = (opcode & 0xF00) >> 8;
-	uint8_t nibble3 = (opcode & 0xF0) >> 4;
-	uint8_t nibble4 = opcode & 0xF;
-	uint8_t nn = opcode & 0xFF;
-	uint16_t nnn = opcode & 0xFFF;
+void instruction_draw_megachip_sprite(struct State* state, int regx, int regy) {
+	(void)state;
+	(void)regx;
+	(void)regy;
+}
+#else
+uint32_t megachip_blend_pixel(uint32_t src, uint32_t dst, uint8_t mode) {
+	if (mode == BLEND_NORMAL) {
+		return src;
+	}
 
-	// printf("PC: 0x%04X OP: 0x%04X\n", state->pc, opcode);
+	uint32_t result = 0xFF000000;
+
+	// Colour channels only, the display itself is opaque
+	for (int shift = 0; shift < 24; shift += 8) {
+		uint32_t s = (src >> shift) & 0xFF;
+		uint32_t d = (dst >> shift) & 0xFF;
+		uint32_t c;
+
+		switch (mode) {
+		case BLEND_25: c = (s + d * 3) >> 2; break;
+		case BLEND_50: c = (s + d) >> 1; break;
+		case BLEND_75: c = (s * 3 + d) >> 2; break;
+		case BLEND_ADD: c = s + d > 0xFF ? 0xFF : s + d; break;
+		case BLEND_MULTIPLY: c = (s * d + 0xFF) >> 8; break;
+		default: c = s; break;
+		}
 
-	bool should_step = true;
+		result |= c << shift;
+	}
 
-	switch (nibble1) {
-	case 0x0:
-		switch (opcode) {
-		case 0x00E0:
-			instruction_clear_video(state);
-			break;
+	return result;
+}
 
-		case 0x00EE:
-			state->pc = state_pop_from_stack(state);
-			should_step = false;
-			break;
+#ifdef HAVE_SSE2
+// Same maths as megachip_blend_pixel, on four pixels at once
+__m128i megachip_blend_sse2(__m128i src, __m128i dst, uint8_t mode) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i opaque = _mm_set1_epi32(0xFF000000);
 
-		default:
-			printf("TODO: Call.\n");
-			break;
-		}
+	if (mode == BLEND_NORMAL) {
+		return src;
+	}
 
-		break;
+	if (mode == BLEND_ADD) {
+		return _mm_or_si128(_mm_adds_epu8(src, dst), opaque);
+	}
 
-	case 0x1:
-		state->pc = nnn;
-		should_step = false;
+	// Widen to 16 bits per channel to keep the intermediate products
+	__m128i s_lo = _mm_unpacklo_epi8(src, zero);
+	__m128i s_hi = _mm_unpackhi_epi8(src, zero);
+	__m128i d_lo = _mm_unpacklo_epi8(dst, zero);
+	__m128i d_hi = _mm_unpackhi_epi8(dst, zero);
+	__m128i r_lo;
+	__m128i r_hi;
+
+	switch (mode) {
+	case BLEND_25:
+		r_lo = _mm_srli_epi16(_mm_add_epi16(s_lo, _mm_add_epi16(d_lo, _mm_slli_epi16(d_lo, 1))), 2);
+		r_hi = _mm_srli_epi16(_mm_add_epi16(s_hi, _mm_add_epi16(d_hi, _mm_slli_epi16(d_hi, 1))), 2);
 		break;
 
-	case 0x2:
-		// Push the counter for the proceeding instruction
-		state_push_to_stack(state, state->pc + 0x2);
-		state->pc = nnn;
-		should_step = false;
-
+	case BLEND_50:
+		r_lo = _mm_srli_epi16(_mm_add_epi16(s_lo, d_lo), 1);
+		r_hi = _mm_srli_epi16(_mm_add_epi16(s_hi, d_hi), 1);
 		break;
 
-	case 0x3:
-		if (state->regs_v[nibble2] == nn) {
-			state->pc += 4;
-			should_step = false;
-		}
+	case BLEND_75:
+		r_lo = _mm_srli_epi16(_mm_add_epi16(d_lo, _mm_add_epi16(s_lo, _mm_slli_epi16(s_lo, 1))), 2);
+		r_hi = _mm_srli_epi16(_mm_add_epi16(d_hi, _mm_add_epi16(s_hi, _mm_slli_epi16(s_hi, 1))), 2);
+		break;
 
+	case BLEND_MULTIPLY: {
+		const __m128i round = _mm_set1_epi16(0xFF);
+		r_lo = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(s_lo, d_lo), round), 8);
+		r_hi = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(s_hi, d_hi), round), 8);
 		break;
+	}
 
-	case 0x4:
-		if (state->regs_v[nibble2] != nn) {
-			state->pc += 4;
-			should_step = false;
-		}
+	default:
+		return src;
+	}
 
-		break;
+	return _mm_or_si128(_mm_packus_epi16(r_lo, r_hi), opaque);
+}
+#endif
 
-	case 0x5:
-		if (state->regs_v[nibble2] == state->regs_v[nibble3]) {
-			state->pc += 4;
-			should_step = false;
+struct MegaChip* state_megachip(struct State* state) {
+	if (state->megachip == NULL) {
+		state->megachip = calloc(1, sizeof(struct MegaChip));
+
+		if (state->megachip == NULL) {
+			fprintf(stderr, "Failed to allocate MegaChip display.\n");
+			return NULL;
 		}
 
-		break;
+		state->megachip->sprite_width = 256;
+		state->megachip->sprite_height = 256;
+		state->megachip->alpha = 0xFF;
+	}
 
-	case 0x6:
-		state->regs_v[nibble2] = nn;
-		break;
+	return state->megachip;
+}
 
-	case 0x7:
-		state->regs_v[nibble2] += nn;
-		break;
+void instruction_clear_megachip(struct State* state) {
+	struct MegaChip* megachip = state->megachip;
 
-	case 0x8:
-		switch (nibble4) {
-		case 0x0:
-			state->regs_v[nibble2] = state->regs_v[nibble3];
-			break;
+	memset(megachip->indices, 0, sizeof(megachip->indices));
 
-		case 0x1:
-			state->regs_v[nibble2] |= state->regs_v[nibble3];
-			break;
+	// Index 0 might have been given a colour by LDPAL
+	for (int i = 0; i < MEGACHIP_WIDTH * MEGACHIP_HEIGHT; i++) {
+		megachip->pixels[i] = megachip->palette[0] | 0xFF000000;
+	}
+}
 
-		case 0x2:
-			state->regs_v[nibble2] &= state->regs_v[nibble3];
-			break;
+// Blends one clipped row of sprite_width palette indices into the display.
+// Returns true if any opaque pixel landed on the collision colour.
+bool megachip_draw_row(struct MegaChip* megachip, const uint8_t* sprite, int count, int offset) {
+	uint8_t* indices = &megachip->indices[offset];
+	uint32_t* pixels = &megachip->pixels[offset];
+	const uint32_t* palette = megachip->palette;
+	uint8_t mode = megachip->blend_mode;
+	bool collision = false;
+	int x = 0;
+
+#ifdef HAVE_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i collision_color = _mm_set1_epi32(megachip->collision_color);
+
+	for (; x + 4 <= count; x += 4) {
+		uint32_t packed;
+		memcpy(&packed, &sprite[x], sizeof(packed));
+
+		// Fully transparent runs are common, skip them without touching the display
+		if (packed == 0) {
+			continue;
+		}
 
-		case 0x3:
-			state->regs_v[nibble2] ^= state->regs_v[nibble3];
-			break;
+		__m128i index = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+		__m128i opaque = _mm_xor_si128(_mm_cmpeq_epi32(index, zero), _mm_set1_epi32(-1));
 
-		case 0x4:
-			// Carry
-			state->regs_v[0xF] = state->regs_v[nibble2] > state->regs_v[nibble2] + state->regs_v[nibble3];
-			state->regs_v[nibble2] += state->regs_v[nibble3];
+		uint32_t old_packed;
+		memcpy(&old_packed, &indices[x], sizeof(old_packed));
+		__m128i old_index = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(old_packed), zero), zero);
 
-			break;
+		if (_mm_movemask_epi8(_mm_and_si128(opaque, _mm_cmpeq_epi32(old_index, collision_color))) != 0) {
+			collision = true;
+		}
 
-		case 0x5:
-			// Carry
-			state->regs_v[0xF] = state->regs_v[nibble2] < state->regs_v[nibble2] - state->regs_v[nibble3];
-			state->regs_v[nibble2] -= state->regs_v[nibble3];
+		__m128i src = _mm_set_epi32(palette[sprite[x + 3]], palette[sprite[x + 2]], palette[sprite[x + 1]], palette[sprite[x]]);
+		__m128i dst = _mm_loadu_si128((const __m128i*)&pixels[x]);
+		__m128i blended = megachip_blend_sse2(src, dst, mode);
 
-			break;
+		_mm_storeu_si128((__m128i*)&pixels[x], _mm_or_si128(_mm_and_si128(opaque, blended), _mm_andnot_si128(opaque, dst)));
 
-		case 0x6:
-			state->regs_v[0xF] = state->regs_v[nibble2] & 0x1;
-			state->regs_v[nibble2] >>= 1;
-			break;
+		// Byte select for the indices: keep the old one where the sprite is transparent
+		__m128i byte_opaque = _mm_xor_si128(_mm_cmpeq_epi8(_mm_cvtsi32_si128(packed), zero), _mm_set1_epi32(-1));
+		__m128i new_indices = _mm_or_si128(
+			_mm_and_si128(byte_opaque, _mm_cvtsi32_si128(packed)),
+			_mm_andnot_si128(byte_opaque, _mm_cvtsi32_si128(old_packed)));
+		uint32_t result = (uint32_t)_mm_cvtsi128_si32(new_indices);
+		memcpy(&indices[x], &result, sizeof(result));
+	}
+#endif
 
-		case 0x7:
-			// Carry
-			// Carry
-			state->regs_v[0xF] = state->regs_v[nibble3] < state->regs_v[nibble3] - state->regs_v[nibble2];
-			state->regs_v[nibble2] = state->regs_v[nibble3] - state->regs_v[nibble2];
+	for (; x < count; x++) {
+		uint8_t index = sprite[x];
 
-			break;
+		if (index == 0) {
+			continue;
+		}
 
-		case 0xE:
-			state->regs_v[0xF] = state->regs_v[nibble2] >> 7;
-			state->regs_v[nibble2] <<= 1;
+		if (indices[x] == megachip->collision_color) {
+			collision = true;
+		}
+
+		indices[x] = index;
+		pixels[x] = megachip_blend_pixel(palette[index], pixels[x], mode);
+	}
+
+	return collision;
+}
+
+void instruction_draw_megachip_sprite(struct State* state, int regx, int regy) {
+	struct MegaChip* megachip = state->megachip;
+
+	int start_x = state->regs_v[regx];
+	int start_y = state->regs_v[regy];
+	int width = megachip->sprite_width;
+	int height = megachip->sprite_height;
+
+	state->regs_v[0xF] = 0;
+
+	// Clipped, not wrapped
+	int count = width;
+
+	if (start_x + count > MEGACHIP_WIDTH) {
+		count = MEGACHIP_WIDTH - start_x;
+	}
+
+	for (int row = 0; row < height; row++) {
+		int y = start_y + row;
+
+		if (y >= MEGACHIP_HEIGHT) {
 			break;
+		}
 
-		default: 
-			printf("Unknown 0x8 ending 0x%04X\n", opcode);
+		size_t address = state->reg_i + (size_t)row * width;
+
+		if (address + count > state->memory_size) {
 			break;
 		}
+
+		if (megachip_draw_row(megachip, &state->memory[address], count, y * MEGACHIP_WIDTH + start_x)) {
+			state->regs_v[0xF] = 1;
+		}
+	}
+}
+
+// Mixes the current digitised sound into count samples at AUDIO_SAMPLE_RATE
+void megachip_mix_audio(struct State* state, int16_t* samples, int count) {
+	struct MegaChip* megachip = state->megachip;
+
+	for (int i = 0; i < count; i++) {
+		if (megachip == NULL || megachip->sample_playing == false) {
+			samples[i] = 0;
+			continue;
+		}
+
+		uint32_t position = (uint32_t)megachip->sample_position;
+		uint8_t value = state->memory[(megachip->sample_address + position) % state->memory_size];
+
+		samples[i] = ((int16_t)value - 128) << 8;
+
+		megachip->sample_position += (double)megachip->sample_rate / AUDIO_SAMPLE_RATE;
+
+		if (megachip->sample_position >= megachip->sample_length) {
+			if (megachip->sample_loop) {
+				megachip->sample_position -= megachip->sample_length;
+			}
+			else {
+				megachip->sample_playing = false;
+			}
+		}
+	}
+}
+
+// 0x0010 - 0x09NN. Returns false if the opcode isn't a MegaChip one.
+bool instruction_megachip(struct State* state, uint16_t opcode) {
+	uint8_t nn = opcode & 0xFF;
+
+	if (opcode == 0x0011) {
+		if (state_megachip(state) == NULL) {
+			return false;
+		}
+
+		state->megachip_mode = true;
+		instruction_clear_megachip(state);
+		return true;
+	}
+
+	if (state->megachip_mode == false) {
+		return false;
+	}
+
+	struct MegaChip* megachip = state->megachip;
+
+	switch (opcode >> 8) {
+	case 0x00:
+		if (opcode != 0x0010) {
+			return false;
+		}
+
+		state->megachip_mode = false;
+		megachip->sample_playing = false;
 		break;
 
-	case 0x9:
-		if (state->regs_v[nibble2] != state->regs_v[nibble3]) {
-			state->pc += 4;
-			should_step = false;
+	case 0x01: {
+		// LDHI: I = NN NNNN, the low 16 bits are the following word
+		uint32_t low = state->memory[(state->pc + 2) % state->memory_size] << 8 | state->memory[(state->pc + 3) % state->memory_size];
+		state->reg_i = ((uint32_t)nn << 16 | low) & (state->memory_size - 1);
+		state->pc += 2;
+		break;
+	}
+
+	case 0x02:
+		// LDPAL: NN ARGB colours from I, into palette entries 1 onwards
+		for (int i = 0; i < nn && i < 255; i++) {
+			const uint8_t* color = &state->memory[(state->reg_i + i * 4) % state->memory_size];
+			megachip->palette[i + 1] = (uint32_t)color[0] << 24 | color[1] << 16 | color[2] << 8 | color[3];
 		}
 
 		break;
 
-	case 0xA:
-		state->reg_i = nnn;
+	case 0x03:
+		megachip->sprite_width = nn == 0 ? 256 : nn;
 		break;
 
-	case 0xC:
-		state->regs_v[nibble2] = rand() & nn;
+	case 0x04:
+		megachip->sprite_height = nn == 0 ? 256 : nn;
 		break;
 
-	case 0xD:
-		instruction_draw_sprite(state, nibble2, nibble3, nibble4);
+	case 0x05:
+		megachip->alpha = nn;
+		break;
+
+	case 0x06: {
+		// DIGISND: header at I is a 16 bit rate and 24 bit length, data follows
+		uint8_t header[5];
+
+		for (int i = 0; i < 5; i++) {
+			header[i] = state->memory[(state->reg_i + i) % state->memory_size];
+		}
+
+		megachip->sample_rate = header[0] << 8 | header[1];
+		megachip->sample_length = (uint32_t)header[2] << 16 | header[3] << 8 | header[4];
+		megachip->sample_address = (state->reg_i + 6) % state->memory_size;
+		megachip->sample_position = 0;
+		megachip->sample_loop = (nn & 0xF) == 0;
+		megachip->sample_playing = megachip->sample_length > 0;
+		break;
+	}
+
+	case 0x07:
+		megachip->sample_playing = false;
+		break;
+
+	case 0x08:
+		megachip->blend_mode = nn & 0xF;
+		break;
+
+	case 0x09:
+		megachip->collision_color = nn;
 		break;
 
+	default:
+		return false;
+	}
+
+	return true;
+}
+#endif
+
+// A ROM stuck on one would otherwise flood the terminal
+void state_unknown_opcode(struct State* state, uint16_t opcode) {
+	if (state->unknown_opcodes++ == 0) {
+		printf("Unknown opcode: 0x%04X at 0x%03X\n", opcode, state->pc);
+	}
+}
+
+enum HostLogKind {
+	HOST_LOG_TIMER = 0,
+	HOST_LOG_REGISTERS,
+	HOST_LOG_MARK
+};
+
+struct HostLogEntry {
+	uint64_t cycle;
+	uint16_t pc;
+	uint8_t kind;
+	// Timer number, or how many registers were logged
+	uint8_t n;
+	// Cycles a timer ran for
+	uint64_t elapsed;
+	uint8_t regs_v[16];
+};
+
+// Opt-in 0FNN host calls for instrumenting ROMs from the inside:
+//   0F0N  start cycle timer N
+//   0F1N  stop cycle timer N and log how long it ran
+//   0F2X  log V0 to VX
+//   0F30  log a frame marker
+// Entries go into a ring the frontend drains once a frame.
+struct HostCalls {
+	uint64_t timers[16];
+	struct HostLogEntry log[256];
+	uint32_t head;
+	uint32_t count;
+	uint32_t dropped;
+	// 0F30s over the whole run, for the summary on exit
+	uint32_t marks;
+};
+
+struct HostLogEntry* host_log(struct State* state, uint8_t kind, uint8_t n) {
+	struct HostCalls* host = state->host_calls;
+	uint32_t capacity = sizeof(host->log) / sizeof(host->log[0]);
+
+	if (host->count == capacity) {
+		host->dropped++;
+		return NULL;
+	}
+
+	struct HostLogEntry* entry = &host->log[(host->head + host->count) % capacity];
+	host->count++;
+
+	entry->cycle = state->cycles;
+	entry->pc = state->pc;
+	entry->kind = kind;
+	entry->n = n;
+
+	return entry;
+}
+
+void host_call_timer_start(struct State* state, uint8_t n) {
+	state->host_calls->timers[n] = state->cycles;
+}
+
+void host_call_timer_stop(struct State* state, uint8_t n) {
+	struct HostLogEntry* entry = host_log(state, HOST_LOG_TIMER, n);
+
+	if (entry != NULL) {
+		entry->elapsed = state->cycles - state->host_calls->timers[n];
+	}
+}
+
+void host_call_log_registers(struct State* state, uint8_t n) {
+	struct HostLogEntry* entry = host_log(state, HOST_LOG_REGISTERS, n + 1);
+
+	if (entry != NULL) {
+		memcpy(entry->regs_v, state->regs_v, n + 1);
+	}
+}
+
+// Only 0F30 is a marker, 0F31-0F3F are as unknown as the empty slots
+void host_call_mark(struct State* state, uint8_t n) {
+	if (n != 0) {
+		state_unknown_opcode(state, 0x0F30 | n);
+		return;
+	}
+
+	host_log(state, HOST_LOG_MARK, 0);
+	state->host_calls->marks++;
+}
+
+// Indexed by the third nibble of 0FNN. Empty slots fall through to the old
+// unhandled 0NNN path.
+void (*const HOST_CALLS[16])(struct State* state, uint8_t n) = {
+	host_call_timer_start,
+	host_call_timer_stop,
+	host_call_log_registers,
+	host_call_mark
+};
+
+// 3XNN, 4XNN, 5XY0, 9XY0, EX9E and EXA1
+FORCE_INLINE bool opcode_is_skip(uint16_t opcode) {
+	switch (opcode >> 12) {
+	case 0x3:
+	case 0x4:
+		return true;
+
+	case 0x5:
+	case 0x9:
+		return (opcode & 0xF) == 0;
+
 	case 0xE:
-		switch (nn) {
-		case 0x9E:
-			if (state->keycode == state->regs_v[nibble2]) {
-				state->pc += 4;
-				should_step = false;
-			}
+		return (opcode & 0xFF) == 0x9E || (opcode & 0xFF) == 0xA1;
 
-			break;
+	default:
+		return false;
+	}
+}
 
-		case 0xA1:
-			if (state->keycode != state->regs_v[nibble2]) {
-				state->pc += 4;
-				should_step = false;
+FORCE_INLINE void coverage_mark(uint8_t* coverage, uint16_t pc, uint16_t opcode, uint16_t next_pc) {
+	uint8_t flags = COVERAGE_EXECUTED;
+
+	if (opcode_is_skip(opcode)) {
+		flags |= next_pc == (uint16_t)(pc + 4) ? COVERAGE_TAKEN : COVERAGE_NOT_TAKEN;
+	}
+
+	coverage[pc] |= flags;
+}
+
+// EX9E, EXA1 and FX0A, the first one to run while the traced key is down sees it
+FORCE_INLINE void latency_key_read(struct State* state) {
+	struct LatencyProbe* probe = state->latency;
+
+	if (probe != NULL && probe->stage == LATENCY_APPLIED && state->cycles >= probe->applied_cycle && state->keycode == probe->key) {
+		probe->observed_cycle = state->cycles;
+		probe->stage = LATENCY_OBSERVED;
+	}
+}
+
+FORCE_INLINE bool latency_before_draw(struct State* state) {
+	struct LatencyProbe* probe = state->latency;
+
+	if (probe == NULL || probe->stage != LATENCY_OBSERVED) {
+		return false;
+	}
+
+	memcpy(probe->video_before, state->video_buffer, sizeof(probe->video_before));
+
+	return true;
+}
+
+// Sprites that land off screen or get drawn twice don't count
+FORCE_INLINE void latency_after_draw(struct State* state) {
+	struct LatencyProbe* probe = state->latency;
+
+	if (memcmp(probe->video_before, state->video_buffer, sizeof(probe->video_before)) != 0) {
+		probe->drawn_cycle = state->cycles;
+		probe->stage = LATENCY_DRAWN;
+	}
+}
+
+// TODO: Annonate instructions
+void state_step(struct State* state) {
+	// Reached end of program, or there are less than 2 bytes to read
+	if (state->pc >= state->memory_size - 1) {
+		state->end_of_program;
+		return;
+	}
+
+	uint16_t pc = state->pc;
+	uint16_t opcode = state->memory[state->pc] << 8 | state->memory[state->pc + 1];
+
+	uint8_t nibble1 = opcode >> 12;
+	uint8_t nibble2 = (opcode & 0xF00) >> 8;
+	uint8_t nibble3 = (opcode & 0xF0) >> 4;
+	uint8_t nibble4 = opcode & 0xF;
+	uint8_t nn = opcode & 0xFF;
+	uint16_t nnn = opcode & 0xFFF;
+
+	// printf("PC: 0x%04X OP: 0x%04X\n", state->pc, opcode);
+
+	bool should_step = true;
+
+	switch (nibble1) {
+	case 0x0:
+		switch (opcode) {
+		case 0x00E0:
+			if (state->megachip_mode) {
+				instruction_clear_megachip(state);
+			}
+			else {
+				instruction_clear_video(state);
 			}
 
 			break;
 
-		default:
-			printf("Unknown 0xE ending 0x%04X\n", opcode);
+		case 0x00EE:
+			state->pc = state_pop_from_stack(state);
+			should_step = false;
 			break;
-		}
 
-		break;
+		case 0x00FE:
+			// Low res, keeping XO-CHIP planes if they're in use
+			state_set_framebuffer(state, state_framebuffer(state)->planes > 1 ? FRAMEBUFFER_XO_64X32 : FRAMEBUFFER_64X32);
+			break;
 
-	case 0xF:
-		switch (nn) {
-		case 0x07:
-			state->regs_v[nibble2] = state->delay_timer;
+		case 0x00FF:
+			state_set_framebuffer(state, state_framebuffer(state)->planes > 1 ? FRAMEBUFFER_XO_128X64 : FRAMEBUFFER_128X64);
 			break;
 
-		case 0x0A:
-			// If a key is pressed
-			if (state->keycode != 16) {
-				state->regs_v[nibble2] = state->keycode;
+		default:
+			if (state->host_calls != NULL && (opcode & 0xF00) == 0xF00 && HOST_CALLS[nibble3] != NULL) {
+				HOST_CALLS[nibble3](state, nibble4);
 			}
-			else {
-				// Stay still (block)
-				should_step = false;
+			else if (instruction_megachip(state, opcode) == false) {
+				state_unknown_opcode(state, opcode);
 			}
 
 			break;
+		}
 
-		case 0x15:
-			state->delay_timer = state->regs_v[nibble2];
+		break;
+
+	case 0x1:
+		state->pc = nnn;
+		should_step = false;
+		break;
+
+	case 0x2:
+		// Push the counter for the proceeding instruction
+		state_push_to_stack(state, state->pc + 0x2);
+		state->pc = nnn;
+		should_step = false;
+
+		break;
+
+	case 0x3:
+		if (state->regs_v[nibble2] == nn) {
+			state->pc += 4;
+			should_step = false;
+		}
+
+		break;
+
+	case 0x4:
+		if (state->regs_v[nibble2] != nn) {
+			state->pc += 4;
+			should_step = false;
+		}
+
+		break;
+
+	case 0x5:
+		if (state->regs_v[nibble2] == state->regs_v[nibble3]) {
+			state->pc += 4;
+			should_step = false;
+		}
+
+		break;
+
+	case 0x6:
+		state->regs_v[nibble2] = nn;
+		break;
+
+	case 0x7:
+		state->regs_v[nibble2] += nn;
+		break;
+
+	case 0x8:
+		switch (nibble4) {
+		case 0x0:
+			state->regs_v[nibble2] = state->regs_v[nibble3];
+			break;
+
+		case 0x1:
+			state->regs_v[nibble2] |= state->regs_v[nibble3];
+			break;
+
+		case 0x2:
+			state->regs_v[nibble2] &= state->regs_v[nibble3];
+			break;
+
+		case 0x3:
+			state->regs_v[nibble2] ^= state->regs_v[nibble3];
+			break;
+
+		case 0x4:
+			// Carry
+			state->regs_v[0xF] = state->regs_v[nibble2] > state->regs_v[nibble2] + state->regs_v[nibble3];
+			state->regs_v[nibble2] += state->regs_v[nibble3];
+
+			break;
+
+		case 0x5:
+			// Carry
+			state->regs_v[0xF] = state->regs_v[nibble2] < state->regs_v[nibble2] - state->regs_v[nibble3];
+			state->regs_v[nibble2] -= state->regs_v[nibble3];
+
+			break;
+
+		case 0x6:
+			state->regs_v[0xF] = state->regs_v[nibble2] & 0x1;
+			state->regs_v[nibble2] >>= 1;
+			break;
+
+		case 0x7:
+			// Carry
+			// Carry
+			state->regs_v[0xF] = state->regs_v[nibble3] < state->regs_v[nibble3] - state->regs_v[nibble2];
+			state->regs_v[nibble2] = state->regs_v[nibble3] - state->regs_v[nibble2];
+
+			break;
+
+		case 0xE:
+			state->regs_v[0xF] = state->regs_v[nibble2] >> 7;
+			state->regs_v[nibble2] <<= 1;
+			break;
+
+		default: 
+			state_unknown_opcode(state, opcode);
+			break;
+		}
+		break;
+
+	case 0x9:
+		if (state->regs_v[nibble2] != state->regs_v[nibble3]) {
+			state->pc += 4;
+			should_step = false;
+		}
+
+		break;
+
+	case 0xA:
+		state->reg_i = nnn;
+		break;
+
+	case 0xC:
+		state->regs_v[nibble2] = state_random(state) & nn;
+		break;
+
+	case 0xD:
+		if (state->megachip_mode) {
+			instruction_draw_megachip_sprite(state, nibble2, nibble3);
+		}
+		else if (latency_before_draw(state)) {
+			instruction_draw_sprite(state, nibble2, nibble3, nibble4);
+			latency_after_draw(state);
+		}
+		else {
+			instruction_draw_sprite(state, nibble2, nibble3, nibble4);
+		}
+
+		break;
+
+	case 0xE:
+		switch (nn) {
+		case 0x9E:
+			latency_key_read(state);
+
+			if (state->keycode == state->regs_v[nibble2]) {
+				state->pc += 4;
+				should_step = false;
+			}
+
+			break;
+
+		case 0xA1:
+			latency_key_read(state);
+
+			if (state->keycode != state->regs_v[nibble2]) {
+				state->pc += 4;
+				should_step = false;
+			}
+
+			break;
+
+		default:
+			state_unknown_opcode(state, opcode);
+			break;
+		}
+
+		break;
+
+	case 0xF:
+		switch (nn) {
+		case 0x01:
+			// XO-CHIP plane select, switches to the two plane display on first use
+			if (state_framebuffer(state)->planes == 1) {
+				state_set_framebuffer(state, state_framebuffer(state)->width == 128 ? FRAMEBUFFER_XO_128X64 : FRAMEBUFFER_XO_64X32);
+			}
+
+			state->plane_mask = nibble2 & 0x3;
+			break;
+
+		case 0x07:
+			state->regs_v[nibble2] = state->delay_timer;
+			break;
+
+		case 0x0A:
+			latency_key_read(state);
+
+			// If a key is pressed
+			if (state->keycode != 16) {
+				state->regs_v[nibble2] = state->keycode;
+			}
+			else {
+				// Stay still (block)
+				should_step = false;
+			}
+
+			break;
+
+		case 0x15:
+			state->delay_timer = state->regs_v[nibble2];
+			break;
+
+		case 0x18:
+			state->sound_timer = state->regs_v[nibble2];
+			break;
+
+		case 0x1E:
+			state->reg_i += state->regs_v[nibble2];
+			break;
+
+		case 0x29:
+			state->reg_i = FONT_START + state->regs_v[nibble2];
+			break;
+
+		case 0x33:
+			instruction_decimal_digits(state, state->regs_v[nibble2]);
+			break;
+
+		case 0x55:
+			memcpy(&state->memory[state->reg_i], state->regs_v, nibble2 + 1);
+			break;
+
+		case 0x65:
+			memcpy(state->regs_v, &state->memory[state->reg_i], nibble2 + 1);
+			break;
+
+		default: 
+			state_unknown_opcode(state, opcode);
+			break;
+		}
+
+		break;
+
+	default:
+		state_unknown_opcode(state, opcode);
+		break;
+	}
+
+	if (should_step == true) {
+		state->pc += 2;
+	}
+
+	if (state->coverage != NULL) {
+		coverage_mark(state->coverage, pc, opcode, state->pc);
+	}
+
+	state->cycles++;
+}
+
+// Runs one 60Hz frame worth of instructions, applying any key transitions at
+// their cycle, then ticks the timers. input may be NULL.
+void state_frame(struct State* state, const struct FrameInput* input) {
+	int next_input = 0;
+	int input_count = input != NULL ? input->count : 0;
+
+	for (int i = 0; i < CYCLES_PER_FRAME; i++) {
+		while (next_input < input_count && input->cycles[next_input] <= i) {
+			state->keycode = input->keycodes[next_input];
+			next_input++;
+		}
+
+		state_step(state);
+
+		if (state->end_of_program) {
+			break;
+		}
+	}
+
+	if (state->delay_timer > 0) {
+		state->delay_timer -= 1;
+	}
+
+	if (state->sound_timer > 0) {
+		state->sound_timer -= 1;
+	}
+}
+
+// Emulated time, counted in instructions. Events sit in a binary heap on the
+// cycle they fall on, so running is just counting down to the next one.
+const int SCHEDULER_EVENTS = 16;
+
+enum EventType {
+	// Sets keycode to data
+	EVENT_KEY = 0,
+	// The 60Hz delay and sound timer tick, reschedules itself
+	EVENT_TIMERS,
+	// Hands control back to whoever called scheduler_run, with data
+	EVENT_STOP
+};
+
+struct Event {
+	uint64_t cycle;
+	// Events on the same cycle happen in EventType order, so the timers have
+	// ticked before a stop, then in the order they were added
+	uint32_t order;
+	uint8_t type;
+	uint8_t data;
+};
+
+struct Scheduler {
+	struct Event events[16]; // SCHEDULER_EVENTS
+	int count;
+	uint32_t next_order;
+	// Kept here rather than taken from state->cycles, so time still passes
+	// while pc is off the end of memory
+	uint64_t now;
+};
+
+FORCE_INLINE bool event_before(const struct Event* a, const struct Event* b) {
+	if (a->cycle != b->cycle) {
+		return a->cycle < b->cycle;
+	}
+
+	return a->type != b->type ? a->type < b->type : a->order < b->order;
+}
+
+bool scheduler_add(struct Scheduler* scheduler, uint64_t cycle, uint8_t type, uint8_t data) {
+	if (scheduler->count == SCHEDULER_EVENTS) {
+		return false;
+	}
+
+	struct Event event = { cycle, scheduler->next_order++, type, data };
+	int i = scheduler->count++;
+
+	// Sift up
+	while (i > 0 && event_before(&event, &scheduler->events[(i - 1) / 2])) {
+		scheduler->events[i] = scheduler->events[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+
+	scheduler->events[i] = event;
+
+	return true;
+}
+
+struct Event scheduler_pop(struct Scheduler* scheduler) {
+	struct Event first = scheduler->events[0];
+	struct Event last = scheduler->events[--scheduler->count];
+	int i = 0;
+
+	// Sift down
+	for (;;) {
+		int child = i * 2 + 1;
+
+		if (child >= scheduler->count) {
+			break;
+		}
+
+		if (child + 1 < scheduler->count && event_before(&scheduler->events[child + 1], &scheduler->events[child])) {
+			child++;
+		}
+
+		if (event_before(&last, &scheduler->events[child]) == false) {
+			scheduler->events[i] = scheduler->events[child];
+			i = child;
+		}
+		else {
+			break;
+		}
+	}
+
+	scheduler->events[i] = last;
+
+	return first;
+}
+
+void scheduler_init(struct Scheduler* scheduler) {
+	scheduler->count = 0;
+	scheduler->next_order = 0;
+	scheduler->now = 0;
+
+	scheduler_add(scheduler, CYCLES_PER_FRAME, EVENT_TIMERS, 0);
+}
+
+// Runs until an EVENT_STOP comes due and returns its data. There has to be
+// one queued, the timers keep the heap from ever running dry.
+uint8_t scheduler_run(struct State* state, struct Scheduler* scheduler) {
+	for (;;) {
+		while (scheduler->events[0].cycle <= scheduler->now) {
+			struct Event event = scheduler_pop(scheduler);
+
+			switch (event.type) {
+			case EVENT_KEY:
+				state->keycode = event.data;
+				break;
+
+			case EVENT_TIMERS:
+				if (state->delay_timer > 0) {
+					state->delay_timer -= 1;
+				}
+
+				if (state->sound_timer > 0) {
+					state->sound_timer -= 1;
+				}
+
+				scheduler_add(scheduler, event.cycle + CYCLES_PER_FRAME, EVENT_TIMERS, 0);
+				break;
+
+			case EVENT_STOP:
+				return event.data;
+			}
+		}
+
+		uint64_t countdown = scheduler->events[0].cycle - scheduler->now;
+		scheduler->now += countdown;
+
+		// Nothing runs once the program has ended, but time still goes by
+		if (state->end_of_program) {
+			continue;
+		}
+
+		for (; countdown > 0; countdown--) {
+			state_step(state);
+		}
+	}
+}
+
+// state_frame on a scheduler. The scheduler has to start on a frame boundary
+// and only ever be run a frame at a time for the timers to line up.
+void state_frame_scheduled(struct State* state, struct Scheduler* scheduler, const struct FrameInput* input) {
+	int input_count = input != NULL ? input->count : 0;
+
+	for (int i = 0; i < input_count; i++) {
+		// state_frame never gets to those either
+		if (input->cycles[i] < CYCLES_PER_FRAME) {
+			scheduler_add(scheduler, scheduler->now + input->cycles[i], EVENT_KEY, input->keycodes[i]);
+		}
+	}
+
+	scheduler_add(scheduler, scheduler->now + CYCLES_PER_FRAME, EVENT_STOP, 0);
+	scheduler_run(state, scheduler);
+}
+
+#ifndef CHIP8_CORE
+// Queue of timestamped key transitions from SDL, drained one frame at a time
+struct InputQueue {
+	uint32_t timestamps[64];
+	uint8_t keycodes[64];
+	int head;
+	int count;
+};
+
+void input_queue_push(struct InputQueue* queue, uint32_t timestamp, uint8_t keycode) {
+	int capacity = sizeof(queue->keycodes);
+
+	if (queue->count == capacity) {
+		// Way more than a frame can apply, drop the oldest
+		queue->head = (queue->head + 1) % capacity;
+		queue->count--;
+	}
+
+	int tail = (queue->head + queue->count) % capacity;
+
+	queue->timestamps[tail] = timestamp;
+	queue->keycodes[tail] = keycode;
+	queue->count++;
+}
+
+// Moves events into input for a frame emulating [frame_start, frame_end) in
+// SDL ticks, at the cycle each happened. Anything that doesn't fit waits for
+// the next frame, where it lands on cycle 0.
+void input_queue_take_frame(struct InputQueue* queue, uint32_t frame_start, uint32_t frame_end, struct FrameInput* input) {
+	int capacity = sizeof(queue->keycodes);
+	int max_inputs = sizeof(input->keycodes);
+	uint32_t duration = frame_end > frame_start ? frame_end - frame_start : 1;
+
+	input->count = 0;
+
+	while (queue->count > 0 && input->count < max_inputs) {
+		uint32_t timestamp = queue->timestamps[queue->head];
+		int cycle = 0;
+
+		if (timestamp > frame_start) {
+			cycle = (int)((uint64_t)(timestamp - frame_start) * CYCLES_PER_FRAME / duration);
+		}
+
+		if (cycle >= CYCLES_PER_FRAME) {
+			cycle = CYCLES_PER_FRAME - 1;
+		}
+
+		// Keep them in order even if timestamps aren't
+		if (input->count > 0 && cycle < input->cycles[input->count - 1]) {
+			cycle = input->cycles[input->count - 1];
+		}
+
+		input->cycles[input->count] = cycle;
+		input->keycodes[input->count] = queue->keycodes[queue->head];
+		input->count++;
+
+		queue->head = (queue->head + 1) % capacity;
+		queue->count--;
+	}
+}
+
+// Recording layout (host byte order):
+//   RecordingHeader
+//   chunk 0: Snapshot, then one FrameInput per frame (up to keyframe_interval)
+//   chunk 1: ...
+//   final Snapshot (state after the last frame)
+//   index: uint64_t offset of each chunk
+//   RecordingFooter
+// Frame F lives in chunk F / keyframe_interval, so seeking never scans the file.
+const char RECORDING_MAGIC[4] = { 'C', '8', 'R', 'C' };
+const char RECORDING_INDEX_MAGIC[4] = { 'C', '8', 'I', 'X' };
+const uint32_t RECORDING_VERSION = 3;
+
+struct RecordingHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t keyframe_interval;
+	uint32_t snapshot_size;
+};
+
+struct RecordingFooter {
+	uint64_t index_offset;
+	uint64_t final_offset;
+	uint32_t keyframe_count;
+	uint32_t frame_count;
+	char magic[4];
+	uint32_t reserved;
+};
+
+struct Recorder {
+	FILE* file;
+	uint64_t offset;
+	uint32_t keyframe_interval;
+	uint32_t frame_count;
+	uint64_t* index;
+	uint32_t index_count;
+	uint32_t index_capacity;
+};
+
+struct MappedFile {
+	const uint8_t* data;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+};
+
+struct Recording {
+	struct MappedFile mapped;
+	uint32_t keyframe_interval;
+	uint32_t keyframe_count;
+	uint32_t frame_count;
+	uint64_t index_offset;
+	uint64_t final_offset;
+};
+
+bool recorder_write(struct Recorder* recorder, const void* data, size_t size) {
+	if (fwrite(data, 1, size, recorder->file) != size) {
+		fprintf(stderr, "Failed to write to recording\n");
+		return false;
+	}
+
+	recorder->offset += size;
+
+	return true;
+}
+
+struct Recorder* recorder_open(const char* path, uint32_t keyframe_interval) {
+	struct Recorder* recorder = calloc(1, sizeof(struct Recorder));
+
+	if (recorder == NULL) {
+		fprintf(stderr, "Failed to allocate recorder.\n");
+		return NULL;
+	}
+
+	if (fopen_s(&recorder->file, path, "wb") != 0) {
+		fprintf(stderr, "Failed to open recording file %s\n", path);
+		free(recorder);
+		return NULL;
+	}
+
+	recorder->keyframe_interval = keyframe_interval > 0 ? keyframe_interval : DEFAULT_KEYFRAME_INTERVAL;
+
+	struct RecordingHeader header;
+	memcpy(header.magic, RECORDING_MAGIC, sizeof(header.magic));
+	header.version = RECORDING_VERSION;
+	header.keyframe_interval = recorder->keyframe_interval;
+	header.snapshot_size = sizeof(struct Snapshot);
+
+	if (recorder_write(recorder, &header, sizeof(header)) == false) {
+		fclose(recorder->file);
+		free(recorder);
+		return NULL;
+	}
+
+	return recorder;
+}
+
+// Call once per frame, before state_frame, with that frame's input
+bool recorder_frame(struct Recorder* recorder, const struct State* state, const struct FrameInput* input) {
+	// Keyframes only hold the classic 4K machine
+	if (state->megachip != NULL || state->memory_size != MEMORY_SIZE) {
+		fprintf(stderr, "Recording MegaChip sessions is not supported\n");
+		return false;
+	}
+
+	if (recorder->frame_count % recorder->keyframe_interval == 0) {
+		if (recorder->index_count == recorder->index_capacity) {
+			uint32_t capacity = recorder->index_capacity > 0 ? recorder->index_capacity * 2 : 64;
+			uint64_t* index = realloc(recorder->index, capacity * sizeof(uint64_t));
+
+			if (index == NULL) {
+				fprintf(stderr, "Failed to grow recording index\n");
+				return false;
+			}
+
+			recorder->index = index;
+			recorder->index_capacity = capacity;
+		}
+
+		recorder->index[recorder->index_count++] = recorder->offset;
+
+		struct Snapshot snapshot;
+		state_save(state, &snapshot);
+
+		if (recorder_write(recorder, &snapshot, sizeof(snapshot)) == false) {
+			return false;
+		}
+	}
+
+	if (recorder_write(recorder, input, sizeof(struct FrameInput)) == false) {
+		return false;
+	}
+
+	recorder->frame_count++;
+
+	return true;
+}
+
+// Writes the final keyframe, index and footer, then frees the recorder
+bool recorder_close(struct Recorder* recorder, const struct State* state) {
+	struct Snapshot snapshot;
+	state_save(state, &snapshot);
+
+	struct RecordingFooter footer;
+	memset(&footer, 0, sizeof(footer));
+	footer.final_offset = recorder->offset;
+
+	bool ok = recorder_write(recorder, &snapshot, sizeof(snapshot));
+
+	footer.index_offset = recorder->offset;
+	footer.keyframe_count = recorder->index_count;
+	footer.frame_count = recorder->frame_count;
+	memcpy(footer.magic, RECORDING_INDEX_MAGIC, sizeof(footer.magic));
+
+	ok = ok && recorder_write(recorder, recorder->index, recorder->index_count * sizeof(uint64_t));
+	ok = ok && recorder_write(recorder, &footer, sizeof(footer));
+
+	if (fclose(recorder->file) != 0) {
+		fprintf(stderr, "Failed to close recording file\n");
+		ok = false;
+	}
+
+	free(recorder->index);
+	free(recorder);
+
+	return ok;
+}
+
+bool map_file(const char* path, struct MappedFile* mapped) {
+	memset(mapped, 0, sizeof(struct MappedFile));
+
+#ifdef _WIN32
+	mapped->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (mapped->file == INVALID_HANDLE_VALUE) {
+		fprintf(stderr, "Failed to open %s\n", path);
+		return false;
+	}
+
+	LARGE_INTEGER size;
+
+	if (GetFileSizeEx(mapped->file, &size) == 0 || size.QuadPart == 0) {
+		fprintf(stderr, "Failed to determine size of %s\n", path);
+		CloseHandle(mapped->file);
+		return false;
+	}
+
+	mapped->mapping = CreateFileMappingA(mapped->file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+	if (mapped->mapping == NULL) {
+		fprintf(stderr, "Failed to map %s\n", path);
+		CloseHandle(mapped->file);
+		return false;
+	}
+
+	mapped->data = MapViewOfFile(mapped->mapping, FILE_MAP_READ, 0, 0, 0);
+	mapped->size = (size_t)size.QuadPart;
+
+	if (mapped->data == NULL) {
+		fprintf(stderr, "Failed to map %s\n", path);
+		CloseHandle(mapped->mapping);
+		CloseHandle(mapped->file);
+		return false;
+	}
+#else
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s\n", path);
+		return false;
+	}
+
+	struct stat info;
+
+	if (fstat(fd, &info) != 0 || info.st_size == 0) {
+		fprintf(stderr, "Failed to determine size of %s\n", path);
+		close(fd);
+		return false;
+	}
+
+	void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	// The mapping keeps its own reference to the file
+	close(fd);
+
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "Failed to map %s\n", path);
+		return false;
+	}
+
+	mapped->data = data;
+	mapped->size = info.st_size;
+#endif
+
+	return true;
+}
+
+void unmap_file(struct MappedFile* mapped) {
+	if (mapped->data == NULL) {
+		return;
+	}
+
+#ifdef _WIN32
+	UnmapViewOfFile(mapped->data);
+	CloseHandle(mapped->mapping);
+	CloseHandle(mapped->file);
+#else
+	munmap((void*)mapped->data, mapped->size);
+#endif
+
+	mapped->data = NULL;
+}
+
+bool recording_read_index(struct Recording* recording, const char* path) {
+	const uint8_t* data = recording->mapped.data;
+	size_t size = recording->mapped.size;
+
+	struct RecordingHeader header;
+	struct RecordingFooter footer;
+
+	if (size < sizeof(header) + sizeof(footer)) {
+		fprintf(stderr, "Recording %s is truncated\n", path);
+		return false;
+	}
+
+	// Copy out rather than cast, nothing in the file is aligned
+	memcpy(&header, data, sizeof(header));
+	memcpy(&footer, data + size - sizeof(footer), sizeof(footer));
+
+	if (memcmp(header.magic, RECORDING_MAGIC, sizeof(header.magic)) != 0 ||
+		memcmp(footer.magic, RECORDING_INDEX_MAGIC, sizeof(footer.magic)) != 0) {
+		fprintf(stderr, "%s is not a recording, or was not closed properly\n", path);
+		return false;
+	}
+
+	if (header.version != RECORDING_VERSION || header.snapshot_size != sizeof(struct Snapshot)) {
+		fprintf(stderr, "Recording %s was made by an incompatible version\n", path);
+		return false;
+	}
+
+	uint64_t index_end = footer.index_offset + (uint64_t)footer.keyframe_count * sizeof(uint64_t);
+
+	if (header.keyframe_interval == 0 ||
+		index_end != size - sizeof(footer) ||
+		footer.final_offset + sizeof(struct Snapshot) > footer.index_offset ||
+		footer.keyframe_count != (footer.frame_count + header.keyframe_interval - 1) / header.keyframe_interval) {
+		fprintf(stderr, "Recording %s has a corrupt index\n", path);
+		return false;
+	}
+
+	for (uint32_t i = 0; i < footer.keyframe_count; i++) {
+		uint64_t offset;
+		memcpy(&offset, data + footer.index_offset + i * sizeof(uint64_t), sizeof(offset));
+
+		uint32_t frames = footer.frame_count - i * header.keyframe_interval;
+
+		if (frames > header.keyframe_interval) {
+			frames = header.keyframe_interval;
+		}
+
+		if (offset < sizeof(header) || offset + sizeof(struct Snapshot) + frames * sizeof(struct FrameInput) > footer.final_offset) {
+			fprintf(stderr, "Recording %s has a corrupt index\n", path);
+			return false;
+		}
+	}
+
+	recording->keyframe_interval = header.keyframe_interval;
+	recording->keyframe_count = footer.keyframe_count;
+	recording->frame_count = footer.frame_count;
+	recording->index_offset = footer.index_offset;
+	recording->final_offset = footer.final_offset;
+
+	return true;
+}
+
+struct Recording* recording_open(const char* path) {
+	struct Recording* recording = calloc(1, sizeof(struct Recording));
+
+	if (recording == NULL) {
+		fprintf(stderr, "Failed to allocate recording.\n");
+		return NULL;
+	}
+
+	if (map_file(path, &recording->mapped) == false) {
+		free(recording);
+		return NULL;
+	}
+
+	if (recording_read_index(recording, path) == false) {
+		unmap_file(&recording->mapped);
+		free(recording);
+		return NULL;
+	}
+
+	return recording;
+}
+
+void recording_close(struct Recording* recording) {
+	unmap_file(&recording->mapped);
+	free(recording);
+}
+
+uint64_t recording_chunk_offset(const struct Recording* recording, uint32_t keyframe) {
+	uint64_t offset;
+	memcpy(&offset, recording->mapped.data + recording->index_offset + keyframe * sizeof(uint64_t), sizeof(offset));
+
+	return offset;
+}
+
+void recording_input(const struct Recording* recording, uint32_t frame, struct FrameInput* input) {
+	uint32_t keyframe = frame / recording->keyframe_interval;
+	uint64_t offset = recording_chunk_offset(recording, keyframe) + sizeof(struct Snapshot);
+
+	memcpy(input, recording->mapped.data + offset + (frame % recording->keyframe_interval) * sizeof(struct FrameInput), sizeof(struct FrameInput));
+}
+
+// Keyframe 0..keyframe_count-1, or keyframe_count for the final state
+void recording_keyframe(const struct Recording* recording, uint32_t keyframe, struct Snapshot* snapshot) {
+	uint64_t offset = keyframe < recording->keyframe_count
+		? recording_chunk_offset(recording, keyframe)
+		: recording->final_offset;
+
+	memcpy(snapshot, recording->mapped.data + offset, sizeof(struct Snapshot));
+}
+
+// Puts state where it was just before frame was played (frame_count = the end)
+bool recording_seek(const struct Recording* recording, struct State* state, uint32_t frame) {
+	if (frame > recording->frame_count) {
+		fprintf(stderr, "Frame %u is past the end of the recording (%u frames)\n", frame, recording->frame_count);
+		return false;
+	}
+
+	uint32_t keyframe = frame / recording->keyframe_interval;
+
+	struct Snapshot snapshot;
+	recording_keyframe(recording, keyframe, &snapshot);
+	state_load(state, &snapshot);
+
+	for (uint32_t i = keyframe * recording->keyframe_interval; i < frame; i++) {
+		struct FrameInput input;
+		recording_input(recording, i, &input);
+		state_frame(state, &input);
+	}
+
+	return true;
+}
+
+// FNV-1a over the machine state
+uint64_t snapshot_hash(const struct Snapshot* snapshot) {
+	const uint8_t* bytes = (const uint8_t*)snapshot;
+	uint64_t hash = 0xCBF29CE484222325ULL;
+
+	for (size_t i = 0; i < sizeof(struct Snapshot); i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001B3ULL;
+	}
+
+	return hash;
+}
+
+// Content-addressed snapshot storage for keeping lots of snapshots of the same
+// game around. Memory and video are cut into pages, each distinct page is kept
+// once with a refcount, and a stored snapshot is just page IDs plus the small
+// fields. Not thread-safe.
+const int SNAPSHOT_PAGE_SIZE = 256;
+const int SNAPSHOT_MEMORY_PAGES = 0x1000 / 256;
+const int SNAPSHOT_PAGES = (0x1000 + 2 * 64 * 2 * 8) / 256;
+
+struct SnapshotPage {
+	uint64_t hash;
+	// 0 when the slot is on the free list
+	uint32_t refcount;
+	// Next page in the bucket or on the free list, UINT32_MAX ends both
+	uint32_t next;
+	// SNAPSHOT_PAGE_SIZE
+	uint8_t data[256];
+};
+
+struct StoredSnapshot {
+	// SNAPSHOT_PAGES, memory then video_buffer
+	uint32_t pages[24];
+	// Everything in Snapshot after video_buffer
+	uint8_t fields[sizeof(struct Snapshot) - offsetof(struct Snapshot, framebuffer_mode)];
+};
+
+struct SnapshotStore {
+	struct SnapshotPage* pages;
+	uint32_t page_count;
+	uint32_t page_capacity;
+	uint32_t free_page;
+	// Pages with a refcount
+	uint32_t unique_pages;
+	// Power of two, each the first page in the bucket
+	uint32_t* buckets;
+	uint32_t bucket_count;
+	uint32_t snapshot_count;
+};
+
+bool snapshot_store_init(struct SnapshotStore* store) {
+	memset(store, 0, sizeof(struct SnapshotStore));
+	store->free_page = UINT32_MAX;
+	store->bucket_count = 256;
+	store->buckets = malloc(store->bucket_count * sizeof(uint32_t));
+
+	if (store->buckets == NULL) {
+		fprintf(stderr, "Failed to allocate snapshot store.\n");
+		return false;
+	}
+
+	memset(store->buckets, 0xFF, store->bucket_count * sizeof(uint32_t));
+
+	return true;
+}
+
+void snapshot_store_destroy(struct SnapshotStore* store) {
+	free(store->pages);
+	free(store->buckets);
+}
+
+// Multiply-rotate over 64 bit words, pages are always whole words
+uint64_t snapshot_page_hash(const uint8_t* data) {
+	uint64_t hash = 0;
+
+	for (int i = 0; i < SNAPSHOT_PAGE_SIZE; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, &data[i], sizeof(word));
+
+		hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+		hash ^= hash >> 29;
+	}
+
+	return hash;
+}
+
+bool snapshot_store_grow_buckets(struct SnapshotStore* store) {
+	uint32_t bucket_count = store->bucket_count * 2;
+	uint32_t* buckets = malloc(bucket_count * sizeof(uint32_t));
+
+	if (buckets == NULL) {
+		return false;
+	}
+
+	memset(buckets, 0xFF, bucket_count * sizeof(uint32_t));
+
+	for (uint32_t i = 0; i < store->page_count; i++) {
+		struct SnapshotPage* page = &store->pages[i];
+
+		if (page->refcount > 0) {
+			uint32_t bucket = (uint32_t)page->hash & (bucket_count - 1);
+			page->next = buckets[bucket];
+			buckets[bucket] = i;
+		}
+	}
+
+	free(store->buckets);
+	store->buckets = buckets;
+	store->bucket_count = bucket_count;
+
+	return true;
+}
+
+// Takes a reference to the page holding data, adding it if it's new. Returns
+// UINT32_MAX if it couldn't be allocated.
+uint32_t snapshot_store_page(struct SnapshotStore* store, const uint8_t* data) {
+	uint64_t hash = snapshot_page_hash(data);
+
+	for (uint32_t id = store->buckets[hash & (store->bucket_count - 1)]; id != UINT32_MAX; id = store->pages[id].next) {
+		struct SnapshotPage* page = &store->pages[id];
+
+		if (page->hash == hash && memcmp(page->data, data, SNAPSHOT_PAGE_SIZE) == 0) {
+			page->refcount++;
+			return id;
+		}
+	}
+
+	// Keep the chains short
+	if (store->unique_pages >= store->bucket_count && snapshot_store_grow_buckets(store) == false) {
+		return UINT32_MAX;
+	}
+
+	uint32_t id = store->free_page;
+
+	if (id != UINT32_MAX) {
+		store->free_page = store->pages[id].next;
+	}
+	else {
+		if (store->page_count == store->page_capacity) {
+			uint32_t capacity = store->page_capacity > 0 ? store->page_capacity * 2 : 64;
+			struct SnapshotPage* pages = realloc(store->pages, capacity * sizeof(struct SnapshotPage));
+
+			if (pages == NULL) {
+				return UINT32_MAX;
+			}
+
+			store->pages = pages;
+			store->page_capacity = capacity;
+		}
+
+		id = store->page_count++;
+	}
+
+	struct SnapshotPage* page = &store->pages[id];
+	uint32_t bucket = (uint32_t)hash & (store->bucket_count - 1);
+
+	page->hash = hash;
+	page->refcount = 1;
+	memcpy(page->data, data, SNAPSHOT_PAGE_SIZE);
+	page->next = store->buckets[bucket];
+	store->buckets[bucket] = id;
+	store->unique_pages++;
+
+	return id;
+}
+
+void snapshot_store_release_page(struct SnapshotStore* store, uint32_t id) {
+	struct SnapshotPage* page = &store->pages[id];
+
+	if (--page->refcount > 0) {
+		return;
+	}
+
+	// Unlink from its bucket, then onto the free list
+	uint32_t* link = &store->buckets[page->hash & (store->bucket_count - 1)];
+
+	while (*link != id) {
+		link = &store->pages[*link].next;
+	}
+
+	*link = page->next;
+	page->next = store->free_page;
+	store->free_page = id;
+	store->unique_pages--;
+}
+
+// Where a page lives inside a Snapshot
+size_t snapshot_page_offset(int page) {
+	if (page < SNAPSHOT_MEMORY_PAGES) {
+		return offsetof(struct Snapshot, memory) + page * SNAPSHOT_PAGE_SIZE;
+	}
+
+	return offsetof(struct Snapshot, video_buffer) + (page - SNAPSHOT_MEMORY_PAGES) * SNAPSHOT_PAGE_SIZE;
+}
+
+void snapshot_store_release(struct SnapshotStore* store, const struct StoredSnapshot* stored) {
+	for (int i = 0; i < SNAPSHOT_PAGES; i++) {
+		snapshot_store_release_page(store, stored->pages[i]);
+	}
+
+	store->snapshot_count--;
+}
+
+bool snapshot_store_put(struct SnapshotStore* store, const struct Snapshot* snapshot, struct StoredSnapshot* stored) {
+	for (int i = 0; i < SNAPSHOT_PAGES; i++) {
+		stored->pages[i] = snapshot_store_page(store, (const uint8_t*)snapshot + snapshot_page_offset(i));
+
+		if (stored->pages[i] == UINT32_MAX) {
+			fprintf(stderr, "Failed to allocate snapshot store page.\n");
+
+			while (i-- > 0) {
+				snapshot_store_release_page(store, stored->pages[i]);
+			}
+
+			return false;
+		}
+	}
+
+	memcpy(stored->fields, &snapshot->framebuffer_mode, sizeof(stored->fields));
+	store->snapshot_count++;
+
+	return true;
+}
+
+void snapshot_store_get(const struct SnapshotStore* store, const struct StoredSnapshot* stored, struct Snapshot* snapshot) {
+	for (int i = 0; i < SNAPSHOT_PAGES; i++) {
+		memcpy((uint8_t*)snapshot + snapshot_page_offset(i), store->pages[stored->pages[i]].data, SNAPSHOT_PAGE_SIZE);
+	}
+
+	memcpy(&snapshot->framebuffer_mode, stored->fields, sizeof(stored->fields));
+}
+
+// Live bytes per stored snapshot, pages shared between them included
+double snapshot_store_bytes_per_snapshot(const struct SnapshotStore* store) {
+	if (store->snapshot_count == 0) {
+		return 0;
+	}
+
+	size_t bytes = (size_t)store->unique_pages * sizeof(struct SnapshotPage) + (size_t)store->snapshot_count * sizeof(struct StoredSnapshot);
+
+	return (double)bytes / store->snapshot_count;
+}
+
+struct Verifier {
+	const struct Recording* recording;
+	SDL_atomic_t next_segment;
+	// Lowest failing segment so far, keyframe_count if none
+	SDL_atomic_t first_failure;
+};
+
+// Replays one keyframe-to-keyframe segment and checks it lands on the next keyframe
+bool verify_segment(const struct Recording* recording, struct State* state, uint32_t segment) {
+	uint32_t start = segment * recording->keyframe_interval;
+	uint32_t end = start + recording->keyframe_interval;
+
+	if (end > recording->frame_count) {
+		end = recording->frame_count;
+	}
+
+	struct Snapshot snapshot;
+	recording_keyframe(recording, segment, &snapshot);
+	state_load(state, &snapshot);
+
+	for (uint32_t frame = start; frame < end; frame++) {
+		struct FrameInput input;
+		recording_input(recording, frame, &input);
+		state_frame(state, &input);
+	}
+
+	struct Snapshot expected;
+	recording_keyframe(recording, segment + 1, &expected);
+	state_save(state, &snapshot);
+
+	return snapshot_hash(&snapshot) == snapshot_hash(&expected);
+}
+
+int verifier_thread(void* data) {
+	struct Verifier* verifier = data;
+	const struct Recording* recording = verifier->recording;
+
+	struct State* state = state_init();
+
+	if (state == NULL) {
+		return 1;
+	}
+
+	while (true) {
+		uint32_t segment = (uint32_t)SDL_AtomicAdd(&verifier->next_segment, 1);
+
+		// Segments are handed out in order, so once past a known failure nothing later matters
+		if (segment >= (uint32_t)SDL_AtomicGet(&verifier->first_failure)) {
+			break;
+		}
+
+		if (verify_segment(recording, state, segment)) {
+			continue;
+		}
+
+		int failure = SDL_AtomicGet(&verifier->first_failure);
+
+		while ((int)segment < failure && SDL_AtomicCAS(&verifier->first_failure, failure, segment) == SDL_FALSE) {
+			failure = SDL_AtomicGet(&verifier->first_failure);
+		}
+	}
+
+	state_destroy(state);
+
+	return 0;
+}
+
+// Returns true if every segment of the recording replays onto its next keyframe
+bool verify_recording(const char* path, int thread_count) {
+	struct Recording* recording = recording_open(path);
+
+	if (recording == NULL) {
+		return false;
+	}
+
+	if (thread_count <= 0) {
+		thread_count = SDL_GetCPUCount();
+	}
+
+	if (thread_count > (int)recording->keyframe_count) {
+		thread_count = recording->keyframe_count > 0 ? recording->keyframe_count : 1;
+	}
+
+	struct Verifier verifier;
+	verifier.recording = recording;
+	SDL_AtomicSet(&verifier.next_segment, 0);
+	SDL_AtomicSet(&verifier.first_failure, recording->keyframe_count);
+
+	SDL_Thread** threads = calloc(thread_count, sizeof(SDL_Thread*));
+
+	if (threads == NULL) {
+		fprintf(stderr, "Failed to allocate verifier threads.\n");
+		recording_close(recording);
+		return false;
+	}
+
+	uint64_t start_time = SDL_GetPerformanceCounter();
+
+	for (int i = 0; i < thread_count; i++) {
+		threads[i] = SDL_CreateThread(verifier_thread, "verifier", &verifier);
+
+		if (threads[i] == NULL) {
+			fprintf(stderr, "Failed to create verifier thread: %s\n", SDL_GetError());
+		}
+	}
+
+	// A thread that failed to start is fine as long as one did, the queue is shared
+	bool any_started = false;
+
+	for (int i = 0; i < thread_count; i++) {
+		if (threads[i] != NULL) {
+			SDL_WaitThread(threads[i], NULL);
+			any_started = true;
+		}
+	}
+
+	double seconds = (double)(SDL_GetPerformanceCounter() - start_time) / SDL_GetPerformanceFrequency();
+	uint32_t failure = (uint32_t)SDL_AtomicGet(&verifier.first_failure);
+	bool ok = any_started && failure == recording->keyframe_count;
+
+	if (any_started == false) {
+		fprintf(stderr, "No verifier threads could be started\n");
+	}
+	else if (ok) {
+		printf("%s: %u frames in %u segments verified OK (%d threads, %.3fs)\n",
+			path, recording->frame_count, recording->keyframe_count, thread_count, seconds);
+	}
+	else {
+		uint32_t start = failure * recording->keyframe_interval;
+		uint32_t end = start + recording->keyframe_interval;
+
+		if (end > recording->frame_count) {
+			end = recording->frame_count;
+		}
+
+		printf("%s: segment %u (frames %u-%u) does not match its end keyframe\n", path, failure, start, end - 1);
+	}
+
+	free(threads);
+	recording_close(recording);
+
+	return ok;
+}
+
+// Lets other threads read the machine without stopping it. The emulation
+// thread publishes a snapshot at each frame boundary, alternating between two
+// buffers so a reader has a whole frame to copy one before it is reused.
+// Each buffer is a seqlock: odd sequence = being written.
+struct ObserverBuffer {
+	SDL_atomic_t sequence;
+	uint32_t frame;
+	struct Snapshot snapshot;
+};
+
+struct Observer {
+	// Number of snapshots published, the latest is in buffers[(published - 1) & 1]
+	SDL_atomic_t published;
+	struct ObserverBuffer buffers[2];
+};
+
+struct Observer* observer_create() {
+	struct Observer* observer = calloc(1, sizeof(struct Observer));
+
+	if (observer == NULL) {
+		fprintf(stderr, "Failed to allocate observer.\n");
+	}
+
+	return observer;
+}
+
+void observer_destroy(struct Observer* observer) {
+	free(observer);
+}
+
+// Emulation thread only
+void observer_publish(struct Observer* observer, const struct State* state, uint32_t frame) {
+	int published = SDL_AtomicGet(&observer->published);
+	struct ObserverBuffer* buffer = &observer->buffers[published & 1];
+	int sequence = SDL_AtomicGet(&buffer->sequence);
+
+	SDL_AtomicSet(&buffer->sequence, sequence + 1);
+	SDL_MemoryBarrierRelease();
+
+	buffer->frame = frame;
+	state_save(state, &buffer->snapshot);
+
+	SDL_MemoryBarrierRelease();
+	SDL_AtomicSet(&buffer->sequence, sequence + 2);
+	SDL_AtomicSet(&observer->published, published + 1);
+}
+
+// Any thread. Copies the latest consistent snapshot, false if nothing has been published yet.
+bool observer_read(struct Observer* observer, struct Snapshot* snapshot, uint32_t* frame) {
+	while (true) {
+		int published = SDL_AtomicGet(&observer->published);
+
+		if (published == 0) {
+			return false;
+		}
+
+		struct ObserverBuffer* buffer = &observer->buffers[(published - 1) & 1];
+		int before = SDL_AtomicGet(&buffer->sequence);
+
+		// Only possible if the reader was descheduled for a whole frame
+		if (before & 1) {
+			continue;
+		}
+
+		SDL_MemoryBarrierAcquire();
+
+		memcpy(snapshot, &buffer->snapshot, sizeof(struct Snapshot));
+		uint32_t buffer_frame = buffer->frame;
+
+		SDL_MemoryBarrierAcquire();
+
+		if (SDL_AtomicGet(&buffer->sequence) == before) {
+			if (frame != NULL) {
+				*frame = buffer_frame;
+			}
+
+			return true;
+		}
+	}
+}
+
+struct Monitor {
+	struct Observer* observer;
+	SDL_atomic_t running;
+};
+
+// --monitor: prints registers once a second from the observer
+int monitor_thread(void* data) {
+	struct Monitor* monitor = data;
+	struct Snapshot snapshot;
+	uint32_t frame;
+
+	while (SDL_AtomicGet(&monitor->running)) {
+		if (observer_read(monitor->observer, &snapshot, &frame)) {
+			printf("frame %u PC %04X I %06X SP %04X DT %02X ST %02X V",
+				frame, snapshot.pc, snapshot.reg_i, snapshot.sp, snapshot.delay_timer, snapshot.sound_timer);
+
+			for (int i = 0; i < 16; i++) {
+				printf(" %02X", snapshot.regs_v[i]);
+			}
+
+			printf("\n");
+		}
+
+		SDL_Delay(1000);
+	}
+
+	return 0;
+}
+
+// Alternative engine: a 64K table indexed by the raw opcode, pointing at
+// handlers generated for each exact form, registers baked in. Only the
+// classic instructions are specialized, everything else (and anything with
+// hooks attached, or MegaChip mode) goes through state_step. Filled on first
+// use, it's 512K of pointers.
+// Most handlers have their operands baked in and never look at opcode
+#define OPCODE_HANDLER(name) static void name(struct State* state UNUSED, uint16_t opcode UNUSED)
+#define OPCODE_SKIP_IF(condition) state->pc += (condition) ? 4 : 2; state->cycles++
+
+OPCODE_HANDLER(opcode_fallback) {
+	state_step(state);
+}
+
+OPCODE_HANDLER(opcode_00e0) {
+	instruction_clear_video(state);
+	state->pc += 2;
+	state->cycles++;
+}
+
+OPCODE_HANDLER(opcode_00ee) {
+	state->pc = state_pop_from_stack(state);
+	state->cycles++;
+}
+
+OPCODE_HANDLER(opcode_1nnn) {
+	state->pc = opcode & 0xFFF;
+	state->cycles++;
+}
+
+OPCODE_HANDLER(opcode_2nnn) {
+	state_push_to_stack(state, state->pc + 0x2);
+	state->pc = opcode & 0xFFF;
+	state->cycles++;
+}
+
+OPCODE_HANDLER(opcode_annn) {
+	state->reg_i = opcode & 0xFFF;
+	state->pc += 2;
+	state->cycles++;
+}
+
+// One register, the rest of the opcode is an operand or picks the handler
+#define OPCODE_STEP_X(family, x, body) OPCODE_HANDLER(opcode_##family##_##x) { \
+	uint8_t* vx = &state->regs_v[0x##x]; \
+	body; \
+	state->pc += 2; \
+	state->cycles++; \
+}
+
+#define OPCODE_HANDLERS_X(x) \
+	OPCODE_HANDLER(opcode_3xnn_##x) { OPCODE_SKIP_IF(state->regs_v[0x##x] == (opcode & 0xFF)); } \
+	OPCODE_HANDLER(opcode_4xnn_##x) { OPCODE_SKIP_IF(state->regs_v[0x##x] != (opcode & 0xFF)); } \
+	OPCODE_HANDLER(opcode_ex9e_##x) { OPCODE_SKIP_IF(state->keycode == state->regs_v[0x##x]); } \
+	OPCODE_HANDLER(opcode_exa1_##x) { OPCODE_SKIP_IF(state->keycode != state->regs_v[0x##x]); } \
+	OPCODE_HANDLER(opcode_fx0a_##x) { \
+		if (state->keycode != 16) { \
+			state->regs_v[0x##x] = state->keycode; \
+			state->pc += 2; \
+		} \
+		state->cycles++; \
+	} \
+	OPCODE_STEP_X(6xnn, x, *vx = opcode & 0xFF) \
+	OPCODE_STEP_X(7xnn, x, *vx += opcode & 0xFF) \
+	OPCODE_STEP_X(cxnn, x, *vx = state_random(state) & (opcode & 0xFF)) \
+	OPCODE_STEP_X(fx07, x, *vx = state->delay_timer) \
+	OPCODE_STEP_X(fx15, x, state->delay_timer = *vx) \
+	OPCODE_STEP_X(fx18, x, state->sound_timer = *vx) \
+	OPCODE_STEP_X(fx1e, x, state->reg_i += *vx) \
+	OPCODE_STEP_X(fx29, x, state->reg_i = FONT_START + *vx) \
+	OPCODE_STEP_X(fx33, x, instruction_decimal_digits(state, *vx)) \
+	OPCODE_HANDLER(opcode_fx55_##x) { \
+		memcpy(&state->memory[state->reg_i], state->regs_v, 0x##x + 1); \
+		state->pc += 2; \
+		state->cycles++; \
+	} \
+	OPCODE_HANDLER(opcode_fx65_##x) { \
+		memcpy(state->regs_v, &state->memory[state->reg_i], 0x##x + 1); \
+		state->pc += 2; \
+		state->cycles++; \
+	} \
+	OPCODE_STEP_X(8x06, x, state->regs_v[0xF] = *vx & 0x1; *vx >>= 1) \
+	OPCODE_STEP_X(8x0e, x, state->regs_v[0xF] = *vx >> 7; *vx <<= 1)
+
+// Two registers. The bodies are state_step's, flag quirks included.
+#define OPCODE_STEP_XY(family, x, y, body) OPCODE_HANDLER(opcode_##family##_##x##y) { \
+	uint8_t* vx = &state->regs_v[0x##x]; \
+	uint8_t* vy = &state->regs_v[0x##y]; \
+	body; \
+	state->pc += 2; \
+	state->cycles++; \
+}
+
+#define OPCODE_HANDLERS_XY(x, y) \
+	OPCODE_HANDLER(opcode_5xy0_##x##y) { OPCODE_SKIP_IF(state->regs_v[0x##x] == state->regs_v[0x##y]); } \
+	OPCODE_HANDLER(opcode_9xy0_##x##y) { OPCODE_SKIP_IF(state->regs_v[0x##x] != state->regs_v[0x##y]); } \
+	OPCODE_STEP_XY(8xy0, x, y, *vx = *vy) \
+	OPCODE_STEP_XY(8xy1, x, y, *vx |= *vy) \
+	OPCODE_STEP_XY(8xy2, x, y, *vx &= *vy) \
+	OPCODE_STEP_XY(8xy3, x, y, *vx ^= *vy) \
+	OPCODE_STEP_XY(8xy4, x, y, state->regs_v[0xF] = *vx > *vx + *vy; *vx += *vy) \
+	OPCODE_STEP_XY(8xy5, x, y, state->regs_v[0xF] = *vx < *vx - *vy; *vx -= *vy) \
+	OPCODE_STEP_XY(8xy7, x, y, state->regs_v[0xF] = *vy < *vy - *vx; *vx = *vy - *vx) \
+	OPCODE_HANDLER(opcode_dxyn_##x##y) { \
+		instruction_draw_sprite(state, 0x##x, 0x##y, opcode & 0xF); \
+		state->pc += 2; \
+		state->cycles++; \
+	}
+
+#define OPCODE_HANDLERS_ROW(x) \
+	OPCODE_HANDLERS_XY(x, 0) OPCODE_HANDLERS_XY(x, 1) OPCODE_HANDLERS_XY(x, 2) OPCODE_HANDLERS_XY(x, 3) \
+	OPCODE_HANDLERS_XY(x, 4) OPCODE_HANDLERS_XY(x, 5) OPCODE_HANDLERS_XY(x, 6) OPCODE_HANDLERS_XY(x, 7) \
+	OPCODE_HANDLERS_XY(x, 8) OPCODE_HANDLERS_XY(x, 9) OPCODE_HANDLERS_XY(x, A) OPCODE_HANDLERS_XY(x, B) \
+	OPCODE_HANDLERS_XY(x, C) OPCODE_HANDLERS_XY(x, D) OPCODE_HANDLERS_XY(x, E) OPCODE_HANDLERS_XY(x, F)
+
+OPCODE_HANDLERS_X(0) OPCODE_HANDLERS_X(1) OPCODE_HANDLERS_X(2) OPCODE_HANDLERS_X(3)
+OPCODE_HANDLERS_X(4) OPCODE_HANDLERS_X(5) OPCODE_HANDLERS_X(6) OPCODE_HANDLERS_X(7)
+OPCODE_HANDLERS_X(8) OPCODE_HANDLERS_X(9) OPCODE_HANDLERS_X(A) OPCODE_HANDLERS_X(B)
+OPCODE_HANDLERS_X(C) OPCODE_HANDLERS_X(D) OPCODE_HANDLERS_X(E) OPCODE_HANDLERS_X(F)
+
+OPCODE_HANDLERS_ROW(0) OPCODE_HANDLERS_ROW(1) OPCODE_HANDLERS_ROW(2) OPCODE_HANDLERS_ROW(3)
+OPCODE_HANDLERS_ROW(4) OPCODE_HANDLERS_ROW(5) OPCODE_HANDLERS_ROW(6) OPCODE_HANDLERS_ROW(7)
+OPCODE_HANDLERS_ROW(8) OPCODE_HANDLERS_ROW(9) OPCODE_HANDLERS_ROW(A) OPCODE_HANDLERS_ROW(B)
+OPCODE_HANDLERS_ROW(C) OPCODE_HANDLERS_ROW(D) OPCODE_HANDLERS_ROW(E) OPCODE_HANDLERS_ROW(F)
+
+// Every handler of a family, indexed by x or by x << 4 | y
+#define OPCODE_NAMES_X(family) \
+	opcode_##family##_0, opcode_##family##_1, opcode_##family##_2, opcode_##family##_3, \
+	opcode_##family##_4, opcode_##family##_5, opcode_##family##_6, opcode_##family##_7, \
+	opcode_##family##_8, opcode_##family##_9, opcode_##family##_A, opcode_##family##_B, \
+	opcode_##family##_C, opcode_##family##_D, opcode_##family##_E, opcode_##family##_F
+
+#define OPCODE_NAMES_ROW(family, x) \
+	opcode_##family##_##x##0, opcode_##family##_##x##1, opcode_##family##_##x##2, opcode_##family##_##x##3, \
+	opcode_##family##_##x##4, opcode_##family##_##x##5, opcode_##family##_##x##6, opcode_##family##_##x##7, \
+	opcode_##family##_##x##8, opcode_##family##_##x##9, opcode_##family##_##x##A, opcode_##family##_##x##B, \
+	opcode_##family##_##x##C, opcode_##family##_##x##D, opcode_##family##_##x##E, opcode_##family##_##x##F
+
+#define OPCODE_NAMES_XY(family) \
+	OPCODE_NAMES_ROW(family, 0), OPCODE_NAMES_ROW(family, 1), OPCODE_NAMES_ROW(family, 2), OPCODE_NAMES_ROW(family, 3), \
+	OPCODE_NAMES_ROW(family, 4), OPCODE_NAMES_ROW(family, 5), OPCODE_NAMES_ROW(family, 6), OPCODE_NAMES_ROW(family, 7), \
+	OPCODE_NAMES_ROW(family, 8), OPCODE_NAMES_ROW(family, 9), OPCODE_NAMES_ROW(family, A), OPCODE_NAMES_ROW(family, B), \
+	OPCODE_NAMES_ROW(family, C), OPCODE_NAMES_ROW(family, D), OPCODE_NAMES_ROW(family, E), OPCODE_NAMES_ROW(family, F)
+
+// Families with one register, and the opcode bits (beyond the top nibble and
+// x) that pick them
+struct OpcodeFamilyX {
+	uint16_t match;
+	uint16_t mask;
+	void (*handlers[16])(struct State*, uint16_t);
+};
+
+const struct OpcodeFamilyX OPCODE_FAMILIES_X[] = {
+	{ 0x3000, 0xF000, { OPCODE_NAMES_X(3xnn) } },
+	{ 0x4000, 0xF000, { OPCODE_NAMES_X(4xnn) } },
+	{ 0x6000, 0xF000, { OPCODE_NAMES_X(6xnn) } },
+	{ 0x7000, 0xF000, { OPCODE_NAMES_X(7xnn) } },
+	{ 0xC000, 0xF000, { OPCODE_NAMES_X(cxnn) } },
+	{ 0xE09E, 0xF0FF, { OPCODE_NAMES_X(ex9e) } },
+	{ 0xE0A1, 0xF0FF, { OPCODE_NAMES_X(exa1) } },
+	{ 0xF007, 0xF0FF, { OPCODE_NAMES_X(fx07) } },
+	{ 0xF00A, 0xF0FF, { OPCODE_NAMES_X(fx0a) } },
+	{ 0xF015, 0xF0FF, { OPCODE_NAMES_X(fx15) } },
+	{ 0xF018, 0xF0FF, { OPCODE_NAMES_X(fx18) } },
+	{ 0xF01E, 0xF0FF, { OPCODE_NAMES_X(fx1e) } },
+	{ 0xF029, 0xF0FF, { OPCODE_NAMES_X(fx29) } },
+	{ 0xF033, 0xF0FF, { OPCODE_NAMES_X(fx33) } },
+	{ 0xF055, 0xF0FF, { OPCODE_NAMES_X(fx55) } },
+	{ 0xF065, 0xF0FF, { OPCODE_NAMES_X(fx65) } },
+	// state_step ignores y for the shifts
+	{ 0x8006, 0xF00F, { OPCODE_NAMES_X(8x06) } },
+	{ 0x800E, 0xF00F, { OPCODE_NAMES_X(8x0e) } }
+};
+
+struct OpcodeFamilyXY {
+	uint16_t match;
+	uint16_t mask;
+	void (*handlers[256])(struct State*, uint16_t);
+};
+
+const struct OpcodeFamilyXY OPCODE_FAMILIES_XY[] = {
+	// state_step doesn't look at N for these
+	{ 0x5000, 0xF000, { OPCODE_NAMES_XY(5xy0) } },
+	{ 0x9000, 0xF000, { OPCODE_NAMES_XY(9xy0) } },
+	{ 0x8000, 0xF00F, { OPCODE_NAMES_XY(8xy0) } },
+	{ 0x8001, 0xF00F, { OPCODE_NAMES_XY(8xy1) } },
+	{ 0x8002, 0xF00F, { OPCODE_NAMES_XY(8xy2) } },
+	{ 0x8003, 0xF00F, { OPCODE_NAMES_XY(8xy3) } },
+	{ 0x8004, 0xF00F, { OPCODE_NAMES_XY(8xy4) } },
+	{ 0x8005, 0xF00F, { OPCODE_NAMES_XY(8xy5) } },
+	{ 0x8007, 0xF00F, { OPCODE_NAMES_XY(8xy7) } },
+	{ 0xD000, 0xF000, { OPCODE_NAMES_XY(dxyn) } }
+};
+
+void (*opcode_table[0x10000])(struct State*, uint16_t);
+
+void opcode_table_init() {
+	if (opcode_table[0] != NULL) {
+		return;
+	}
+
+	for (uint32_t opcode = 0; opcode < 0x10000; opcode++) {
+		void (*handler)(struct State*, uint16_t) = opcode_fallback;
+
+		switch (opcode >> 12) {
+		case 0x0:
+			handler = opcode == 0x00E0 ? opcode_00e0 : opcode == 0x00EE ? opcode_00ee : opcode_fallback;
+			break;
+
+		case 0x1: handler = opcode_1nnn; break;
+		case 0x2: handler = opcode_2nnn; break;
+		case 0xA: handler = opcode_annn; break;
+
+		default:
+			for (size_t i = 0; i < sizeof(OPCODE_FAMILIES_X) / sizeof(OPCODE_FAMILIES_X[0]); i++) {
+				if ((opcode & OPCODE_FAMILIES_X[i].mask) == OPCODE_FAMILIES_X[i].match) {
+					handler = OPCODE_FAMILIES_X[i].handlers[(opcode >> 8) & 0xF];
+				}
+			}
+
+			for (size_t i = 0; i < sizeof(OPCODE_FAMILIES_XY) / sizeof(OPCODE_FAMILIES_XY[0]); i++) {
+				if ((opcode & OPCODE_FAMILIES_XY[i].mask) == OPCODE_FAMILIES_XY[i].match) {
+					handler = OPCODE_FAMILIES_XY[i].handlers[(opcode >> 4) & 0xFF];
+				}
+			}
+
+			break;
+		}
+
+		opcode_table[opcode] = handler;
+	}
+}
+
+// state_frame, dispatching through opcode_table. Call opcode_table_init first.
+void state_frame_table(struct State* state, const struct FrameInput* input) {
+	int next_input = 0;
+	int input_count = input != NULL ? input->count : 0;
+	// The handlers skip the coverage, latency and host call hooks
+	bool hooked = state->coverage != NULL || state->latency != NULL || state->host_calls != NULL;
+
+	for (int i = 0; i < CYCLES_PER_FRAME; i++) {
+		while (next_input < input_count && input->cycles[next_input] <= i) {
+			state->keycode = input->keycodes[next_input];
+			next_input++;
+		}
+
+		if (hooked || state->megachip_mode || state->pc >= state->memory_size - 1) {
+			state_step(state);
+		}
+		else {
+			uint16_t opcode = state->memory[state->pc] << 8 | state->memory[state->pc + 1];
+			opcode_table[opcode](state, opcode);
+		}
+
+		if (state->end_of_program) {
+			break;
+		}
+	}
+
+	if (state->delay_timer > 0) {
+		state->delay_timer -= 1;
+	}
+
+	if (state->sound_timer > 0) {
+		state->sound_timer -= 1;
+	}
+}
+
+// Predecoding engine on top of opcode_table: every address caches the handler
+// and opcode of the instruction there, so a step doesn't fetch or look
+// anything up. Memory writes have to invalidate what they overwrite, unless
+// smc_analyze proved at load time that none of them can reach code.
+struct DecodeCache {
+	// decode_cache_miss until the address has been decoded
+	void (*handlers[0x1000])(struct State*, uint16_t);
+	uint16_t opcodes[0x1000];
+	// No write barriers, calls just check the stack stays where the proof assumed
+	bool barrier_free;
+	// The stack grew into the program, so it's back to barriers
+	bool fell_back;
+	uint64_t misses;
+	uint64_t invalidations;
+};
+
+// Instruction reachability and the interval I can be in at each instruction
+struct SmcAnalysis {
+	uint32_t i_low[0x1000]; // MEMORY_SIZE
+	uint32_t i_high[0x1000];
+	uint8_t flags[0x1000];
+	uint16_t worklist[0x1000];
+	int count;
+	// I on return, joined over every reachable 00EE
+	bool returns;
+	uint32_t return_low;
+	uint32_t return_high;
+};
+
+enum SmcFlag {
+	SMC_REACHED = 1,
+	SMC_QUEUED = 2,
+	SMC_CALL = 4,
+	SMC_CODE = 8
+};
+
+void smc_flow(struct SmcAnalysis* analysis, uint32_t pc, uint32_t i_low, uint32_t i_high) {
+	// Off the end is the end of the program
+	if (pc >= MEMORY_SIZE) {
+		return;
+	}
+
+	if (analysis->flags[pc] & SMC_REACHED) {
+		if (analysis->i_low[pc] <= i_low && analysis->i_high[pc] >= i_high) {
+			return;
+		}
+
+		i_low = analysis->i_low[pc] < i_low ? analysis->i_low[pc] : i_low;
+		i_high = analysis->i_high[pc] > i_high ? analysis->i_high[pc] : i_high;
+	}
+
+	analysis->i_low[pc] = i_low;
+	analysis->i_high[pc] = i_high;
+	analysis->flags[pc] |= SMC_REACHED;
+
+	if ((analysis->flags[pc] & SMC_QUEUED) == 0) {
+		analysis->flags[pc] |= SMC_QUEUED;
+		analysis->worklist[analysis->count++] = pc;
+	}
+}
+
+// Load-time proof that FX33 and FX55 can never write over an instruction or
+// the stack, from a freshly loaded ROM. Calls and returns are followed
+// context-insensitively, and calls are assumed to stay under PROGRAM_START,
+// which the engine checks as it runs.
+bool smc_analyze(const struct State* state) {
+	// MegaChip loads past 4K and has its own instructions
+	if (state->megachip_mode || state->memory_size != MEMORY_SIZE) {
+		return false;
+	}
+
+	struct SmcAnalysis* analysis = calloc(1, sizeof(struct SmcAnalysis));
+
+	if (analysis == NULL) {
+		return false;
+	}
+
+	// I can grow past the end through FX1E, writes there aren't our problem
+	const uint32_t I_LIMIT = MEMORY_SIZE + 0xFF;
+
+	bool safe = true;
+	smc_flow(analysis, state->pc, 0, 0);
+
+	while (safe && analysis->count > 0) {
+		uint16_t pc = analysis->worklist[--analysis->count];
+		analysis->flags[pc] &= ~SMC_QUEUED;
+
+		if (pc >= MEMORY_SIZE - 1) {
+			continue;
+		}
+
+		// Running the stack or font as code
+		if (pc < PROGRAM_START) {
+			safe = false;
+			break;
+		}
+
+		analysis->flags[pc] |= SMC_CODE;
+		analysis->flags[pc + 1] |= SMC_CODE;
+
+		uint16_t opcode = state->memory[pc] << 8 | state->memory[pc + 1];
+		uint32_t i_low = analysis->i_low[pc];
+		uint32_t i_high = analysis->i_high[pc];
+
+		switch (opcode >> 12) {
+		case 0x0:
+			if (opcode == 0x0011) {
+				safe = false;
+			}
+			else if (opcode != 0x00EE) {
+				smc_flow(analysis, pc + 2, i_low, i_high);
+			}
+			else if (analysis->returns == false || i_low < analysis->return_low || i_high > analysis->return_high) {
+				analysis->return_low = analysis->returns && analysis->return_low < i_low ? analysis->return_low : i_low;
+				analysis->return_high = analysis->returns && analysis->return_high > i_high ? analysis->return_high : i_high;
+				analysis->returns = true;
+
+				for (uint32_t call = PROGRAM_START; call < MEMORY_SIZE; call++) {
+					if (analysis->flags[call] & SMC_CALL) {
+						smc_flow(analysis, call + 2, analysis->return_low, analysis->return_high);
+					}
+				}
+			}
+
+			break;
+
+		case 0x1:
+			smc_flow(analysis, opcode & 0xFFF, i_low, i_high);
+			break;
+
+		case 0x2:
+			analysis->flags[pc] |= SMC_CALL;
+			smc_flow(analysis, opcode & 0xFFF, i_low, i_high);
+
+			if (analysis->returns) {
+				smc_flow(analysis, pc + 2, analysis->return_low, analysis->return_high);
+			}
+
+			break;
+
+		case 0x3:
+		case 0x4:
+		case 0x5:
+		case 0x9:
+			smc_flow(analysis, pc + 2, i_low, i_high);
+			smc_flow(analysis, pc + 4, i_low, i_high);
+			break;
+
+		case 0xA:
+			smc_flow(analysis, pc + 2, opcode & 0xFFF, opcode & 0xFFF);
+			break;
+
+		case 0xE:
+			smc_flow(analysis, pc + 2, i_low, i_high);
+
+			if ((opcode & 0xFF) == 0x9E || (opcode & 0xFF) == 0xA1) {
+				smc_flow(analysis, pc + 4, i_low, i_high);
+			}
+
+			break;
+
+		case 0xF:
+			if ((opcode & 0xFF) == 0x1E) {
+				i_high = i_high + 0xFF < I_LIMIT ? i_high + 0xFF : I_LIMIT;
+			}
+			else if ((opcode & 0xFF) == 0x29) {
+				i_low = FONT_START;
+				i_high = FONT_START + 0xFF;
+			}
+
+			smc_flow(analysis, pc + 2, i_low, i_high);
+			break;
+
+		default:
+			smc_flow(analysis, pc + 2, i_low, i_high);
+			break;
+		}
+	}
+
+	// Only once all the code is known can the writes be checked against it
+	for (uint32_t pc = PROGRAM_START; pc < MEMORY_SIZE - 1 && safe; pc++) {
+		uint16_t opcode = state->memory[pc] << 8 | state->memory[pc + 1];
+
+		if ((analysis->flags[pc] & SMC_REACHED) == 0 || ((opcode & 0xF0FF) != 0xF033 && (opcode & 0xF0FF) != 0xF055)) {
+			continue;
+		}
+
+		uint32_t start = analysis->i_low[pc];
+		uint32_t end = analysis->i_high[pc] + ((opcode & 0xFF) == 0x33 ? 3 : ((opcode >> 8) & 0xF) + 1);
+
+		// Over the stack changes where 00EE goes
+		safe = start >= PROGRAM_START || end <= STACK_START;
+
+		for (uint32_t address = start; address < end && address < MEMORY_SIZE && safe; address++) {
+			safe = (analysis->flags[address] & SMC_CODE) == 0;
+		}
+	}
+
+	free(analysis);
+
+	return safe;
+}
+
+// What an instruction writes to memory, as [start, end)
+bool decode_cache_writes(const struct State* state, uint16_t opcode, uint32_t* start, uint32_t* end) {
+	if (opcode == 0x00EE) {
+		*start = state->sp - 2;
+		*end = state->sp;
+	}
+	else if ((opcode >> 12) == 0x2) {
+		*start = state->sp;
+		*end = state->sp + 2;
+	}
+	else if ((opcode & 0xF0FF) == 0xF033) {
+		*start = state->reg_i;
+		*end = state->reg_i + 3;
+	}
+	else if ((opcode & 0xF0FF) == 0xF055) {
+		*start = state->reg_i;
+		*end = state->reg_i + ((opcode >> 8) & 0xF) + 1;
+	}
+	else {
+		return false;
+	}
+
+	return true;
+}
+
+OPCODE_HANDLER(decode_cache_miss);
+
+void decode_cache_invalidate(struct DecodeCache* cache, uint32_t start, uint32_t end) {
+	// The instruction starting just before shares its second byte
+	for (uint32_t address = start > 0 ? start - 1 : 0; address < end && address < 0x1000; address++) {
+		if (cache->handlers[address] != decode_cache_miss) {
+			cache->handlers[address] = decode_cache_miss;
+			cache->invalidations++;
+		}
+	}
+}
+
+// Needed whenever memory changes behind the engine's back, like state_load
+void decode_cache_flush(struct DecodeCache* cache) {
+	for (int address = 0; address < 0x1000; address++) {
+		cache->handlers[address] = decode_cache_miss;
+	}
+}
+
+OPCODE_HANDLER(decode_cache_write) {
+	uint32_t start;
+	uint32_t end;
+	decode_cache_writes(state, opcode, &start, &end);
+
+	opcode_table[opcode](state, opcode);
+	decode_cache_invalidate(state->decode_cache, start, end);
+}
+
+void decode_cache_fall_back(struct DecodeCache* cache) {
+	// Everything decoded so far has unchecked writers in it
+	cache->barrier_free = false;
+	cache->fell_back = true;
+	decode_cache_flush(cache);
+}
+
+// The only check left without barriers: the proof doesn't cover the stack
+// growing into the program
+OPCODE_HANDLER(decode_cache_checked_call) {
+	struct DecodeCache* cache = state->decode_cache;
+
+	if ((size_t)state->sp + 2 > PROGRAM_START) {
+		decode_cache_fall_back(cache);
+		decode_cache_write(state, opcode);
+		return;
+	}
+
+	opcode_2nnn(state, opcode);
+}
+
+OPCODE_HANDLER(decode_cache_miss) {
+	struct DecodeCache* cache = state->decode_cache;
+	uint16_t pc = state->pc;
+	opcode = state->memory[pc] << 8 | state->memory[pc + 1];
+
+	void (*handler)(struct State*, uint16_t) = opcode_table[opcode];
+	uint32_t start;
+	uint32_t end;
+
+	if (decode_cache_writes(state, opcode, &start, &end)) {
+		if (cache->barrier_free == false) {
+			handler = decode_cache_write;
+		}
+		else if ((opcode >> 12) == 0x2) {
+			handler = decode_cache_checked_call;
+		}
+	}
+
+	cache->handlers[pc] = handler;
+	cache->opcodes[pc] = opcode;
+	cache->misses++;
+
+	handler(state, opcode);
+}
+
+// Attaches a cache to state, barrier_free only if smc_analyze said so
+bool decode_cache_create(struct State* state, bool barrier_free) {
+	struct DecodeCache* cache = malloc(sizeof(struct DecodeCache));
+
+	if (cache == NULL) {
+		fprintf(stderr, "Unable to allocate decode cache\n");
+		return false;
+	}
+
+	opcode_table_init();
+	decode_cache_flush(cache);
+	memset(cache->opcodes, 0, sizeof(cache->opcodes));
+	cache->barrier_free = barrier_free;
+	cache->fell_back = false;
+	cache->misses = 0;
+	cache->invalidations = 0;
+
+	state->decode_cache = cache;
+
+	return true;
+}
+
+void decode_cache_destroy(struct State* state) {
+	free(state->decode_cache);
+	state->decode_cache = NULL;
+}
+
+// state_frame through state->decode_cache
+void state_frame_cached(struct State* state, const struct FrameInput* input) {
+	struct DecodeCache* cache = state->decode_cache;
+	int next_input = 0;
+	int input_count = input != NULL ? input->count : 0;
+	bool hooked = state->coverage != NULL || state->latency != NULL || state->host_calls != NULL;
+
+	for (int i = 0; i < CYCLES_PER_FRAME; i++) {
+		while (next_input < input_count && input->cycles[next_input] <= i) {
+			state->keycode = input->keycodes[next_input];
+			next_input++;
+		}
+
+		uint16_t pc = state->pc;
+
+		if (hooked || state->megachip_mode || pc >= MEMORY_SIZE - 1) {
+			// state_step doesn't know about the cache, so do its barrier for it
+			uint32_t start;
+			uint32_t end;
+			uint16_t opcode = pc < state->memory_size - 1 ? state->memory[pc] << 8 | state->memory[pc + 1] : 0;
+			bool writes = decode_cache_writes(state, opcode, &start, &end);
+
+			if (writes && cache->barrier_free && (opcode >> 12) == 0x2 && end > PROGRAM_START) {
+				decode_cache_fall_back(cache);
+			}
+
+			state_step(state);
+
+			if (writes) {
+				decode_cache_invalidate(cache, start, end);
+			}
+		}
+		else {
+			cache->handlers[pc](state, cache->opcodes[pc]);
+		}
+
+		if (state->end_of_program) {
+			break;
+		}
+	}
+
+	if (state->delay_timer > 0) {
+		state->delay_timer -= 1;
+	}
+
+	if (state->sound_timer > 0) {
+		state->sound_timer -= 1;
+	}
+}
+
+struct BenchReader {
+	struct Observer* observer;
+	SDL_atomic_t running;
+	uint64_t reads;
+};
+
+int bench_reader_thread(void* data) {
+	struct BenchReader* reader = data;
+	struct Snapshot snapshot;
+
+	while (SDL_AtomicGet(&reader->running)) {
+		if (observer_read(reader->observer, &snapshot, NULL)) {
+			reader->reads++;
+		}
+	}
+
+	return 0;
+}
+
+// Runs frames as fast as possible, returns seconds taken
+double bench_frames(struct State* state, uint32_t frames, struct Observer* observer) {
+	uint64_t start_time = SDL_GetPerformanceCounter();
+
+	for (uint32_t frame = 0; frame < frames && state->end_of_program == false; frame++) {
+		state_frame(state, NULL);
+
+		if (observer != NULL) {
+			observer_publish(observer, state, frame);
+		}
+	}
+
+	return (double)(SDL_GetPerformanceCounter() - start_time) / SDL_GetPerformanceFrequency();
+}
+
+double bench_frames_table(struct State* state, uint32_t frames) {
+	uint64_t start_time = SDL_GetPerformanceCounter();
+
+	for (uint32_t frame = 0; frame < frames && state->end_of_program == false; frame++) {
+		state_frame_table(state, NULL);
+	}
+
+	return (double)(SDL_GetPerformanceCounter() - start_time) / SDL_GetPerformanceFrequency();
+}
+
+double bench_frames_cached(struct State* state, uint32_t frames) {
+	uint64_t start_time = SDL_GetPerformanceCounter();
+
+	for (uint32_t frame = 0; frame < frames && state->end_of_program == false; frame++) {
+		state_frame_cached(state, NULL);
+	}
+
+	return (double)(SDL_GetPerformanceCounter() - start_time) / SDL_GetPerformanceFrequency();
+}
+
+// How much of opcode_table a run touches. The switch engine has no table, its
+// footprint is just state_step's code.
+void bench_opcode_footprint(struct State* state, const struct Snapshot* initial, uint32_t frames) {
+	uint8_t* seen = calloc(0x10000, 1);
+
+	if (seen == NULL) {
+		return;
+	}
+
+	state_load(state, initial);
+
+	// state_frame without input, one step at a time
+	for (uint32_t frame = 0; frame < frames && state->end_of_program == false; frame++) {
+		for (int i = 0; i < CYCLES_PER_FRAME && state->end_of_program == false; i++) {
+			if (state->pc < state->memory_size - 1) {
+				seen[state->memory[state->pc] << 8 | state->memory[state->pc + 1]] = 1;
+			}
+
+			state_step(state);
+		}
+
+		if (state->delay_timer > 0) {
+			state->delay_timer -= 1;
+		}
+
+		if (state->sound_timer > 0) {
+			state->sound_timer -= 1;
+		}
+	}
+
+	int opcodes = 0;
+	int lines = 0;
+	int handlers = 0;
+	int entries_per_line = 64 / sizeof(opcode_table[0]);
+
+	for (uint32_t opcode = 0; opcode < 0x10000; opcode++) {
+		if (seen[opcode] == 0) {
+			continue;
+		}
+
+		opcodes++;
+
+		// First seen opcode on its cache line
+		bool new_line = true;
+
+		for (uint32_t other = opcode - opcode % entries_per_line; other < opcode && new_line; other++) {
+			new_line = seen[other] == 0;
+		}
+
+		lines += new_line;
+
+		bool new_handler = true;
+
+		for (uint32_t other = 0; other < opcode && new_handler; other++) {
+			new_handler = seen[other] == 0 || opcode_table[other] != opcode_table[opcode];
+		}
+
+		handlers += new_handler;
+	}
+
+	printf("  opcode table is %zuK, the run touched %d opcodes on %d cache lines (%dK) through %d handlers\n",
+		sizeof(opcode_table) / 1024, opcodes, lines, lines * 64 / 1024, handlers);
+
+	free(seen);
+}
+
+void bench_report(const char* name, uint32_t frames, double seconds, double baseline) {
+	double mips = (double)frames * CYCLES_PER_FRAME / seconds / 1000000.0;
+
+	if (baseline > 0) {
+		printf("  %-28s %8.3fs %10.0f frames/s %8.2f MIPS %+7.2f%%\n",
+			name, seconds, frames / seconds, mips, (seconds - baseline) / baseline * 100.0);
+	}
+	else {
+		printf("  %-28s %8.3fs %10.0f frames/s %8.2f MIPS\n", name, seconds, frames / seconds, mips);
+	}
+}
+
+double bench_frames_scheduled(struct State* state, uint32_t frames) {
+	struct Scheduler scheduler;
+	scheduler_init(&scheduler);
+
+	uint64_t start_time = SDL_GetPerformanceCounter();
+
+	for (uint32_t frame = 0; frame < frames && state->end_of_program == false; frame++) {
+		state_frame_scheduled(state, &scheduler, NULL);
+	}
+
+	return (double)(SDL_GetPerformanceCounter() - start_time) / SDL_GetPerformanceFrequency();
+}
+
+// The decode cache with write barriers, then without if the ROM's writes are
+// proven to stay out of its code
+void bench_decode_cache(struct State* state, const struct Snapshot* initial, const struct Snapshot* expected, uint32_t frames, double baseline) {
+	state_load(state, initial);
+
+	uint64_t start_time = SDL_GetPerformanceCounter();
+	bool safe = smc_analyze(state);
+	double analysis = (double)(SDL_GetPerformanceCounter() - start_time) / SDL_GetPerformanceFrequency();
+
+	printf("  self-modifying code analysis: %s (%.2fms)\n",
+		safe ? "writes can't reach code" : "writes might reach code", analysis * 1000.0);
+
+	for (int barrier_free = 0; barrier_free <= (safe ? 1 : 0); barrier_free++) {
+		state_load(state, initial);
+
+		if (decode_cache_create(state, barrier_free) == false) {
+			return;
+		}
+
+		double seconds = bench_frames_cached(state, frames);
+		bench_report(barrier_free ? "decode cache, no barriers" : "decode cache, write barriers", frames, seconds, baseline);
+
+		struct DecodeCache* cache = state->decode_cache;
+		printf("  %llu decodes, %llu invalidated%s\n", (unsigned long long)cache->misses,
+			(unsigned long long)cache->invalidations, cache->fell_back ? ", fell back to barriers" : "");
+
+		struct Snapshot snapshot;
+		state_save(state, &snapshot);
+
+		if (memcmp(&snapshot, expected, sizeof(snapshot)) != 0) {
+			printf("  decode cache ended up in a different state to state_step!\n");
+		}
+
+		decode_cache_destroy(state);
+	}
+}
+
+// Stores every frame's snapshot, the way rewind or a search would
+void bench_snapshot_store(struct State* state, const struct Snapshot* initial, uint32_t frames, double baseline) {
+	struct SnapshotStore store;
+	struct StoredSnapshot* stored = malloc(frames * sizeof(struct StoredSnapshot));
+
+	if (stored == NULL || snapshot_store_init(&store) == false) {
+		free(stored);
+		return;
+	}
+
+	state_load(state, initial);
+
+	uint32_t count = 0;
+	uint64_t start_time = SDL_GetPerformanceCounter();
+
+	for (; count < frames && state->end_of_program == false; count++) {
+		state_frame(state, NULL);
+
+		struct Snapshot snapshot;
+		state_save(state, &snapshot);
+
+		if (snapshot_store_put(&store, &snapshot, &stored[count]) == false) {
+			break;
+		}
+	}
+
+	double seconds = (double)(SDL_GetPerformanceCounter() - start_time) / SDL_GetPerformanceFrequency();
+	bench_report("+ snapshot_store_put", count, seconds, baseline * count / frames);
+
+	printf("  %u snapshots in %u unique pages, %.0f bytes each (%zu raw)\n",
+		count, store.unique_pages, snapshot_store_bytes_per_snapshot(&store), sizeof(struct Snapshot));
+
+	for (uint32_t i = 0; i < count; i++) {
+		snapshot_store_release(&store, &stored[i]);
+	}
+
+	snapshot_store_destroy(&store);
+	free(stored);
+}
+
+// --bench: headless throughput of the interpreter and whatever is layered on it
+bool bench_rom(const char* rom_path, uint32_t frames) {
+	struct State* state = state_init();
+
+	if (state == NULL) {
+		return false;
+	}
+
+	if (load_rom(state, rom_path) == false) {
+		state_destroy(state);
+		return false;
+	}
+
+	struct Snapshot initial;
+	state_save(state, &initial);
+
+	struct Observer* observer = observer_create();
+
+	if (observer == NULL) {
+		state_destroy(state);
+		return false;
+	}
+
+	printf("%s, %u frames of %d instructions\n", rom_path, frames, CYCLES_PER_FRAME);
+
+	double baseline = bench_frames(state, frames, NULL);
+	bench_report("state_step", frames, baseline, 0);
+
+	struct Snapshot expected;
+	state_save(state, &expected);
+
+	opcode_table_init();
+	state_load(state, &initial);
+	double table = bench_frames_table(state, frames);
+	bench_report("opcode table engine", frames, table, baseline);
+
+	struct Snapshot snapshot;
+	state_save(state, &snapshot);
+
+	if (memcmp(&snapshot, &expected, sizeof(snapshot)) != 0) {
+		printf("  opcode table engine ended up in a different state to state_step!\n");
+	}
+
+	bench_opcode_footprint(state, &initial, frames);
+	bench_decode_cache(state, &initial, &expected, frames, baseline);
+
+	state_load(state, &initial);
+	double scheduled = bench_frames_scheduled(state, frames);
+	bench_report("scheduler", frames, scheduled, baseline);
+
+	state_save(state, &snapshot);
+
+	if (memcmp(&snapshot, &expected, sizeof(snapshot)) != 0) {
+		printf("  scheduler ended up in a different state to state_step!\n");
+	}
+
+	state_load(state, &initial);
+	double published = bench_frames(state, frames, observer);
+	bench_report("+ observer_publish", frames, published, baseline);
+
+	struct BenchReader reader;
+	reader.observer = observer;
+	reader.reads = 0;
+	SDL_AtomicSet(&reader.running, 1);
+
+	SDL_Thread* reader_thread = SDL_CreateThread(bench_reader_thread, "bench reader", &reader);
+
+	state_load(state, &initial);
+	double contended = bench_frames(state, frames, observer);
+
+	SDL_AtomicSet(&reader.running, 0);
+	SDL_WaitThread(reader_thread, NULL);
+
+	bench_report("+ publish, spinning reader", frames, contended, baseline);
+	printf("  reader took %llu consistent snapshots\n", (unsigned long long)reader.reads);
+
+	state->coverage = calloc(COVERAGE_SIZE, 1);
+
+	if (state->coverage != NULL) {
+		state_load(state, &initial);
+		double covered = bench_frames(state, frames, NULL);
+		bench_report("+ coverage", frames, covered, baseline);
+
+		free(state->coverage);
+		state->coverage = NULL;
+	}
+
+	bench_snapshot_store(state, &initial, frames, baseline);
+
+	observer_destroy(observer);
+	state_destroy(state);
+
+	return true;
+}
+
+// Address -> source line map for coverage reports. One mapping per line, as
+// "<hex address> <source file>:<line>", anything after # is ignored.
+struct SourceMap {
+	int file_count;
+	char** files;
+	// File index + 1 for every address, 0 where there's no source
+	uint16_t* address_files;
+	uint32_t* address_lines;
+};
+
+void source_map_destroy(struct SourceMap* map) {
+	for (int i = 0; i < map->file_count; i++) {
+		free(map->files[i]);
+	}
+
+	free(map->files);
+	free(map->address_files);
+	free(map->address_lines);
+	free(map);
+}
+
+int source_map_file(struct SourceMap* map, const char* name) {
+	for (int i = 0; i < map->file_count; i++) {
+		if (strcmp(map->files[i], name) == 0) {
+			return i;
+		}
+	}
+
+	char** files = realloc(map->files, (map->file_count + 1) * sizeof(char*));
+
+	if (files == NULL || map->file_count == UINT16_MAX - 1) {
+		return -1;
+	}
+
+	map->files = files;
+	map->files[map->file_count] = malloc(strlen(name) + 1);
+
+	if (map->files[map->file_count] == NULL) {
+		return -1;
+	}
+
+	strcpy(map->files[map->file_count], name);
+
+	return map->file_count++;
+}
+
+struct SourceMap* source_map_load(const char* path) {
+	FILE* file = NULL;
+
+	if (fopen_s(&file, path, "rb") != 0) {
+		fprintf(stderr, "Failed to open symbol map %s\n", path);
+		return NULL;
+	}
+
+	struct SourceMap* map = calloc(1, sizeof(struct SourceMap));
+
+	if (map == NULL) {
+		fprintf(stderr, "Failed to allocate symbol map.\n");
+		fclose(file);
+		return NULL;
+	}
+
+	map->address_files = calloc(COVERAGE_SIZE, sizeof(uint16_t));
+	map->address_lines = calloc(COVERAGE_SIZE, sizeof(uint32_t));
+
+	if (map->address_files == NULL || map->address_lines == NULL) {
+		fprintf(stderr, "Failed to allocate symbol map.\n");
+		source_map_destroy(map);
+		fclose(file);
+		return NULL;
+	}
+
+	char text[1024];
+	int line_number = 0;
+	bool success = true;
+
+	while (success && fgets(text, sizeof(text), file) != NULL) {
+		line_number++;
+
+		char* comment = strchr(text, '#');
+
+		if (comment != NULL) {
+			*comment = '\0';
+		}
+
+		unsigned int address = 0;
+		char source[1024];
+
+		if (sscanf(text, "%x %1023s", &address, source) != 2) {
+			// Blank or comment
+			continue;
+		}
+
+		// File names can have colons in them, the line is after the last one
+		char* colon = strrchr(source, ':');
+		int file_index = -1;
+
+		if (colon != NULL && address < COVERAGE_SIZE) {
+			*colon = '\0';
+			map->address_lines[address] = (uint32_t)strtoul(colon + 1, NULL, 10);
+			file_index = source_map_file(map, source);
+		}
+
+		if (file_index < 0 || map->address_lines[address] == 0) {
+			fprintf(stderr, "Bad mapping on line %d of %s\n", line_number, path);
+			success = false;
+			continue;
+		}
+
+		map->address_files[address] = (uint16_t)(file_index + 1);
+	}
+
+	fclose(file);
+
+	if (success == false) {
+		source_map_destroy(map);
+		return NULL;
+	}
+
+	return map;
+}
+
+bool ends_with(const char* text, const char* suffix) {
+	size_t text_length = strlen(text);
+	size_t suffix_length = strlen(suffix);
+
+	return text_length >= suffix_length && strcmp(text + text_length - suffix_length, suffix) == 0;
+}
+
+// With a map every mapped address is code, so skips that never ran still show
+// up as branches. Without one only what ran is known.
+bool coverage_is_branch(const struct State* state, const struct SourceMap* map, uint32_t address) {
+	if ((state->coverage[address] & (COVERAGE_TAKEN | COVERAGE_NOT_TAKEN)) != 0) {
+		return true;
+	}
+
+	if (map == NULL || map->address_files[address] == 0 || address + 1 >= state->memory_size) {
+		return false;
+	}
+
+	return opcode_is_skip(state->memory[address] << 8 | state->memory[address + 1]);
+}
+
+// lcov tracefile. Lines are source lines with a map, or addresses without one.
+// The flags are a bitmap, so hit counts are 0 or 1.
+bool coverage_write_lcov(FILE* file, const struct State* state, const struct SourceMap* map, const char* rom_name) {
+	int file_count = map != NULL ? map->file_count : 1;
+
+	fprintf(file, "TN:\n");
+
+	for (int f = 0; f < file_count; f++) {
+		// Bit 0 for a line with code on it, bit 1 once any of it ran
+		uint32_t line_count = map != NULL ? 0 : (uint32_t)COVERAGE_SIZE;
+
+		for (uint32_t address = 0; map != NULL && address < COVERAGE_SIZE; address++) {
+			if (map->address_files[address] == f + 1 && map->address_lines[address] >= line_count) {
+				line_count = map->address_lines[address] + 1;
+			}
+		}
+
+		uint8_t* lines = calloc(line_count, 1);
+
+		if (lines == NULL) {
+			fprintf(stderr, "Failed to allocate coverage lines.\n");
+			return false;
+		}
+
+		fprintf(file, "SF:%s\n", map != NULL ? map->files[f] : rom_name);
+
+		int branches_found = 0;
+		int branches_hit = 0;
+
+		for (uint32_t address = 0; address < COVERAGE_SIZE; address++) {
+			uint8_t flags = state->coverage[address];
+			bool in_file = map != NULL ? map->address_files[address] == f + 1 : flags != 0;
+
+			if (in_file == false) {
+				continue;
+			}
+
+			uint32_t line = map != NULL ? map->address_lines[address] : address;
+			lines[line] |= (flags & COVERAGE_EXECUTED) ? 0x3 : 0x1;
+
+			if (coverage_is_branch(state, map, address) == false) {
+				continue;
+			}
+
+			// Taken is branch 0, not taken branch 1, - when the skip never ran
+			if (flags & COVERAGE_EXECUTED) {
+				fprintf(file, "BRDA:%u,%u,0,%d\n", line, address, (flags & COVERAGE_TAKEN) != 0);
+				fprintf(file, "BRDA:%u,%u,1,%d\n", line, address, (flags & COVERAGE_NOT_TAKEN) != 0);
+			}
+			else {
+				fprintf(file, "BRDA:%u,%u,0,-\nBRDA:%u,%u,1,-\n", line, address, line, address);
+			}
+
+			branches_found += 2;
+			branches_hit += ((flags & COVERAGE_TAKEN) != 0) + ((flags & COVERAGE_NOT_TAKEN) != 0);
+		}
+
+		int lines_found = 0;
+		int lines_hit = 0;
+
+		for (uint32_t line = 0; line < line_count; line++) {
+			if (lines[line] != 0) {
+				fprintf(file, "DA:%u,%d\n", line, lines[line] >> 1);
+				lines_found++;
+				lines_hit += lines[line] >> 1;
+			}
+		}
+
+		free(lines);
+
+		fprintf(file, "BRF:%d\nBRH:%d\nLF:%d\nLH:%d\nend_of_record\n", branches_found, branches_hit, lines_found, lines_hit);
+	}
+
+	return true;
+}
+
+// As a quoted JSON string, Windows paths and all
+void json_write_string(FILE* file, const char* text) {
+	fputc('"', file);
+
+	for (const unsigned char* c = (const unsigned char*)text; *c != '\0'; c++) {
+		if (*c == '"' || *c == '\\') {
+			fprintf(file, "\\%c", *c);
+		}
+		else if (*c < 0x20) {
+			fprintf(file, "\\u%04x", *c);
+		}
+		else {
+			fputc(*c, file);
+		}
+	}
+
+	fputc('"', file);
+}
+
+// Everything that ran, for diffing runs against each other, plus the same
+// per line view as lcov when there's a map
+void coverage_write_json(FILE* file, const struct State* state, const struct SourceMap* map, const char* rom_name) {
+	fprintf(file, "{\n  \"rom\": ");
+	json_write_string(file, rom_name);
+	fprintf(file, ",\n  \"executed\": [");
+
+	const char* separator = "";
+
+	for (uint32_t address = 0; address < COVERAGE_SIZE; address++) {
+		if (state->coverage[address] & COVERAGE_EXECUTED) {
+			fprintf(file, "%s%u", separator, address);
+			separator = ", ";
+		}
+	}
+
+	fprintf(file, "],\n  \"branches\": [");
+	separator = "\n    ";
+
+	for (uint32_t address = 0; address < COVERAGE_SIZE; address++) {
+		uint8_t flags = state->coverage[address];
+
+		if (coverage_is_branch(state, map, address)) {
+			fprintf(file, "%s{\"address\": %u, \"taken\": %s, \"not_taken\": %s}", separator, address,
+				(flags & COVERAGE_TAKEN) ? "true" : "false", (flags & COVERAGE_NOT_TAKEN) ? "true" : "false");
+			separator = ",\n    ";
+		}
+	}
+
+	fprintf(file, "\n  ],\n  \"lines\": [");
+	separator = "\n    ";
+
+	for (uint32_t address = 0; map != NULL && address < COVERAGE_SIZE; address++) {
+		if (map->address_files[address] != 0) {
+			fprintf(file, "%s{\"address\": %u, \"file\": ", separator, address);
+			json_write_string(file, map->files[map->address_files[address] - 1]);
+			fprintf(file, ", \"line\": %u, \"executed\": %s}", map->address_lines[address],
+				(state->coverage[address] & COVERAGE_EXECUTED) ? "true" : "false");
+			separator = ",\n    ";
+		}
+	}
+
+	fprintf(file, "\n  ]\n}\n");
+}
+
+// --coverage: runs a recording (or a ROM with no input for --bench-frames)
+// headless and writes which addresses and skip directions it exercised.
+// .json outputs get JSON, anything else an lcov tracefile.
+bool coverage_run(const char* rom_path, const char* play_path, const char* symbols_path, const char* output_path, uint32_t frames) {
+	struct State* state = state_init();
+	struct Recording* playback = NULL;
+
+	if (state == NULL) {
+		return false;
+	}
+
+	if (play_path != NULL) {
+		playback = recording_open(play_path);
+
+		if (playback == NULL || recording_seek(playback, state, 0) == false) {
+			state_destroy(state);
+			return false;
+		}
+
+		frames = playback->frame_count;
+	}
+	else if (load_rom(state, rom_path) == false) {
+		state_destroy(state);
+		return false;
+	}
+
+	struct SourceMap* map = NULL;
+
+	if (symbols_path != NULL) {
+		map = source_map_load(symbols_path);
+
+		if (map == NULL) {
+			state_destroy(state);
+			return false;
+		}
+	}
+
+	state->coverage = calloc(COVERAGE_SIZE, 1);
+
+	if (state->coverage == NULL) {
+		fprintf(stderr, "Failed to allocate coverage.\n");
+
+		if (map != NULL) {
+			source_map_destroy(map);
+		}
+
+		if (playback != NULL) {
+			recording_close(playback);
+		}
+
+		state_destroy(state);
+		return false;
+	}
+
+	for (uint32_t frame = 0; frame < frames && state->end_of_program == false; frame++) {
+		struct FrameInput input;
+		input.count = 0;
+
+		if (playback != NULL) {
+			recording_input(playback, frame, &input);
+		}
+
+		state_frame(state, &input);
+	}
+
+	FILE* file = NULL;
+	bool success = false;
+
+	if (fopen_s(&file, output_path, "wb") != 0) {
+		fprintf(stderr, "Failed to open coverage output %s\n", output_path);
+	}
+	else {
+		const char* name = play_path != NULL ? play_path : rom_path;
+
+		if (ends_with(output_path, ".json")) {
+			coverage_write_json(file, state, map, name);
+			success = true;
+		}
+		else {
+			success = coverage_write_lcov(file, state, map, name);
+		}
+
+		success = fclose(file) == 0 && success;
+	}
+
+	int executed = 0;
+	int directions = 0;
+	int branches = 0;
+
+	for (uint32_t address = 0; address < COVERAGE_SIZE; address++) {
+		executed += (state->coverage[address] & COVERAGE_EXECUTED) != 0;
+		directions += ((state->coverage[address] & COVERAGE_TAKEN) != 0) + ((state->coverage[address] & COVERAGE_NOT_TAKEN) != 0);
+		branches += coverage_is_branch(state, map, address) ? 2 : 0;
+	}
+
+	printf("%u frames, %d addresses executed, %d of %d skip directions taken\n", frames, executed, directions, branches);
+
+	free(state->coverage);
+	state->coverage = NULL;
+
+	if (map != NULL) {
+		source_map_destroy(map);
+	}
+
+	if (playback != NULL) {
+		recording_close(playback);
+	}
+
+	state_destroy(state);
+
+	return success;
+}
+
+enum ScanPredicate {
+	SCAN_CHANGED = 0,
+	SCAN_UNCHANGED,
+	SCAN_INCREASED,
+	SCAN_DECREASED,
+	SCAN_EQUALS
+};
+
+// Snapshot memory at frame, and keep addresses where predicate holds against
+// the snapshot before
+struct ScanStep {
+	uint32_t frame;
+	uint8_t predicate;
+	uint8_t value;
+};
+
+const int SCAN_MAX_STEPS = 64;
+// Candidates listed with their values at the end
+const int SCAN_MAX_LISTED = 32;
+
+// Parses "frame:predicate,..." where predicate is changed, unchanged,
+// increased, decreased or =N. Returns the step count, or -1.
+int parse_scan_steps(const char* text, struct ScanStep* steps) {
+	int count = 0;
+	uint32_t last_frame = 0;
+
+	while (*text != '\0') {
+		char* end;
+		uint32_t frame = (uint32_t)strtoul(text, &end, 10);
+
+		if (end == text || *end != ':' || frame <= last_frame || count == SCAN_MAX_STEPS) {
+			fprintf(stderr, "Scan steps need increasing frames, as frame:predicate,... (at most %d)\n", SCAN_MAX_STEPS);
+			return -1;
+		}
+
+		const char* name = end + 1;
+		size_t length = strcspn(name, ",");
+		struct ScanStep* step = &steps[count];
+
+		step->frame = frame;
+		step->value = 0;
+
+		if (length == 7 && strncmp(name, "changed", length) == 0) {
+			step->predicate = SCAN_CHANGED;
+		}
+		else if (length == 9 && strncmp(name, "unchanged", length) == 0) {
+			step->predicate = SCAN_UNCHANGED;
+		}
+		else if (length == 9 && strncmp(name, "increased", length) == 0) {
+			step->predicate = SCAN_INCREASED;
+		}
+		else if (length == 9 && strncmp(name, "decreased", length) == 0) {
+			step->predicate = SCAN_DECREASED;
+		}
+		else if (length > 1 && name[0] == '=') {
+			step->predicate = SCAN_EQUALS;
+			step->value = (uint8_t)strtoul(name + 1, NULL, 0);
+		}
+		else {
+			fprintf(stderr, "Unknown scan predicate %.*s\n", (int)length, name);
+			return -1;
+		}
+
+		last_frame = frame;
+		count++;
+		text = name[length] == ',' ? name + length + 1 : name + length;
+	}
+
+	return count;
+}
+
+#ifdef HAVE_AVX2
+static FORCE_INLINE __m256i scan_predicate_avx2(__m256i previous, __m256i current, const struct ScanStep* step) {
+	__m256i same = _mm256_cmpeq_epi8(previous, current);
+	__m256i ones = _mm256_set1_epi8(-1);
+
+	switch (step->predicate) {
+	case SCAN_CHANGED: return _mm256_xor_si256(same, ones);
+	case SCAN_UNCHANGED: return same;
+	// Unsigned greater than: the max is current and they differ
+	case SCAN_INCREASED: return _mm256_andnot_si256(same, _mm256_cmpeq_epi8(_mm256_max_epu8(previous, current), current));
+	case SCAN_DECREASED: return _mm256_andnot_si256(same, _mm256_cmpeq_epi8(_mm256_max_epu8(previous, current), previous));
+	default: return _mm256_cmpeq_epi8(current, _mm256_set1_epi8((char)step->value));
+	}
+}
+#endif
+
+#ifdef HAVE_SSE2
+static FORCE_INLINE __m128i scan_predicate_sse2(__m128i previous, __m128i current, const struct ScanStep* step) {
+	__m128i same = _mm_cmpeq_epi8(previous, current);
+	__m128i ones = _mm_set1_epi8(-1);
+
+	switch (step->predicate) {
+	case SCAN_CHANGED: return _mm_xor_si128(same, ones);
+	case SCAN_UNCHANGED: return same;
+	case SCAN_INCREASED: return _mm_andnot_si128(same, _mm_cmpeq_epi8(_mm_max_epu8(previous, current), current));
+	case SCAN_DECREASED: return _mm_andnot_si128(same, _mm_cmpeq_epi8(_mm_max_epu8(previous, current), previous));
+	default: return _mm_cmpeq_epi8(current, _mm_set1_epi8((char)step->value));
+	}
+}
+#endif
+
+bool scan_predicate(uint8_t previous, uint8_t current, const struct ScanStep* step) {
+	switch (step->predicate) {
+	case SCAN_CHANGED: return current != previous;
+	case SCAN_UNCHANGED: return current == previous;
+	case SCAN_INCREASED: return current > previous;
+	case SCAN_DECREASED: return current < previous;
+	default: return current == step->value;
+	}
+}
+
+int scan_count_bits(uint32_t bits) {
+	int count = 0;
+
+	for (; bits != 0; bits &= bits - 1) {
+		count++;
+	}
+
+	return count;
+}
+
+// Runs every step over a block of addresses before moving to the next block,
+// so the candidate mask stays in a register. images holds step_count + 1
+// memory images, the first is the one the first step compares against.
+// candidates gets 0xFF for every address that passed them all, counts the
+// candidates left after each step.
+void scan_filter(const uint8_t* images, const struct ScanStep* steps, int step_count, uint8_t* candidates, uint32_t* counts) {
+	size_t address = 0;
+
+	memset(counts, 0, step_count * sizeof(uint32_t));
+
+#ifdef HAVE_AVX2
+	for (; address + 32 <= MEMORY_SIZE; address += 32) {
+		__m256i mask = _mm256_set1_epi8(-1);
+		__m256i previous = _mm256_loadu_si256((const __m256i*)&images[address]);
+
+		for (int i = 0; i < step_count; i++) {
+			__m256i current = _mm256_loadu_si256((const __m256i*)&images[(i + 1) * MEMORY_SIZE + address]);
+
+			mask = _mm256_and_si256(mask, scan_predicate_avx2(previous, current, &steps[i]));
+			counts[i] += scan_count_bits((uint32_t)_mm256_movemask_epi8(mask));
+			previous = current;
+		}
+
+		_mm256_storeu_si256((__m256i*)&candidates[address], mask);
+	}
+#endif
+
+#ifdef HAVE_SSE2
+	for (; address + 16 <= MEMORY_SIZE; address += 16) {
+		__m128i mask = _mm_set1_epi8(-1);
+		__m128i previous = _mm_loadu_si128((const __m128i*)&images[address]);
+
+		for (int i = 0; i < step_count; i++) {
+			__m128i current = _mm_loadu_si128((const __m128i*)&images[(i + 1) * MEMORY_SIZE + address]);
+
+			mask = _mm_and_si128(mask, scan_predicate_sse2(previous, current, &steps[i]));
+			counts[i] += scan_count_bits((uint32_t)_mm_movemask_epi8(mask));
+			previous = current;
+		}
+
+		_mm_storeu_si128((__m128i*)&candidates[address], mask);
+	}
+#endif
+
+	for (; address < MEMORY_SIZE; address++) {
+		bool candidate = true;
+
+		for (int i = 0; i < step_count && candidate; i++) {
+			candidate = scan_predicate(images[i * MEMORY_SIZE + address], images[(i + 1) * MEMORY_SIZE + address], &steps[i]);
+			counts[i] += candidate;
+		}
+
+		candidates[address] = candidate ? 0xFF : 0;
+	}
+}
+
+// --scan: plays a ROM (or a recording, for input) and narrows down where it
+// keeps a variable from how memory changes between the given frames
+bool scan_run(const char* rom_path, const char* play_path, const char* steps_text) {
+	struct ScanStep steps[64];
+	int step_count = parse_scan_steps(steps_text, steps);
+
+	if (step_count <= 0) {
+		return false;
+	}
+
+	struct State* state = state_init();
+	struct Recording* playback = NULL;
+
+	if (state == NULL) {
+		return false;
+	}
+
+	if (play_path != NULL) {
+		playback = recording_open(play_path);
+
+		if (playback == NULL || recording_seek(playback, state, 0) == false) {
+			state_destroy(state);
+			return false;
+		}
+	}
+	else if (load_rom(state, rom_path) == false) {
+		state_destroy(state);
+		return false;
+	}
+
+	uint8_t* images = malloc((size_t)(step_count + 1) * MEMORY_SIZE);
+	uint8_t* candidates = malloc(MEMORY_SIZE);
+	bool success = images != NULL && candidates != NULL;
+
+	if (success == false) {
+		fprintf(stderr, "Failed to allocate memory scan.\n");
+	}
+	else if (state->memory_size != MEMORY_SIZE) {
+		fprintf(stderr, "MegaChip memory can't be scanned\n");
+		success = false;
+	}
+
+	if (success) {
+		memcpy(images, state->memory, MEMORY_SIZE);
+
+		uint32_t frame = 0;
+
+		for (int i = 0; i < step_count; i++) {
+			for (; frame < steps[i].frame; frame++) {
+				struct FrameInput input;
+				input.count = 0;
+
+				if (playback != NULL && frame < playback->frame_count) {
+					recording_input(playback, frame, &input);
+				}
+
+				state_frame(state, &input);
+			}
+
+			memcpy(&images[(i + 1) * MEMORY_SIZE], state->memory, MEMORY_SIZE);
+		}
+
+		uint32_t counts[64];
+		scan_filter(images, steps, step_count, candidates, counts);
+
+		for (int i = 0; i < step_count; i++) {
+			printf("Frame %6u: %4u candidates\n", steps[i].frame, counts[i]);
+		}
+
+		int listed = 0;
+
+		for (size_t address = 0; address < MEMORY_SIZE && listed < SCAN_MAX_LISTED; address++) {
+			if (candidates[address] == 0) {
+				continue;
+			}
+
+			printf("  0x%03X:", (unsigned)address);
+
+			for (int i = 0; i <= step_count; i++) {
+				printf(" %3u", images[i * MEMORY_SIZE + address]);
+			}
+
+			printf("\n");
+			listed++;
+		}
+
+		if (counts[step_count - 1] > (uint32_t)listed) {
+			printf("  ... and %u more\n", counts[step_count - 1] - listed);
+		}
+	}
+
+	free(images);
+	free(candidates);
+
+	if (playback != NULL) {
+		recording_close(playback);
+	}
+
+	state_destroy(state);
+
+	return success;
+}
+
+// PNG without zlib: the image data is small enough to go in stored deflate
+// blocks, so writing one is a CRC and a copy. Screenshots are grayscale, 1 bit
+// for one plane and 2 bits for XO-CHIP, so a 64x32 frame is 256 bytes of pixels.
+uint32_t png_crc_table[256];
+
+uint32_t png_crc(const uint8_t* data, size_t size, uint32_t crc) {
+	if (png_crc_table[1] == 0) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t value = i;
+
+			for (int bit = 0; bit < 8; bit++) {
+				value = (value & 1) ? 0xEDB88320 ^ (value >> 1) : value >> 1;
+			}
+
+			png_crc_table[i] = value;
+		}
+	}
+
+	crc = ~crc;
+
+	for (size_t i = 0; i < size; i++) {
+		crc = png_crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	}
+
+	return ~crc;
+}
+
+void png_put_u32(uint8_t* bytes, uint32_t value) {
+	bytes[0] = value >> 24;
+	bytes[1] = value >> 16;
+	bytes[2] = value >> 8;
+	bytes[3] = value;
+}
+
+uint32_t png_get_u32(const uint8_t* bytes) {
+	return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | bytes[3];
+}
+
+void png_write_chunk(FILE* file, const char* type, const uint8_t* data, uint32_t size) {
+	uint8_t header[8];
+	png_put_u32(header, size);
+	memcpy(&header[4], type, 4);
+
+	uint8_t crc[4];
+	png_put_u32(crc, png_crc(data, size, png_crc(&header[4], 4, 0)));
+
+	fwrite(header, 1, sizeof(header), file);
+	fwrite(data, 1, size, file);
+	fwrite(crc, 1, sizeof(crc), file);
+}
+
+// rows are the scanlines, each led by its filter byte (always 0 here).
+// palette is 3 bytes a colour for color_type 3, otherwise NULL.
+bool png_write(const char* path, int width, int height, int bit_depth, int color_type,
+	const uint8_t* palette, int palette_colors, const uint8_t* rows, size_t size) {
+	// zlib header, stored blocks of up to 64K, Adler-32
+	size_t blocks = size / 0xFFFF + 1;
+	uint8_t* idat = malloc(2 + blocks * 5 + size + 4);
+
+	if (idat == NULL) {
+		fprintf(stderr, "Failed to allocate PNG data\n");
+		return false;
+	}
+
+	size_t length = 0;
+	idat[length++] = 0x78;
+	idat[length++] = 0x01;
+
+	uint32_t adler_a = 1;
+	uint32_t adler_b = 0;
+
+	size_t offset = 0;
+
+	// At least one block, even for no data
+	do {
+		uint16_t count = size - offset < 0xFFFF ? (uint16_t)(size - offset) : 0xFFFF;
+
+		idat[length++] = offset + count == size;
+		idat[length++] = count;
+		idat[length++] = count >> 8;
+		idat[length++] = ~count;
+		idat[length++] = (uint16_t)~count >> 8;
+
+		memcpy(&idat[length], &rows[offset], count);
+		length += count;
+
+		for (int i = 0; i < count; i++) {
+			adler_a = (adler_a + rows[offset + i]) % 65521;
+			adler_b = (adler_b + adler_a) % 65521;
+		}
+
+		offset += count;
+	} while (offset < size);
+
+	png_put_u32(&idat[length], adler_b << 16 | adler_a);
+	length += 4;
+
+	FILE* file = NULL;
+	fopen_s(&file, path, "wb");
+
+	if (file == NULL) {
+		fprintf(stderr, "Unable to create %s\n", path);
+		free(idat);
+		return false;
+	}
+
+	const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	fwrite(signature, 1, sizeof(signature), file);
+
+	uint8_t header[13];
+	png_put_u32(&header[0], width);
+	png_put_u32(&header[4], height);
+	header[8] = bit_depth;
+	header[9] = color_type;
+	// Deflate, adaptive filtering, no interlacing
+	header[10] = 0;
+	header[11] = 0;
+	header[12] = 0;
+
+	png_write_chunk(file, "IHDR", header, sizeof(header));
+
+	if (palette != NULL) {
+		png_write_chunk(file, "PLTE", palette, palette_colors * 3);
+	}
+
+	png_write_chunk(file, "IDAT", idat, (uint32_t)length);
+	png_write_chunk(file, "IEND", NULL, 0);
+
+	free(idat);
+
+	bool success = ferror(file) == 0;
+	success = fclose(file) == 0 && success;
+
+	if (success == false) {
+		fprintf(stderr, "Failed to write %s\n", path);
+	}
+
+	return success;
+}
+
+// Straight from video_buffer: one plane's rows are already MSB first bits
+bool screenshot_save(const struct State* state, const char* path) {
+	if (state->megachip_mode) {
+		fprintf(stderr, "MegaChip screens can't be saved as screenshots\n");
+		return false;
+	}
+
+	const struct Framebuffer* framebuffer = state_framebuffer(state);
+	int bit_depth = framebuffer->planes > 1 ? 2 : 1;
+	int row_bytes = framebuffer->width * bit_depth / 8;
+
+	// Grey for each PLANE_COLORS index: black, white, light and dark
+	const uint8_t levels[4] = { 0, 3, 2, 1 };
+
+	uint8_t rows[64 * (1 + 128 * 2 / 8)];
+	uint8_t* row = rows;
+
+	for (int y = 0; y < framebuffer->height; y++) {
+		*row++ = 0;
+
+		const uint64_t* words = &state->video_buffer[y * framebuffer->words_per_row];
+
+		if (bit_depth == 1) {
+			for (int i = 0; i < row_bytes; i++) {
+				*row++ = words[i / 8] >> (56 - i % 8 * 8);
+			}
+
+			continue;
+		}
+
+		const uint64_t* plane2 = &state->video_buffer[(framebuffer->height + y) * framebuffer->words_per_row];
+
+		for (int i = 0; i < row_bytes; i++) {
+			int x = i * 4;
+			uint8_t first = words[x / 64] >> (60 - x % 64);
+			uint8_t second = plane2[x / 64] >> (60 - x % 64);
+			uint8_t byte = 0;
+
+			for (int pixel = 0; pixel < 4; pixel++) {
+				int color = (first >> (3 - pixel) & 1) | (second >> (3 - pixel) & 1) << 1;
+				byte |= levels[color] << (6 - pixel * 2);
+			}
+
+			*row++ = byte;
+		}
+	}
+
+	return png_write(path, framebuffer->width, framebuffer->height, bit_depth, 0, NULL, 0, rows, row - rows);
+}
+
+// Reads back the grayscale PNGs png_write makes, as one 0-255 byte per pixel.
+// Anything actually compressed is refused rather than carrying an inflater.
+uint8_t* png_read_gray(const char* path, int* width, int* height) {
+	FILE* file = NULL;
+	fopen_s(&file, path, "rb");
+
+	if (file == NULL) {
+		fprintf(stderr, "Unable to open %s\n", path);
+		return NULL;
+	}
+
+	fseek(file, 0, SEEK_END);
+	long file_size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	uint8_t* bytes = file_size > 8 ? malloc(file_size) : NULL;
+	bool success = bytes != NULL && fread(bytes, 1, file_size, file) == (size_t)file_size &&
+		memcmp(bytes, "\x89PNG\r\n\x1A\n", 8) == 0;
+	fclose(file);
+
+	// Stored deflate is the image data with 5 byte block headers mixed in
+	uint8_t* data = success ? malloc(file_size) : NULL;
+	size_t data_size = 0;
+	int bit_depth = 0;
+	*width = 0;
+	*height = 0;
+
+	for (long offset = 8; success && data != NULL && offset + 12 <= file_size;) {
+		uint32_t size = png_get_u32(&bytes[offset]);
+		const uint8_t* type = &bytes[offset + 4];
+
+		if (size > (uint32_t)(file_size - offset - 12)) {
+			success = false;
+			break;
+		}
+
+		if (memcmp(type, "IHDR", 4) == 0 && size == 13) {
+			*width = png_get_u32(&bytes[offset + 8]);
+			*height = png_get_u32(&bytes[offset + 12]);
+			int depth = bytes[offset + 16];
+			// Grayscale, not interlaced
+			success = bytes[offset + 17] == 0 && bytes[offset + 20] == 0 &&
+				(depth == 1 || depth == 2 || depth == 4 || depth == 8) &&
+				*width > 0 && *width <= 4096 && *height > 0 && *height <= 4096;
+			bit_depth = success ? depth : 0;
+		}
+		else if (memcmp(type, "IDAT", 4) == 0) {
+			memcpy(&data[data_size], &bytes[offset + 8], size);
+			data_size += size;
+		}
+
+		offset += 12 + size;
+	}
+
+	free(bytes);
+
+	size_t row_bytes = ((size_t)*width * bit_depth + 7) / 8;
+	size_t rows_size = (row_bytes + 1) * *height;
+	uint8_t* rows = success && data != NULL && bit_depth != 0 ? malloc(rows_size) : NULL;
+	size_t rows_length = 0;
+
+	if (rows != NULL) {
+		size_t offset = 2;
+		bool last = false;
+
+		while (success && last == false) {
+			// Only BTYPE 00, stored
+			if (offset + 5 > data_size || (data[offset] & 0x6) != 0) {
+				success = false;
+				break;
+			}
+
+			last = data[offset] & 1;
+			size_t count = data[offset + 1] | data[offset + 2] << 8;
+			offset += 5;
+
+			if (offset + count > data_size || rows_length + count > rows_size) {
+				success = false;
+				break;
+			}
+
+			memcpy(&rows[rows_length], &data[offset], count);
+			rows_length += count;
+			offset += count;
+		}
+
+		success = success && rows_length == rows_size;
+	}
+
+	free(data);
+
+	uint8_t* pixels = success && rows != NULL ? malloc((size_t)*width * *height) : NULL;
+	int max_level = pixels != NULL ? (1 << bit_depth) - 1 : 0;
+
+	for (int y = 0; pixels != NULL && y < *height; y++) {
+		const uint8_t* row = &rows[y * (row_bytes + 1)];
+
+		// Filtering would need unfiltering, and png_write never does it
+		if (row[0] != 0) {
+			free(pixels);
+			pixels = NULL;
+			break;
+		}
+
+		for (int x = 0; x < *width; x++) {
+			int bit = x * bit_depth;
+			int level = row[1 + bit / 8] >> (8 - bit_depth - bit % 8) & max_level;
+			pixels[y * *width + x] = level * 255 / max_level;
+		}
+	}
+
+	free(rows);
+
+	if (pixels == NULL) {
+		fprintf(stderr, "%s isn't a screenshot, only uncompressed grayscale PNGs can be compared\n", path);
+	}
+
+	return pixels;
+}
+
+// --diff: compares a screenshot against a golden one. With --diff-out the
+// result is an RGB image: matching pixels dimmed, pixels only lit (or
+// brighter) in the screenshot red, and only in the golden green.
+bool diff_screenshots(const char* golden_path, const char* path, const char* output_path, bool* identical) {
+	int golden_width;
+	int golden_height;
+	int width;
+	int height;
+	uint8_t* golden = png_read_gray(golden_path, &golden_width, &golden_height);
+	uint8_t* pixels = golden != NULL ? png_read_gray(path, &width, &height) : NULL;
+
+	if (pixels == NULL) {
+		free(golden);
+		return false;
+	}
+
+	if (width != golden_width || height != golden_height) {
+		printf("%s is %dx%d but %s is %dx%d\n", path, width, height, golden_path, golden_width, golden_height);
+		*identical = false;
+		free(golden);
+		free(pixels);
+		return true;
+	}
+
+	uint32_t different = 0;
+	size_t row_bytes = 1 + (size_t)width * 3;
+	uint8_t* rows = output_path != NULL ? malloc(row_bytes * height) : NULL;
+
+	for (int y = 0; y < height; y++) {
+		uint8_t* row = rows != NULL ? &rows[y * row_bytes] : NULL;
+
+		if (row != NULL) {
+			*row++ = 0;
+		}
+
+		for (int x = 0; x < width; x++) {
+			uint8_t expected = golden[y * width + x];
+			uint8_t actual = pixels[y * width + x];
+
+			different += actual != expected;
+
+			if (row != NULL) {
+				row[x * 3] = actual == expected ? actual / 4 : actual > expected ? 255 : 0;
+				row[x * 3 + 1] = actual == expected ? actual / 4 : actual < expected ? 255 : 0;
+				row[x * 3 + 2] = actual == expected ? actual / 4 : 0;
+			}
+		}
+	}
+
+	printf("%s: %u of %d pixels differ from %s\n", path, different, width * height, golden_path);
+	*identical = different == 0;
+
+	bool success = true;
+
+	if (output_path != NULL) {
+		success = rows != NULL && png_write(output_path, width, height, 8, 2, NULL, 0, rows, row_bytes * height);
+	}
+
+	free(rows);
+	free(golden);
+	free(pixels);
+
+	return success;
+}
+
+// --screenshots: saves every nth frame of a headless run, as <dir>/<frame>.png
+bool screenshots_run(const char* rom_path, const char* play_path, const char* dir, uint32_t frames, uint32_t every) {
+	struct State* state = state_init();
+	struct Recording* playback = NULL;
+
+	if (state == NULL) {
+		return false;
+	}
+
+	if (play_path != NULL) {
+		playback = recording_open(play_path);
+
+		if (playback == NULL || recording_seek(playback, state, 0) == false) {
+			state_destroy(state);
+			return false;
+		}
+
+		frames = playback->frame_count;
+	}
+	else if (load_rom(state, rom_path) == false) {
+		state_destroy(state);
+		return false;
+	}
+
+	every = every > 0 ? every : 1;
+
+	bool success = true;
+	uint32_t saved = 0;
+	uint64_t encode_time = 0;
+
+	for (uint32_t frame = 1; frame <= frames && success; frame++) {
+		struct FrameInput input;
+		input.count = 0;
+
+		if (playback != NULL) {
+			recording_input(playback, frame - 1, &input);
+		}
+
+		state_frame(state, &input);
+
+		if (frame % every == 0) {
+			char path[4096];
+			snprintf(path, sizeof(path), "%s/%06u.png", dir, frame);
+
+			uint64_t start_time = SDL_GetPerformanceCounter();
+			success = screenshot_save(state, path);
+			encode_time += SDL_GetPerformanceCounter() - start_time;
+			saved++;
+		}
+	}
+
+	if (saved > 0) {
+		printf("%u screenshots in %s, %.1fus each\n", saved, dir,
+			(double)encode_time / SDL_GetPerformanceFrequency() * 1000000.0 / saved);
+	}
+
+	if (playback != NULL) {
+		recording_close(playback);
+	}
+
+	state_destroy(state);
+
+	return success;
+}
+
+enum DisplayFilter {
+	FILTER_SCALE2X = 0x1,
+	FILTER_SCALE3X = 0x2,
+	FILTER_SCANLINES = 0x4,
+	FILTER_CRT = 0x8
+};
+
+// CPU side post-processing, straight into the window sized streaming texture.
+// scale2x/3x run on the framebuffer, then one pass scales that up to the window
+// and applies the scanline/CRT brightness mask on the way.
+struct Filter {
+	int filters;
+	// Framebuffer geometry the buffers below were last set up for
+	int width;
+	int height;
+	// RGBA framebuffer with a 1 pixel border, so neighbour loads never go out of bounds
+	uint32_t* padded;
+	// scale2x/3x output, up to 3x the largest framebuffer
+	uint32_t* scaled;
+	// Source column for every window column
+	uint32_t* columns;
+	// One scaled up source row, reused for every window row it covers
+	uint32_t* row;
+	// Per channel brightness (255 = unchanged) for normal and scanline rows
+	uint32_t* bright;
+	uint32_t* dark;
+	bool bright_is_identity;
+	bool dark_is_identity;
+};
+
+void filter_destroy(struct Filter* filter) {
+	free(filter->padded);
+	free(filter->scaled);
+	free(filter->columns);
+	free(filter->row);
+	free(filter->bright);
+	free(filter->dark);
+	free(filter);
+}
+
+struct Filter* filter_create(int filters) {
+	struct Filter* filter = calloc(1, sizeof(struct Filter));
+
+	if (filter == NULL) {
+		fprintf(stderr, "Failed to allocate display filter.\n");
+		return NULL;
+	}
+
+	filter->filters = filters;
+	filter->padded = calloc((128 + 2) * (64 + 2), sizeof(uint32_t));
+	filter->scaled = calloc(128 * 3 * 64 * 3, sizeof(uint32_t));
+	filter->columns = calloc(WINDOW_WIDTH, sizeof(uint32_t));
+	filter->row = calloc(WINDOW_WIDTH, sizeof(uint32_t));
+	filter->bright = calloc(WINDOW_WIDTH, sizeof(uint32_t));
+	filter->dark = calloc(WINDOW_WIDTH, sizeof(uint32_t));
+
+	if (filter->padded == NULL || filter->scaled == NULL || filter->columns == NULL ||
+		filter->row == NULL || filter->bright == NULL || filter->dark == NULL) {
+		fprintf(stderr, "Failed to allocate display filter buffers.\n");
+		filter_destroy(filter);
+		return NULL;
+	}
+
+	// Aperture grille: each column favours one of R, G, B
+	const uint32_t triads[3] = { 0xFFB4B4FF, 0xB4FFB4FF, 0xB4B4FFFF };
+
+	filter->bright_is_identity = (filters & FILTER_CRT) == 0;
+	filter->dark_is_identity = (filters & (FILTER_SCANLINES | FILTER_CRT)) == 0;
+
+	for (int x = 0; x < WINDOW_WIDTH; x++) {
+		filter->bright[x] = (filters & FILTER_CRT) ? triads[x % 3] : 0xFFFFFFFF;
+		filter->dark[x] = filter->bright[x];
+
+		// Every other window row at 60%, alpha always kept
+		if (filters & (FILTER_SCANLINES | FILTER_CRT)) {
+			uint32_t weight = filter->bright[x];
+			filter->dark[x] = 0xFF;
+
+			for (int shift = 8; shift < 32; shift += 8) {
+				filter->dark[x] |= (((weight >> shift) & 0xFF) * 154 / 255) << shift;
+			}
+		}
+	}
+
+	return filter;
+}
+
+// 1: D==B && B!=F && D!=H. The four scale2x corner rules are all this with the
+// neighbours rotated.
+#ifdef HAVE_SSE2
+static FORCE_INLINE __m128i filter_corner_sse2(__m128i d, __m128i b, __m128i f, __m128i h) {
+	__m128i db = _mm_cmpeq_epi32(d, b);
+	__m128i bf = _mm_cmpeq_epi32(b, f);
+	__m128i dh = _mm_cmpeq_epi32(d, h);
+
+	return _mm_andnot_si128(_mm_or_si128(bf, dh), db);
+}
+
+static FORCE_INLINE __m128i filter_select_sse2(__m128i mask, __m128i a, __m128i b) {
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+#endif
+
+static FORCE_INLINE bool filter_corner(uint32_t d, uint32_t b, uint32_t f, uint32_t h) {
+	return d == b && b != f && d != h;
+}
+
+void filter_scale2x(const struct Filter* filter, int width, int height) {
+	int stride = width + 2;
+	int out_width = width * 2;
+
+	for (int y = 0; y < height; y++) {
+		const uint32_t* above = &filter->padded[y * stride + 1];
+		const uint32_t* center = above + stride;
+		const uint32_t* below = center + stride;
+		uint32_t* out0 = &filter->scaled[(y * 2) * out_width];
+		uint32_t* out1 = out0 + out_width;
+		int x = 0;
+
+#ifdef HAVE_SSE2
+		// Widths are all multiples of 4
+		for (; x + 4 <= width; x += 4) {
+			__m128i b = _mm_loadu_si128((const __m128i*)&above[x]);
+			__m128i h = _mm_loadu_si128((const __m128i*)&below[x]);
+			__m128i d = _mm_loadu_si128((const __m128i*)&center[x - 1]);
+			__m128i e = _mm_loadu_si128((const __m128i*)&center[x]);
+			__m128i f = _mm_loadu_si128((const __m128i*)&center[x + 1]);
+
+			__m128i e0 = filter_select_sse2(filter_corner_sse2(d, b, f, h), d, e);
+			__m128i e1 = filter_select_sse2(filter_corner_sse2(f, b, d, h), f, e);
+			__m128i e2 = filter_select_sse2(filter_corner_sse2(d, h, f, b), d, e);
+			__m128i e3 = filter_select_sse2(filter_corner_sse2(f, h, d, b), f, e);
+
+			_mm_storeu_si128((__m128i*)&out0[x * 2], _mm_unpacklo_epi32(e0, e1));
+			_mm_storeu_si128((__m128i*)&out0[x * 2 + 4], _mm_unpackhi_epi32(e0, e1));
+			_mm_storeu_si128((__m128i*)&out1[x * 2], _mm_unpacklo_epi32(e2, e3));
+			_mm_storeu_si128((__m128i*)&out1[x * 2 + 4], _mm_unpackhi_epi32(e2, e3));
+		}
+#endif
+
+		for (; x < width; x++) {
+			uint32_t b = above[x], h = below[x], d = center[x - 1], e = center[x], f = center[x + 1];
+
+			out0[x * 2] = filter_corner(d, b, f, h) ? d : e;
+			out0[x * 2 + 1] = filter_corner(f, b, d, h) ? f : e;
+			out1[x * 2] = filter_corner(d, h, f, b) ? d : e;
+			out1[x * 2 + 1] = filter_corner(f, h, d, b) ? f : e;
+		}
+	}
+}
+
+// AdvMAME3x. The rules are worked out 4 pixels at a time, the 3x3 blocks are
+// written out one by one since SSE2 can't interleave by 3.
+void filter_scale3x(const struct Filter* filter, int width, int height) {
+	int stride = width + 2;
+	int out_width = width * 3;
+
+	for (int y = 0; y < height; y++) {
+		const uint32_t* above = &filter->padded[y * stride + 1];
+		const uint32_t* center = above + stride;
+		const uint32_t* below = center + stride;
+		uint32_t* out = &filter->scaled[(y * 3) * out_width];
+
+		for (int x = 0; x < width; x += 4) {
+			// Pixels of each 3x3 block, [block pixel][x]
+			uint32_t blocks[9][4];
+			int count = width - x < 4 ? width - x : 4;
+
+#ifdef HAVE_SSE2
+			if (count == 4) {
+				__m128i a = _mm_loadu_si128((const __m128i*)&above[x - 1]);
+				__m128i b = _mm_loadu_si128((const __m128i*)&above[x]);
+				__m128i c = _mm_loadu_si128((const __m128i*)&above[x + 1]);
+				__m128i d = _mm_loadu_si128((const __m128i*)&center[x - 1]);
+				__m128i e = _mm_loadu_si128((const __m128i*)&center[x]);
+				__m128i f = _mm_loadu_si128((const __m128i*)&center[x + 1]);
+				__m128i g = _mm_loadu_si128((const __m128i*)&below[x - 1]);
+				__m128i h = _mm_loadu_si128((const __m128i*)&below[x]);
+				__m128i i = _mm_loadu_si128((const __m128i*)&below[x + 1]);
+
+				__m128i top_left = filter_corner_sse2(d, b, f, h);
+				__m128i top_right = filter_corner_sse2(f, b, d, h);
+				__m128i bottom_left = filter_corner_sse2(d, h, f, b);
+				__m128i bottom_right = filter_corner_sse2(f, h, d, b);
+
+				// Edges take a corner's colour unless the pixel diagonally past it matches
+				__m128i not_a = _mm_andnot_si128(_mm_cmpeq_epi32(e, a), _mm_set1_epi32(-1));
+				__m128i not_c = _mm_andnot_si128(_mm_cmpeq_epi32(e, c), _mm_set1_epi32(-1));
+				__m128i not_g = _mm_andnot_si128(_mm_cmpeq_epi32(e, g), _mm_set1_epi32(-1));
+				__m128i not_i = _mm_andnot_si128(_mm_cmpeq_epi32(e, i), _mm_set1_epi32(-1));
+
+				__m128i top = _mm_or_si128(_mm_and_si128(top_left, not_c), _mm_and_si128(top_right, not_a));
+				__m128i left = _mm_or_si128(_mm_and_si128(top_left, not_g), _mm_and_si128(bottom_left, not_a));
+				__m128i right = _mm_or_si128(_mm_and_si128(top_right, not_i), _mm_and_si128(bottom_right, not_c));
+				__m128i bottom = _mm_or_si128(_mm_and_si128(bottom_left, not_i), _mm_and_si128(bottom_right, not_g));
+
+				_mm_storeu_si128((__m128i*)blocks[0], filter_select_sse2(top_left, d, e));
+				_mm_storeu_si128((__m128i*)blocks[1], filter_select_sse2(top, b, e));
+				_mm_storeu_si128((__m128i*)blocks[2], filter_select_sse2(top_right, f, e));
+				_mm_storeu_si128((__m128i*)blocks[3], filter_select_sse2(left, d, e));
+				_mm_storeu_si128((__m128i*)blocks[4], e);
+				_mm_storeu_si128((__m128i*)blocks[5], filter_select_sse2(right, f, e));
+				_mm_storeu_si128((__m128i*)blocks[6], filter_select_sse2(bottom_left, d, e));
+				_mm_storeu_si128((__m128i*)blocks[7], filter_select_sse2(bottom, h, e));
+				_mm_storeu_si128((__m128i*)blocks[8], filter_select_sse2(bottom_right, f, e));
+			}
+			else
+#endif
+			for (int n = 0; n < count; n++) {
+				int p = x + n;
+				uint32_t a = above[p - 1], b = above[p], c = above[p + 1];
+				uint32_t d = center[p - 1], e = center[p], f = center[p + 1];
+				uint32_t g = below[p - 1], h = below[p], i = below[p + 1];
+
+				bool top_left = filter_corner(d, b, f, h);
+				bool top_right = filter_corner(f, b, d, h);
+				bool bottom_left = filter_corner(d, h, f, b);
+				bool bottom_right = filter_corner(f, h, d, b);
+
+				blocks[0][n] = top_left ? d : e;
+				blocks[1][n] = (top_left && e != c) || (top_right && e != a) ? b : e;
+				blocks[2][n] = top_right ? f : e;
+				blocks[3][n] = (top_left && e != g) || (bottom_left && e != a) ? d : e;
+				blocks[4][n] = e;
+				blocks[5][n] = (top_right && e != i) || (bottom_right && e != c) ? f : e;
+				blocks[6][n] = bottom_left ? d : e;
+				blocks[7][n] = (bottom_left && e != i) || (bottom_right && e != g) ? h : e;
+				blocks[8][n] = bottom_right ? f : e;
+			}
+
+			for (int n = 0; n < count; n++) {
+				for (int row = 0; row < 3; row++) {
+					uint32_t* block = &out[row * out_width + (x + n) * 3];
+
+					block[0] = blocks[row * 3][n];
+					block[1] = blocks[row * 3 + 1][n];
+					block[2] = blocks[row * 3 + 2][n];
+				}
+			}
+		}
+	}
+}
+
+// dst = src * (weight + 1) / 256 for every channel
+void filter_weight_row(const uint32_t* src, const uint32_t* weights, uint32_t* dst, int count) {
+	int x = 0;
+
+#ifdef HAVE_AVX2
+	__m256i zero256 = _mm256_setzero_si256();
+	__m256i one256 = _mm256_set1_epi16(1);
+
+	// Unpack and pack work within 128 bit lanes, so the order comes back out the same
+	for (; x + 8 <= count; x += 8) {
+		__m256i pixels = _mm256_loadu_si256((const __m256i*)&src[x]);
+		__m256i weight = _mm256_loadu_si256((const __m256i*)&weights[x]);
+
+		__m256i lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(pixels, zero256), _mm256_add_epi16(_mm256_unpacklo_epi8(weight, zero256), one256));
+		__m256i hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(pixels, zero256), _mm256_add_epi16(_mm256_unpackhi_epi8(weight, zero256), one256));
+
+		_mm256_storeu_si256((__m256i*)&dst[x], _mm256_packus_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8)));
+	}
+#endif
+
+#ifdef HAVE_SSE2
+	__m128i zero = _mm_setzero_si128();
+	__m128i one = _mm_set1_epi16(1);
+
+	for (; x + 4 <= count; x += 4) {
+		__m128i pixels = _mm_loadu_si128((const __m128i*)&src[x]);
+		__m128i weight = _mm_loadu_si128((const __m128i*)&weights[x]);
+
+		__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(pixels, zero), _mm_add_epi16(_mm_unpacklo_epi8(weight, zero), one));
+		__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(pixels, zero), _mm_add_epi16(_mm_unpackhi_epi8(weight, zero), one));
+
+		_mm_storeu_si128((__m128i*)&dst[x], _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+	}
+#endif
+
+	for (; x < count; x++) {
+		uint32_t result = 0;
+
+		for (int shift = 0; shift < 32; shift += 8) {
+			uint32_t channel = (src[x] >> shift) & 0xFF;
+			result |= ((channel * (((weights[x] >> shift) & 0xFF) + 1)) >> 8) << shift;
+		}
+
+		dst[x] = result;
+	}
+}
+
+// pixels is the RGBA framebuffer from convert_video_to_sdl, output is
+// WINDOW_WIDTH x WINDOW_HEIGHT
+void filter_apply(struct Filter* filter, const uint32_t* pixels, int width, int height, uint8_t* output, int pitch) {
+	const uint32_t* source = pixels;
+	int scale = (filter->filters & FILTER_SCALE3X) ? 3 : (filter->filters & FILTER_SCALE2X) ? 2 : 1;
+
+	if (scale > 1) {
+		// Edge pixels repeated into the border
+		int stride = width + 2;
+
+		for (int y = -1; y <= height; y++) {
+			const uint32_t* row = &pixels[(y < 0 ? 0 : y >= height ? height - 1 : y) * width];
+			uint32_t* padded = &filter->padded[(y + 1) * stride];
+
+			memcpy(&padded[1], row, width * sizeof(uint32_t));
+			padded[0] = row[0];
+			padded[width + 1] = row[width - 1];
+		}
+
+		if (scale == 3) {
+			filter_scale3x(filter, width, height);
+		}
+		else {
+			filter_scale2x(filter, width, height);
+		}
+
+		source = filter->scaled;
+	}
+
+	int source_width = width * scale;
+	int source_height = height * scale;
+
+	if (filter->width != source_width || filter->height != source_height) {
+		for (int x = 0; x < WINDOW_WIDTH; x++) {
+			filter->columns[x] = x * source_width / WINDOW_WIDTH;
+		}
+
+		filter->width = source_width;
+		filter->height = source_height;
+	}
+
+	int last_row = -1;
+
+	for (int y = 0; y < WINDOW_HEIGHT; y++) {
+		int source_row = y * source_height / WINDOW_HEIGHT;
+		uint32_t* out = (uint32_t*)(output + (size_t)y * pitch);
+
+		// Nearest neighbour, once per source row
+		if (source_row != last_row) {
+			const uint32_t* src = &source[source_row * source_width];
+			int x = 0;
+
+#ifdef HAVE_AVX2
+			for (; x + 8 <= WINDOW_WIDTH; x += 8) {
+				__m256i columns = _mm256_loadu_si256((const __m256i*)&filter->columns[x]);
+				_mm256_storeu_si256((__m256i*)&filter->row[x], _mm256_i32gather_epi32((const int*)src, columns, 4));
+			}
+#endif
+
+			for (; x < WINDOW_WIDTH; x++) {
+				filter->row[x] = src[filter->columns[x]];
+			}
+
+			last_row = source_row;
+		}
+
+		if ((y & 1) ? filter->dark_is_identity : filter->bright_is_identity) {
+			memcpy(out, filter->row, WINDOW_WIDTH * sizeof(uint32_t));
+		}
+		else {
+			filter_weight_row(filter->row, (y & 1) ? filter->dark : filter->bright, out, WINDOW_WIDTH);
+		}
+	}
+}
+
+// --filter takes a comma separated list, returns -1 on anything unknown
+int parse_filters(const char* text) {
+	const struct { const char* name; int filter; } names[] = {
+		{ "scale2x", FILTER_SCALE2X },
+		{ "scale3x", FILTER_SCALE3X },
+		{ "scanlines", FILTER_SCANLINES },
+		{ "crt", FILTER_CRT },
+		{ "none", 0 }
+	};
+
+	int filters = 0;
+
+	while (*text != '\0') {
+		size_t length = strcspn(text, ",");
+		bool found = false;
+
+		for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+			if (strlen(names[i].name) == length && strncmp(text, names[i].name, length) == 0) {
+				filters |= names[i].filter;
+				found = true;
+			}
+		}
+
+		if (found == false) {
+			fprintf(stderr, "Unknown filter %.*s\n", (int)length, text);
+			return -1;
+		}
+
+		text += length + (text[length] == ',');
+	}
+
+	return filters;
+}
+
+// --bench with --filter: time the filter pass alone on whatever the ROM has
+// drawn after a few seconds
+bool bench_filters(const char* rom_path, int filters) {
+	struct State* state = state_init();
+
+	if (state == NULL) {
+		return false;
+	}
+
+	struct Filter* filter = NULL;
+	uint32_t* pixels = NULL;
+	uint32_t* output = NULL;
+	bool ok = load_rom(state, rom_path);
+
+	if (ok) {
+		for (int i = 0; i < 600; i++) {
+			state_frame(state, NULL);
+		}
+
+		filter = filter_create(filters);
+		pixels = calloc(128 * 64, sizeof(uint32_t));
+		output = calloc((size_t)WINDOW_WIDTH * WINDOW_HEIGHT, sizeof(uint32_t));
+
+		if (filter == NULL || pixels == NULL || output == NULL) {
+			fprintf(stderr, "Failed to allocate filter benchmark buffers.\n");
+			ok = false;
+		}
+	}
+
+	if (ok) {
+		const struct Framebuffer* framebuffer = state_framebuffer(state);
+		const int frames = 600;
+
+		uint64_t start_time = SDL_GetPerformanceCounter();
+
+		for (int i = 0; i < frames; i++) {
+			convert_video_to_sdl(framebuffer, state->framebuffer_mode, state->video_buffer, pixels);
+			filter_apply(filter, pixels, framebuffer->width, framebuffer->height, (uint8_t*)output, WINDOW_WIDTH * sizeof(uint32_t));
+		}
+
+		double seconds = (double)(SDL_GetPerformanceCounter() - start_time) / SDL_GetPerformanceFrequency();
+
+		printf("  filters at %dx%d from %dx%d: %.3fms per frame, %.0f%% of a 60Hz frame\n",
+			WINDOW_WIDTH, WINDOW_HEIGHT, framebuffer->width, framebuffer->height,
+			seconds * 1000.0 / frames, seconds / frames * 60.0 * 100.0);
+	}
+
+	free(output);
+	free(pixels);
+
+	if (filter != NULL) {
+		filter_destroy(filter);
+	}
+
+	state_destroy(state);
+
+	return ok;
+}
+
+// How a frame gets into video_texture
+enum UploadPath {
+	// Converted to RGBA, then copied into the locked texture
+	UPLOAD_RGBA = 0,
+	// A byte per pixel in an INDEX8 surface, which SDL's blitter expands
+	// into the locked texture through the palette
+	UPLOAD_INDEXED,
+	// The framebuffer's own rows as an INDEX1MSB surface, same again. Only
+	// for one plane, XO-CHIP drops to UPLOAD_INDEXED.
+	UPLOAD_BITS
+};
+
+const char* const UPLOAD_NAMES[] = { "rgba8888", "indexed 8 bit", "packed 1 bit" };
+
+// Everything needed to put a State on screen, created once so drawing a frame
+// doesn't allocate
+struct Display {
+	SDL_Renderer* renderer;
+	SDL_Texture* video_texture;
+	// Geometry video_texture was created for, recreated whenever the ROM switches
+	int texture_mode;
+	// Preferred UploadPath for the renderer, and the one texture_mode allows
+	int upload;
+	int texture_upload;
+	// Wraps upload_pixels for UPLOAD_INDEXED and UPLOAD_BITS
+	SDL_Surface* upload_surface;
+	uint8_t* upload_pixels;
+	// Created on first switch into MegaChip mode
+	SDL_Texture* megachip_texture;
+	// RGBA conversion of the largest framebuffer
+	uint32_t* pixels;
+	// With --filter, drawn into a window sized texture instead
+	struct Filter* filter;
+	SDL_Texture* filter_texture;
+};
+
+// A software renderer's texture is just a surface, so SDL can expand a packed
+// frame straight into it and the RGBA pass is wasted. An accelerated one
+// uploads 32 bits a pixel whatever we hand it, so converting there is cheapest.
+int display_pick_upload(SDL_Renderer* renderer) {
+	SDL_RendererInfo info;
+
+	if (SDL_GetRendererInfo(renderer, &info) == 0 && (info.flags & SDL_RENDERER_SOFTWARE)) {
+		return UPLOAD_BITS;
+	}
+
+	return UPLOAD_RGBA;
+}
+
+bool display_init(struct Display* display, SDL_Renderer* renderer, int filters) {
+	memset(display, 0, sizeof(struct Display));
+
+	display->renderer = renderer;
+	display->texture_mode = -1;
+	display->upload = display_pick_upload(renderer);
+	display->pixels = calloc(128 * 64, sizeof(uint32_t));
+	display->upload_pixels = calloc(128 * 64, 1);
+
+	if (display->pixels == NULL || display->upload_pixels == NULL) {
+		fprintf(stderr, "Failed to allocate video buffer when converting.\n");
+		return false;
+	}
+
+	if (filters != 0) {
+		display->filter = filter_create(filters);
+
+		if (display->filter == NULL) {
+			return false;
+		}
+
+		display->filter_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING,
+			WINDOW_WIDTH, WINDOW_HEIGHT);
+
+		if (display->filter_texture == NULL) {
+			fprintf(stderr, "Failed to create SDL texture: %s\n", SDL_GetError());
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void display_destroy(struct Display* display) {
+	if (display->megachip_texture != NULL) {
+		SDL_DestroyTexture(display->megachip_texture);
+	}
+
+	if (display->video_texture != NULL) {
+		SDL_DestroyTexture(display->video_texture);
+	}
+
+	if (display->upload_surface != NULL) {
+		SDL_FreeSurface(display->upload_surface);
+	}
+
+	if (display->filter_texture != NULL) {
+		SDL_DestroyTexture(display->filter_texture);
+	}
+
+	if (display->filter != NULL) {
+		filter_destroy(display->filter);
+	}
+
+	free(display->pixels);
+	free(display->upload_pixels);
+}
+
+// The surface for display->texture_upload over upload_pixels, with the
+// PLANE_COLORS palette
+bool display_create_upload_surface(struct Display* display, const struct Framebuffer* framebuffer) {
+	bool bits = display->texture_upload == UPLOAD_BITS;
+
+	display->upload_surface = SDL_CreateRGBSurfaceWithFormatFrom(display->upload_pixels,
+		framebuffer->width, framebuffer->height, bits ? 1 : 8,
+		bits ? (int)(framebuffer->words_per_row * sizeof(uint64_t)) : framebuffer->width,
+		bits ? SDL_PIXELFORMAT_INDEX1MSB : SDL_PIXELFORMAT_INDEX8);
+
+	if (display->upload_surface == NULL) {
+		fprintf(stderr, "Failed to create SDL surface: %s\n", SDL_GetError());
+		return false;
+	}
+
+	SDL_Color colors[4];
+
+	for (int i = 0; i < 4; i++) {
+		colors[i].r = PLANE_COLORS[i] >> 24;
+		colors[i].g = PLANE_COLORS[i] >> 16;
+		colors[i].b = PLANE_COLORS[i] >> 8;
+		colors[i].a = PLANE_COLORS[i];
+	}
+
+	SDL_SetPaletteColors(display->upload_surface->format->palette, colors, 0, bits ? 2 : 4);
+
+	// Copy the palette's alpha too, like the RGBA path does
+	SDL_SetSurfaceBlendMode(display->upload_surface, SDL_BLENDMODE_NONE);
+
+	return true;
+}
+
+void display_upload(struct Display* display, const struct State* state, const struct Framebuffer* framebuffer) {
+	if (display->texture_upload == UPLOAD_RGBA) {
+		convert_video_to_sdl(framebuffer, state->framebuffer_mode, state->video_buffer, display->pixels);
+
+		void* pixels;
+		int pitch;
+		SDL_LockTexture(display->video_texture, NULL, &pixels, &pitch);
+
+		for (int y = 0; y < framebuffer->height; y++) {
+			memcpy((uint8_t*)pixels + y * pitch, &display->pixels[y * framebuffer->width], framebuffer->width * sizeof(uint32_t));
+		}
+
+		SDL_UnlockTexture(display->video_texture);
+		return;
+	}
+
+	if (display->texture_upload == UPLOAD_INDEXED) {
+		convert_video_to_indices(framebuffer, state->framebuffer_mode, state->video_buffer, display->upload_pixels);
+	}
+	else {
+		// Rows are already MSB first bits, the words just need to be big endian
+		int words = framebuffer->height * framebuffer->words_per_row;
+
+		for (int i = 0; i < words; i++) {
+			uint64_t word = SDL_SwapBE64(state->video_buffer[i]);
+			memcpy(&display->upload_pixels[i * sizeof(uint64_t)], &word, sizeof(uint64_t));
+		}
+	}
+
+	SDL_Surface* target;
+
+	if (SDL_LockTextureToSurface(display->video_texture, NULL, &target) == 0) {
+		SDL_BlitSurface(display->upload_surface, NULL, target, NULL);
+		SDL_UnlockTexture(display->video_texture);
+	}
+}
+
+// Draws state and presents it
+bool display_render(struct Display* display, const struct State* state) {
+	SDL_Renderer* renderer = display->renderer;
+
+	if (state->megachip_mode) {
+		if (display->megachip_texture == NULL) {
+			display->megachip_texture = SDL_CreateTexture(
+				renderer,
+				SDL_PIXELFORMAT_ARGB8888,
+				SDL_TEXTUREACCESS_STREAMING,
+				MEGACHIP_WIDTH,
+				MEGACHIP_HEIGHT
+			);
+
+			if (display->megachip_texture == NULL) {
+				fprintf(stderr, "Failed to create SDL texture: %s\n", SDL_GetError());
+				return false;
+			}
+
+			SDL_SetTextureBlendMode(display->megachip_texture, SDL_BLENDMODE_BLEND);
+		}
+
+		// Already ARGB, so no conversion pass
+		SDL_UpdateTexture(display->megachip_texture, NULL, state->megachip->pixels, MEGACHIP_WIDTH * sizeof(uint32_t));
+		SDL_SetTextureAlphaMod(display->megachip_texture, state->megachip->alpha);
+
+		SDL_RenderClear(renderer);
+		SDL_RenderCopy(renderer, display->megachip_texture, NULL, NULL);
+		SDL_RenderPresent(renderer);
+
+		return true;
+	}
+
+	const struct Framebuffer* framebuffer = state_framebuffer(state);
+
+	// Filtered output is already window sized
+	if (display->filter != NULL) {
+		convert_video_to_sdl(framebuffer, state->framebuffer_mode, state->video_buffer, display->pixels);
+
+		void* pixels;
+		int pitch;
+		SDL_LockTexture(display->filter_texture, NULL, &pixels, &pitch);
+		filter_apply(display->filter, display->pixels, framebuffer->width, framebuffer->height, pixels, pitch);
+		SDL_UnlockTexture(display->filter_texture);
+
+		SDL_RenderCopy(renderer, display->filter_texture, NULL, NULL);
+		SDL_RenderPresent(renderer);
+
+		return true;
+	}
+
+	if (display->texture_mode != state->framebuffer_mode) {
+		if (display->video_texture != NULL) {
+			SDL_DestroyTexture(display->video_texture);
+		}
+
+		if (display->upload_surface != NULL) {
+			SDL_FreeSurface(display->upload_surface);
+			display->upload_surface = NULL;
+		}
+
+		display->video_texture = create_video_texture(renderer, framebuffer);
+
+		if (display->video_texture == NULL) {
+			return false;
+		}
+
+		display->texture_upload = display->upload == UPLOAD_BITS && framebuffer->planes > 1 ? UPLOAD_INDEXED : display->upload;
+
+		if (display->texture_upload != UPLOAD_RGBA && display_create_upload_surface(display, framebuffer) == false) {
+			return false;
+		}
+
+		display->texture_mode = state->framebuffer_mode;
+	}
+
+	display_upload(display, state, framebuffer);
+
+	SDL_Rect texture_rect;
+	texture_rect.x = 0;
+	texture_rect.y = 0;
+	texture_rect.w = WINDOW_WIDTH;
+	texture_rect.h = WINDOW_HEIGHT;
+
+	SDL_RenderCopy(renderer, display->video_texture, NULL, &texture_rect);
+	SDL_RenderPresent(renderer);
+
+	return true;
+}
+
+// Every UploadPath under a software and an accelerated renderer, on a hidden
+// window. Timed through display_render, so the copy and present are included.
+bool bench_uploads(const char* rom_path) {
+	struct State* state = state_init();
+
+	if (state == NULL) {
+		return false;
+	}
+
+	if (load_rom(state, rom_path) == false) {
+		state_destroy(state);
+		return false;
+	}
+
+	// Something on screen
+	for (int i = 0; i < 600; i++) {
+		state_frame(state, NULL);
+	}
+
+	if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+		printf("  no video for the texture uploads: %s\n", SDL_GetError());
+		state_destroy(state);
+		return true;
+	}
+
+	SDL_Window* window = SDL_CreateWindow("CHIP-8", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+		WINDOW_WIDTH, WINDOW_HEIGHT, SDL_WINDOW_HIDDEN);
+
+	if (window == NULL) {
+		fprintf(stderr, "Failed to create SDL window: %s\n", SDL_GetError());
+		state_destroy(state);
+		return false;
+	}
+
+	const uint32_t renderer_flags[2] = { SDL_RENDERER_SOFTWARE, SDL_RENDERER_ACCELERATED };
+	const struct Framebuffer* framebuffer = state_framebuffer(state);
+	const int frames = 600;
+
+	for (int r = 0; r < 2; r++) {
+		SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, renderer_flags[r]);
+
+		if (renderer == NULL) {
+			printf("  no %s renderer: %s\n", r == 0 ? "software" : "accelerated", SDL_GetError());
+			continue;
+		}
+
+		SDL_RendererInfo info;
+		SDL_GetRendererInfo(renderer, &info);
+
+		struct Display display;
+
+		if (display_init(&display, renderer, 0) == false) {
+			SDL_DestroyRenderer(renderer);
+			break;
+		}
+
+		int picked = display.upload;
+
+		for (int upload = UPLOAD_RGBA; upload <= UPLOAD_BITS; upload++) {
+			display.upload = upload;
+			display.texture_mode = -1;
+
+			// Creates the texture outside the timing
+			if (display_render(&display, state) == false) {
+				break;
+			}
+
+			uint64_t start_time = SDL_GetPerformanceCounter();
+
+			for (int i = 0; i < frames; i++) {
+				display_render(&display, state);
+			}
+
+			double seconds = (double)(SDL_GetPerformanceCounter() - start_time) / SDL_GetPerformanceFrequency();
+
+			int pixels = framebuffer->width * framebuffer->height;
+			int bytes = display.texture_upload == UPLOAD_RGBA ? pixels * 4 : display.texture_upload == UPLOAD_INDEXED ? pixels : pixels / 8;
+
+			printf("  %-12s %-14s %5d bytes per frame %8.3fms%s\n", info.name, UPLOAD_NAMES[display.texture_upload],
+				bytes, seconds * 1000.0 / frames, upload == picked ? " (picked)" : "");
+		}
+
+		display_destroy(&display);
+		SDL_DestroyRenderer(renderer);
+	}
+
+	SDL_DestroyWindow(window);
+	state_destroy(state);
+
+	return true;
+}
+
+// Single producer (emulation thread), single consumer (SDL audio callback).
+// Replaces SDL_QueueAudio in real-time mode, which takes the audio lock.
+struct AudioRing {
+	int16_t samples[8192];
+	SDL_atomic_t read;
+	SDL_atomic_t write;
+	int core;
+	bool configured;
+};
+
+void audio_ring_push(struct AudioRing* ring, const int16_t* samples, int count) {
+	int capacity = sizeof(ring->samples) / sizeof(int16_t);
+	int read = SDL_AtomicGet(&ring->read);
+	int write = SDL_AtomicGet(&ring->write);
+
+	for (int i = 0; i < count; i++) {
+		int next = (write + 1) % capacity;
+
+		// Full, the rest would only add latency
+		if (next == read) {
+			break;
+		}
+
+		ring->samples[write] = samples[i];
+		write = next;
+	}
+
+	SDL_MemoryBarrierRelease();
+	SDL_AtomicSet(&ring->write, write);
+}
+
+void realtime_setup_thread(int core, const char* name, int priority_boost);
+
+void audio_ring_callback(void* userdata, uint8_t* stream, int length) {
+	struct AudioRing* ring = userdata;
+	int capacity = sizeof(ring->samples) / sizeof(int16_t);
+
+	// Only chance to get hold of SDL's audio thread
+	if (ring->configured == false) {
+		realtime_setup_thread(ring->core, "audio", 1);
+		ring->configured = true;
+	}
+
+	int16_t* out = (int16_t*)stream;
+	int count = length / sizeof(int16_t);
+	int read = SDL_AtomicGet(&ring->read);
+	int write = SDL_AtomicGet(&ring->write);
+
+	SDL_MemoryBarrierAcquire();
+
+	for (int i = 0; i < count; i++) {
+		if (read == write) {
+			out[i] = 0;
+			continue;
+		}
+
+		out[i] = ring->samples[read];
+		read = (read + 1) % capacity;
+	}
+
+	SDL_AtomicSet(&ring->read, read);
+}
+
+// Queues through the ring in real-time mode, SDL otherwise
+void audio_output(SDL_AudioDeviceID audio_device, struct AudioRing* ring, const int16_t* samples, int count) {
+	if (ring != NULL) {
+		audio_ring_push(ring, samples, count);
+	}
+	else {
+		SDL_QueueAudio(audio_device, samples, count * sizeof(int16_t));
+	}
+}
+
+// --realtime: pinned threads, locked memory and frame deadline tracking.
+// Times are in performance counter ticks.
+struct Realtime {
+	int emulation_core;
+	int audio_core;
+	uint64_t period;
+	uint64_t next_deadline;
+	uint64_t frame_start;
+	uint64_t frames;
+	uint64_t misses;
+	uint64_t worst_frame;
+	uint64_t worst_lateness;
+};
+
+// Pins the calling thread to one logical CPU
+bool pin_thread(int core) {
+#if defined(_WIN32)
+	return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << core) != 0;
+#elif defined(__linux__)
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(core, &cpus);
+
+	return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+#else
+	return false;
+#endif
+}
+
+// Pins the calling thread to core (if >= 0) and asks for SCHED_FIFO, falling
+// back to SDL's priorities when that isn't permitted
+void realtime_setup_thread(int core, const char* name, int priority_boost) {
+	if (core >= 0 && pin_thread(core) == false) {
+		fprintf(stderr, "Failed to pin %s thread to core %d\n", name, core);
+	}
+
+#if defined(_WIN32)
+	if (SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL) == 0) {
+		fprintf(stderr, "Failed to raise %s thread priority\n", name);
+	}
+#elif defined(__linux__)
+	struct sched_param param;
+	memset(&param, 0, sizeof(param));
+	// Audio sits just above emulation so a long frame can't starve it
+	param.sched_priority = sched_get_priority_max(SCHED_FIFO) - 2 + priority_boost;
+
+	if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0) {
+		fprintf(stderr, "SCHED_FIFO not permitted for %s thread, using high priority instead\n", name);
+		SDL_SetThreadPriority(SDL_THREAD_PRIORITY_HIGH);
+	}
+#else
+	SDL_SetThreadPriority(SDL_THREAD_PRIORITY_TIME_CRITICAL);
+#endif
+}
+
+// Locks a region into RAM, which also faults every page of it in
+void realtime_lock(const void* data, size_t size, const char* name) {
+#if defined(_WIN32)
+	if (VirtualLock((LPVOID)data, size) == 0) {
+		fprintf(stderr, "Failed to lock %s into memory\n", name);
+	}
+#elif defined(__linux__)
+	if (mlock(data, size) != 0) {
+		fprintf(stderr, "Failed to lock %s into memory (check RLIMIT_MEMLOCK)\n", name);
+	}
+#else
+	// Touch each page at least
+	volatile const uint8_t* bytes = data;
+
+	for (size_t i = 0; i < size; i += 4096) {
+		(void)bytes[i];
+	}
+#endif
+}
+
+void realtime_prefault_stack() {
+	// Grow the stack now rather than in the middle of a frame
+	volatile uint8_t stack[256 * 1024];
+
+	for (size_t i = 0; i < sizeof(stack); i += 4096) {
+		stack[i] = 0;
+	}
+}
+
+void realtime_init(struct Realtime* realtime, struct State* state, struct Display* display, struct AudioRing* ring) {
+	realtime->period = (uint64_t)(SDL_GetPerformanceFrequency() * FRAME_TIME / 1000.0);
+
+	realtime_setup_thread(realtime->emulation_core, "emulation", 0);
+
+	// MegaChip state is normally allocated on first use, don't let that happen mid-game
+	if (state->memory_size == MEGACHIP_MEMORY_SIZE && state_megachip(state) != NULL) {
+		realtime_lock(state->megachip, sizeof(struct MegaChip), "MegaChip display");
+	}
+
+	realtime_lock(state, sizeof(struct State), "state");
+	realtime_lock(state->memory, state->memory_size, "memory");
+	realtime_lock(state->video_buffer, sizeof(uint64_t) * VIDEO_BUFFER_WORDS, "video buffer");
+	realtime_lock(display->pixels, sizeof(uint32_t) * 128 * 64, "conversion buffer");
+	realtime_lock(ring, sizeof(struct AudioRing), "audio ring");
+
+	realtime_prefault_stack();
+}
+
+// Sleeps until the next frame is due, then spins the last couple of
+// milliseconds since SDL_Delay can overshoot
+void realtime_wait(struct Realtime* realtime) {
+	uint64_t frequency = SDL_GetPerformanceFrequency();
+	uint64_t now = SDL_GetPerformanceCounter();
+
+	if (realtime->next_deadline == 0) {
+		realtime->next_deadline = now;
+	}
+
+	while (now + frequency * 2 / 1000 < realtime->next_deadline) {
+		SDL_Delay(1);
+		now = SDL_GetPerformanceCounter();
+	}
+
+	while (now < realtime->next_deadline) {
+		now = SDL_GetPerformanceCounter();
+	}
+
+	uint64_t lateness = now - realtime->next_deadline;
+
+	if (lateness > realtime->worst_lateness) {
+		realtime->worst_lateness = lateness;
+	}
+
+	realtime->frame_start = now;
+}
+
+// A frame misses its deadline if it isn't on screen before the next one is due
+void realtime_frame_done(struct Realtime* realtime) {
+	uint64_t now = SDL_GetPerformanceCounter();
+	uint64_t duration = now - realtime->frame_start;
+
+	if (duration > realtime->worst_frame) {
+		realtime->worst_frame = duration;
+	}
+
+	realtime->frames++;
+	realtime->next_deadline += realtime->period;
+
+	if (now > realtime->next_deadline) {
+		realtime->misses++;
+
+		// Drop the frame rather than rushing to catch up
+		realtime->next_deadline = now;
+	}
+}
+
+void realtime_report(const struct Realtime* realtime) {
+	double to_ms = 1000.0 / SDL_GetPerformanceFrequency();
+
+	printf("Real-time: %llu frames, %llu deadline misses, worst frame %.3fms, worst wake-up lateness %.3fms\n",
+		(unsigned long long)realtime->frames, (unsigned long long)realtime->misses,
+		realtime->worst_frame * to_ms, realtime->worst_lateness * to_ms);
+}
+
+// --low-power: sleeps on events instead of polling, wakes once every few
+// frames when nothing is happening and catches up in one go, only presents
+// frames that changed and pauses audio while it's silent
+struct LowPower {
+	// When the next frame is due, in SDL_GetTicks milliseconds
+	double next_frame;
+	// Frames in a row that didn't change the screen or make a sound
+	uint32_t idle_frames;
+	// What's on screen, to tell whether a frame needs presenting
+	uint64_t presented[2 * 64 * 2];
+	uint8_t presented_mode;
+	bool dirty;
+	bool audio_paused;
+	uint64_t frames;
+	uint64_t presents;
+	// CPU time at the start of the current minute, and overall
+	uint32_t minute_start;
+	double minute_cpu;
+	uint32_t start;
+	double start_cpu;
+};
+
+// Seconds of CPU used by the whole process so far, every thread included
+double process_cpu_seconds() {
+#if defined(_WIN32)
+	FILETIME creation, exited, kernel, user;
+	GetProcessTimes(GetCurrentProcess(), &creation, &exited, &kernel, &user);
+
+	uint64_t kernel_time = (uint64_t)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime;
+	uint64_t user_time = (uint64_t)user.dwHighDateTime << 32 | user.dwLowDateTime;
+
+	// 100ns units
+	return (kernel_time + user_time) / 10000000.0;
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+#endif
+}
+
+void low_power_init(struct LowPower* power) {
+	memset(power, 0, sizeof(struct LowPower));
+
+	power->next_frame = SDL_GetTicks();
+	power->presented_mode = 0xFF;
+	power->dirty = true;
+	power->start = SDL_GetTicks();
+	power->start_cpu = process_cpu_seconds();
+	power->minute_start = power->start;
+	power->minute_cpu = power->start_cpu;
+}
+
+// Blocked on FX0A with both timers stopped and no MegaChip sample playing,
+// nothing can change until a key
+bool low_power_frozen(const struct State* state) {
+	if (state->megachip != NULL && state->megachip->sample_playing) {
+		return false;
+	}
+
+	return state->keycode == 16 && state->delay_timer == 0 && state->sound_timer == 0 &&
+		(size_t)state->pc + 1 < state->memory_size &&
+		(state->memory[state->pc] & 0xF0) == 0xF0 && state->memory[state->pc + 1] == 0x0A;
+}
+
+// Returns true with frame_time set when a frame is due, otherwise sleeps until
+// one is (or an event arrives) and returns false so events get polled again
+bool low_power_wait(struct LowPower* power, const struct State* state, uint32_t* frame_time) {
+	uint32_t now = SDL_GetTicks();
+
+	if (now >= power->next_frame) {
+		// Way behind (suspended, dragged window), don't try to catch all of it up
+		if (now - power->next_frame > 1000) {
+			power->next_frame = now;
+		}
+
+		*frame_time = (uint32_t)power->next_frame;
+		power->next_frame += FRAME_TIME;
+		return true;
+	}
+
+	if (low_power_frozen(state) && power->dirty == false) {
+		SDL_WaitEvent(NULL);
+
+		// The frames spent frozen would all have been the same, skip them
+		power->next_frame = SDL_GetTicks();
+		return false;
+	}
+
+	// After a second of nothing, wake every 6th frame and run the backlog at once
+	double wake = power->next_frame;
+
+	if (power->idle_frames >= 60 && power->dirty == false) {
+		wake += 5 * FRAME_TIME;
+	}
+
+	SDL_WaitEventTimeout(NULL, (int)(wake - now) + 1);
+
+	return false;
+}
+
+// After each frame, before sound. Returns whether to present it: only when
+// something changed and there isn't a backlog of frames left to catch up.
+bool low_power_frame_done(struct LowPower* power, const struct State* state, SDL_AudioDeviceID audio_device, bool sound) {
+	power->frames++;
+
+	bool changed = state->megachip_mode || state->framebuffer_mode != power->presented_mode ||
+		memcmp(state->video_buffer, power->presented, sizeof(power->presented)) != 0;
+
+	if (changed) {
+		memcpy(power->presented, state->video_buffer, sizeof(power->presented));
+		power->presented_mode = state->framebuffer_mode;
+		power->dirty = true;
+	}
+
+	power->idle_frames = changed || sound ? 0 : power->idle_frames + 1;
+
+	// A few frames of grace so beeps next to each other don't stutter
+	if (sound && power->audio_paused) {
+		SDL_PauseAudioDevice(audio_device, 0);
+		power->audio_paused = false;
+	}
+	else if (power->idle_frames == 30 && power->audio_paused == false) {
+		SDL_PauseAudioDevice(audio_device, 1);
+		power->audio_paused = true;
+	}
+
+	if (power->dirty == false || SDL_GetTicks() >= power->next_frame) {
+		return false;
+	}
+
+	power->dirty = false;
+	power->presents++;
+
+	return true;
+}
+
+void low_power_report(struct LowPower* power, bool final) {
+	uint32_t now = SDL_GetTicks();
+
+	if (now - power->minute_start >= 60000) {
+		double cpu = process_cpu_seconds();
+
+		printf("Low power: %.2f%% CPU over the last minute\n", (cpu - power->minute_cpu) * 100000.0 / (now - power->minute_start));
+
+		power->minute_start = now;
+		power->minute_cpu = cpu;
+	}
+
+	if (final && now > power->start) {
+		printf("Low power: %.2f%% CPU on average, %llu of %llu frames presented\n",
+			(process_cpu_seconds() - power->start_cpu) * 100000.0 / (now - power->start),
+			(unsigned long long)power->presents, (unsigned long long)power->frames);
+	}
+}
+
+// Prints and empties the host call log, frame is only for context
+void host_calls_drain(struct HostCalls* host, uint32_t frame) {
+	uint32_t capacity = sizeof(host->log) / sizeof(host->log[0]);
+
+	for (; host->count > 0; host->count--) {
+		const struct HostLogEntry* entry = &host->log[host->head];
+		host->head = (host->head + 1) % capacity;
+
+		printf("[frame %u, cycle %llu] 0x%03X ", frame, (unsigned long long)entry->cycle, entry->pc);
+
+		switch (entry->kind) {
+		case HOST_LOG_TIMER:
+			printf("timer %u: %llu cycles\n", entry->n, (unsigned long long)entry->elapsed);
+			break;
+
+		case HOST_LOG_REGISTERS:
+			for (int i = 0; i < entry->n; i++) {
+				printf("V%X=%02X ", i, entry->regs_v[i]);
+			}
+
+			printf("\n");
+			break;
+
+		default:
+			printf("mark\n");
+			break;
+		}
+	}
+
+	if (host->dropped > 0) {
+		printf("%u host log entries dropped\n", host->dropped);
+		host->dropped = 0;
+	}
+}
+
+enum LatencySegment {
+	SEGMENT_EVENT_TO_READ = 0,
+	SEGMENT_READ_TO_DRAW,
+	SEGMENT_DRAW_TO_PRESENT,
+	SEGMENT_EVENT_TO_PRESENT,
+	// In emulated cycles rather than milliseconds
+	SEGMENT_APPLY_TO_READ_CYCLES,
+	SEGMENT_COUNT
+};
+
+const int LATENCY_MAX_SAMPLES = 4096;
+
+// --latency: follows key presses from the SDL event to the SDL_RenderPresent
+// that shows the first sprite drawn after the ROM read the key
+struct LatencyTracker {
+	struct LatencyProbe probe;
+	// Performance counter times of each stage of the current trace
+	uint64_t event_time;
+	uint64_t observed_time;
+	uint64_t drawn_time;
+	double* samples[SEGMENT_COUNT];
+	int count;
+	// Presses that were overtaken by the next one before they got that far
+	int unread;
+	int undrawn;
+};
+
+void latency_destroy(struct LatencyTracker* tracker, struct State* state) {
+	state->latency = NULL;
+
+	for (int i = 0; i < SEGMENT_COUNT; i++) {
+		free(tracker->samples[i]);
+	}
+
+	free(tracker);
+}
+
+struct LatencyTracker* latency_create(struct State* state) {
+	struct LatencyTracker* tracker = calloc(1, sizeof(struct LatencyTracker));
+
+	if (tracker == NULL) {
+		fprintf(stderr, "Failed to allocate latency tracker.\n");
+		return NULL;
+	}
+
+	for (int i = 0; i < SEGMENT_COUNT; i++) {
+		tracker->samples[i] = calloc(LATENCY_MAX_SAMPLES, sizeof(double));
+
+		if (tracker->samples[i] == NULL) {
+			fprintf(stderr, "Failed to allocate latency samples.\n");
+			latency_destroy(tracker, state);
+			return NULL;
+		}
+	}
+
+	state->latency = &tracker->probe;
+
+	return tracker;
+}
+
+// timestamp is the event's, in SDL_GetTicks milliseconds
+void latency_key_event(struct LatencyTracker* tracker, uint8_t key, uint32_t timestamp) {
+	if (key == 16) {
+		return;
+	}
+
+	uint8_t stage = tracker->probe.stage;
+
+	if (stage == LATENCY_EVENT || stage == LATENCY_APPLIED) {
+		tracker->unread++;
+	}
+	else if (stage == LATENCY_OBSERVED) {
+		tracker->undrawn++;
+	}
+
+	// Back-dated by however long the event sat in SDL's queue
+	uint64_t frequency = SDL_GetPerformanceFrequency();
+	uint32_t queued = SDL_GetTicks() - timestamp;
+
+	tracker->event_time = SDL_GetPerformanceCounter() - queued * frequency / 1000;
+	tracker->observed_time = 0;
+	tracker->drawn_time = 0;
+	tracker->probe.key = key;
+	tracker->probe.stage = LATENCY_EVENT;
+}
+
+// Before state_frame, with the input it's about to apply
+void latency_frame_input(struct LatencyTracker* tracker, const struct State* state, const struct FrameInput* input) {
+	if (tracker->probe.stage != LATENCY_EVENT) {
+		return;
+	}
+
+	for (int i = 0; i < input->count; i++) {
+		if (input->keycodes[i] == tracker->probe.key) {
+			tracker->probe.applied_cycle = state->cycles + input->cycles[i];
+			tracker->probe.stage = LATENCY_APPLIED;
+			return;
+		}
+	}
+}
+
+// After state_frame. The frame runs in one burst, so the read and the draw are
+// stamped with when it finished.
+void latency_frame_done(struct LatencyTracker* tracker) {
+	uint8_t stage = tracker->probe.stage;
+	uint64_t now = SDL_GetPerformanceCounter();
+
+	if ((stage == LATENCY_OBSERVED || stage == LATENCY_DRAWN) && tracker->observed_time == 0) {
+		tracker->observed_time = now;
+	}
+
+	if (stage == LATENCY_DRAWN && tracker->drawn_time == 0) {
+		tracker->drawn_time = now;
+	}
+}
+
+// After the frame has been presented
+void latency_presented(struct LatencyTracker* tracker) {
+	if (tracker->probe.stage != LATENCY_DRAWN) {
+		return;
+	}
+
+	tracker->probe.stage = LATENCY_IDLE;
+
+	if (tracker->count == LATENCY_MAX_SAMPLES) {
+		return;
+	}
+
+	double to_ms = 1000.0 / SDL_GetPerformanceFrequency();
+	uint64_t now = SDL_GetPerformanceCounter();
+	int n = tracker->count++;
+
+	tracker->samples[SEGMENT_EVENT_TO_READ][n] = (tracker->observed_time - tracker->event_time) * to_ms;
+	tracker->samples[SEGMENT_READ_TO_DRAW][n] = (tracker->drawn_time - tracker->observed_time) * to_ms;
+	tracker->samples[SEGMENT_DRAW_TO_PRESENT][n] = (now - tracker->drawn_time) * to_ms;
+	tracker->samples[SEGMENT_EVENT_TO_PRESENT][n] = (now - tracker->event_time) * to_ms;
+	tracker->samples[SEGMENT_APPLY_TO_READ_CYCLES][n] = (double)(tracker->probe.observed_cycle - tracker->probe.applied_cycle);
+}
+
+int compare_doubles(const void* a, const void* b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+void latency_report(struct LatencyTracker* tracker) {
+	const char* names[SEGMENT_COUNT] = {
+		"event -> read (ms)",
+		"read -> draw (ms)",
+		"draw -> present (ms)",
+		"event -> present (ms)",
+		"apply -> read (cycles)"
+	};
+
+	printf("Latency over %d key presses (%d never read, %d read but nothing drawn)\n",
+		tracker->count, tracker->unread, tracker->undrawn);
+
+	if (tracker->count == 0) {
+		return;
+	}
+
+	printf("  %-24s %9s %9s %9s %9s %9s\n", "", "min", "p50", "p90", "p99", "max");
+
+	for (int i = 0; i < SEGMENT_COUNT; i++) {
+		double* samples = tracker->samples[i];
+		int count = tracker->count;
+
+		qsort(samples, count, sizeof(double), compare_doubles);
+
+		printf("  %-24s %9.2f %9.2f %9.2f %9.2f %9.2f\n", names[i],
+			samples[0], samples[count / 2], samples[count * 9 / 10], samples[count * 99 / 100], samples[count - 1]);
+	}
+}
+
+// Bulk loader for large sets of small ROMs. Every ROM gets a fixed slot in one
+// arena and is read with a single open/read/close, through io_uring where the
+// kernel allows it and a pool of reader threads otherwise. Consumers pick ROMs
+// up in completion order while the rest are still loading.
+const size_t ROM_SLOT_SIZE = 0x1000;
+const int CORPUS_READER_THREADS = 8;
+
+struct RomCorpus {
+	int count;
+	const char** paths;
+	uint8_t* arena;
+	// Bytes loaded, 0 if the ROM failed
+	uint32_t* sizes;
+	// ROM index + 1 for each completion position, 0 until that position is filled
+	SDL_atomic_t* order;
+	SDL_atomic_t completed;
+	// Next ROM for the reader threads
+	SDL_atomic_t next;
+	SDL_Thread* threads[8];
+	uint64_t start_time;
+	SDL_atomic_t finish_time_ms;
+	bool used_io_uring;
+};
+
+const uint8_t* corpus_rom(const struct RomCorpus* corpus, int index) {
+	return &corpus->arena[(size_t)index * ROM_SLOT_SIZE];
+}
+
+void corpus_complete(struct RomCorpus* corpus, int index, int size) {
+	if (size < 0) {
+		fprintf(stderr, "Failed to read ROM %s\n", corpus->paths[index]);
+		size = 0;
+	}
+	// Same limit as read_rom
+	else if ((size_t)size >= MEMORY_SIZE - PROGRAM_START) {
+		fprintf(stderr, "Program %s is too big to load into memory\n", corpus->paths[index]);
+		size = 0;
+	}
+	else if (size == 0) {
+		fprintf(stderr, "Failed to determine ROM size of %s\n", corpus->paths[index]);
+	}
+
+	corpus->sizes[index] = size;
+
+	int position = SDL_AtomicAdd(&corpus->completed, 1);
+
+	SDL_MemoryBarrierRelease();
+	SDL_AtomicSet(&corpus->order[position], index + 1);
+
+	if (position == corpus->count - 1) {
+		SDL_AtomicSet(&corpus->finish_time_ms, (int)((SDL_GetPerformanceCounter() - corpus->start_time) * 1000 / SDL_GetPerformanceFrequency()) + 1);
+	}
+}
+
+int corpus_reader_thread(void* data) {
+	struct RomCorpus* corpus = data;
+
+	while (true) {
+		int index = SDL_AtomicAdd(&corpus->next, 1);
+
+		if (index >= corpus->count) {
+			break;
+		}
+
+		FILE* file = NULL;
+
+		if (fopen_s(&file, corpus->paths[index], "rb") != 0) {
+			corpus_complete(corpus, index, -1);
+			continue;
+		}
+
+		// One read of a whole slot, a full slot means the ROM is too big
+		size_t size = fread(&corpus->arena[(size_t)index * ROM_SLOT_SIZE], 1, ROM_SLOT_SIZE, file);
+		bool failed = ferror(file) != 0;
+
+		fclose(file);
+
+		corpus_complete(corpus, index, failed ? -1 : (int)size);
+	}
+
+	return 0;
+}
+
+#ifdef HAVE_IO_URING
+struct Uring {
+	int fd;
+	unsigned entries;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	void* sq_ring;
+	size_t sq_ring_size;
+	void* cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+	// Next free submission entry, published to sq_tail on submit
+	unsigned sqe_tail;
+};
+
+// Whichever of the queues got mapped
+void uring_unmap(struct Uring* ring) {
+	if (ring->sqes != MAP_FAILED) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+
+	if (ring->cq_ring != ring->sq_ring && ring->cq_ring != MAP_FAILED) {
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+
+	if (ring->sq_ring != MAP_FAILED) {
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	}
+}
+
+bool uring_init(struct Uring* ring, unsigned entries) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	memset(ring, 0, sizeof(struct Uring));
+
+	ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+
+	// Not built in, or blocked by seccomp in containers
+	if (ring->fd < 0) {
+		return false;
+	}
+
+	ring->entries = params.sq_entries;
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size) {
+			ring->sq_ring_size = ring->cq_ring_size;
+		}
+
+		ring->cq_ring_size = 0;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = ring->sq_ring;
+
+	if (ring->sq_ring != MAP_FAILED && ring->cq_ring_size > 0) {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	}
+
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+	if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		fprintf(stderr, "Failed to map io_uring queues\n");
+		uring_unmap(ring);
+		close(ring->fd);
+		return false;
+	}
+
+	uint8_t* sq = ring->sq_ring;
+	uint8_t* cq = ring->cq_ring;
+
+	ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+	ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+	ring->sqe_tail = *ring->sq_tail;
+
+	return true;
+}
+
+void uring_destroy(struct Uring* ring) {
+	uring_unmap(ring);
+	close(ring->fd);
+}
+
+// 5.1 to 5.5 have io_uring without open, read or close, and without the
+// probe either, so a failed probe means they're missing too
+bool uring_supports(struct Uring* ring, const uint8_t* ops, int count) {
+	size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe* probe = calloc(1, size);
+
+	if (probe == NULL) {
+		return false;
+	}
+
+	bool supported = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+
+	for (int i = 0; i < count && supported; i++) {
+		supported = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+	}
+
+	free(probe);
+
+	return supported;
+}
+
+// Caller keeps in-flight requests under entries, so there is always room
+struct io_uring_sqe* uring_get_sqe(struct Uring* ring) {
+	unsigned index = ring->sqe_tail & *ring->sq_mask;
+	struct io_uring_sqe* sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring->sq_array[index] = index;
+	ring->sqe_tail++;
+
+	return sqe;
+}
+
+// Submits everything queued and waits for at least one completion
+bool uring_submit_and_wait(struct Uring* ring) {
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+	// Includes anything the kernel didn't take last time
+	unsigned to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	if (syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+		fprintf(stderr, "io_uring_enter failed\n");
+		return false;
+	}
+
+	return true;
+}
+
+// user_data is the ROM index shifted up, with the step in the low bits
+enum CorpusStep {
+	CORPUS_OPEN = 0,
+	CORPUS_READ = 1,
+	CORPUS_CLOSE = 2
+};
+
+// Loads the whole corpus from one thread. Returns false if io_uring isn't available.
+bool corpus_load_io_uring(struct RomCorpus* corpus) {
+	struct Uring ring;
+
+	if (uring_init(&ring, 256) == false) {
+		return false;
+	}
+
+	const uint8_t ops[3] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE };
+
+	if (uring_supports(&ring, ops, 3) == false) {
+		uring_destroy(&ring);
+		return false;
+	}
+
+	int* fds = calloc(corpus->count, sizeof(int));
+	bool* finished = calloc(corpus->count, sizeof(bool));
+
+	if (fds == NULL || finished == NULL) {
+		free(fds);
+		free(finished);
+		uring_destroy(&ring);
+		return false;
+	}
+
+	int next_open = 0;
+	int done = 0;
+	unsigned in_flight = 0;
+
+	while (done < corpus->count) {
+		// Each open turns into a read then a close, leave room for them
+		while (next_open < corpus->count && in_flight + 1 < ring.entries / 2) {
+			struct io_uring_sqe* sqe = uring_get_sqe(&ring);
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (uint64_t)(uintptr_t)corpus->paths[next_open];
+			sqe->open_flags = O_RDONLY;
+			sqe->user_data = (uint64_t)next_open << 2 | CORPUS_OPEN;
+
+			next_open++;
+			in_flight++;
+		}
+
+		if (uring_submit_and_wait(&ring) == false) {
+			break;
+		}
+
+		unsigned head = *ring.cq_head;
+		unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; head++) {
+			struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+			int index = (int)(cqe->user_data >> 2);
+			int result = cqe->res;
+
+			in_flight--;
+
+			switch (cqe->user_data & 0x3) {
+			case CORPUS_OPEN:
+				if (result < 0) {
+					corpus_complete(corpus, index, -1);
+					finished[index] = true;
+					done++;
+					break;
+				}
+
+				fds[index] = result;
+
+				// One read of a whole slot, a full slot means the ROM is too big
+				struct io_uring_sqe* read_file = uring_get_sqe(&ring);
+				read_file->opcode = IORING_OP_READ;
+				read_file->fd = result;
+				read_file->addr = (uint64_t)(uintptr_t)&corpus->arena[(size_t)index * ROM_SLOT_SIZE];
+				read_file->len = ROM_SLOT_SIZE;
+				read_file->off = 0;
+				read_file->user_data = (uint64_t)index << 2 | CORPUS_READ;
+				in_flight++;
+				break;
+
+			case CORPUS_READ: {
+				corpus_complete(corpus, index, result);
+				finished[index] = true;
+				done++;
+
+				struct io_uring_sqe* close_file = uring_get_sqe(&ring);
+				close_file->opcode = IORING_OP_CLOSE;
+				close_file->fd = fds[index];
+				close_file->user_data = (uint64_t)index << 2 | CORPUS_CLOSE;
+				in_flight++;
+				break;
+			}
+
+			default:
+				break;
+			}
+		}
+
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	// Drain the last closes
+	while (in_flight > 0 && uring_submit_and_wait(&ring)) {
+		unsigned head = *ring.cq_head;
+		unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+		in_flight -= tail - head;
+		__atomic_store_n(ring.cq_head, tail, __ATOMIC_RELEASE);
+	}
+
+	// Anything left over means io_uring_enter broke part way, fail the rest
+	for (int i = 0; i < corpus->count; i++) {
+		if (finished[i] == false) {
+			corpus_complete(corpus, i, -1);
+		}
+	}
+
+	free(fds);
+	free(finished);
+	uring_destroy(&ring);
+
+	return true;
+}
+
+int corpus_io_uring_thread(void* data) {
+	struct RomCorpus* corpus = data;
+
+	corpus->used_io_uring = corpus_load_io_uring(corpus);
+
+	// Fall back to the reader thread pool, with this thread as one of them
+	if (corpus->used_io_uring == false) {
+		for (int i = 1; i < CORPUS_READER_THREADS; i++) {
+			corpus->threads[i] = SDL_CreateThread(corpus_reader_thread, "corpus reader", corpus);
+		}
+
+		corpus_reader_thread(corpus);
+	}
+
+	return 0;
+}
+#endif
+
+// Starts loading in the background, ROMs can be taken with corpus_wait straight away
+bool corpus_start(struct RomCorpus* corpus, const char** paths, int count) {
+	memset(corpus, 0, sizeof(struct RomCorpus));
+
+	corpus->count = count;
+	corpus->paths = paths;
+	corpus->arena = malloc((size_t)count * ROM_SLOT_SIZE);
+	corpus->sizes = calloc(count, sizeof(uint32_t));
+	corpus->order = calloc(count, sizeof(SDL_atomic_t));
+	corpus->start_time = SDL_GetPerformanceCounter();
+
+	if (corpus->arena == NULL || corpus->sizes == NULL || corpus->order == NULL) {
+		fprintf(stderr, "Failed to allocate ROM arena for %d ROMs\n", count);
+		free(corpus->arena);
+		free(corpus->sizes);
+		free(corpus->order);
+		return false;
+	}
+
+#ifdef HAVE_IO_URING
+	corpus->threads[0] = SDL_CreateThread(corpus_io_uring_thread, "corpus loader", corpus);
+#else
+	for (int i = 0; i < CORPUS_READER_THREADS; i++) {
+		corpus->threads[i] = SDL_CreateThread(corpus_reader_thread, "corpus reader", corpus);
+	}
+#endif
+
+	if (corpus->threads[0] == NULL) {
+		fprintf(stderr, "Failed to create ROM loader thread: %s\n", SDL_GetError());
+		corpus_reader_thread(corpus);
+	}
+
+	return true;
+}
+
+// Index of the ROM that finished loading in this position, waiting if needed
+int corpus_wait(struct RomCorpus* corpus, int position) {
+	int value;
+
+	while ((value = SDL_AtomicGet(&corpus->order[position])) == 0) {
+		SDL_Delay(0);
+	}
+
+	SDL_MemoryBarrierAcquire();
+
+	return value - 1;
+}
+
+void corpus_destroy(struct RomCorpus* corpus) {
+	for (int i = 0; i < CORPUS_READER_THREADS; i++) {
+		if (corpus->threads[i] != NULL) {
+			SDL_WaitThread(corpus->threads[i], NULL);
+		}
+	}
+
+	free(corpus->arena);
+	free(corpus->sizes);
+	free(corpus->order);
+}
+
+// CPUs ordered round-robin across NUMA nodes, so the first N threads spread
+// over every node's memory controller
+struct Topology {
+	int node_count;
+	int cpu_count;
+	int cpus[256];
+	int cpu_nodes[256];
+	size_t l2_size;
+};
+
+#ifdef __linux__
+// Parses a sysfs cpulist like "0-3,8-11" into cpus, returns how many
+int parse_cpu_list(const char* text, int* cpus, int max_cpus) {
+	int count = 0;
+
+	while (*text != '\0' && *text != '\n' && count < max_cpus) {
+		char* end;
+		int first = (int)strtol(text, &end, 10);
+		int last = first;
+
+		if (*end == '-') {
+			last = (int)strtol(end + 1, &end, 10);
+		}
+
+		for (int cpu = first; cpu <= last && count < max_cpus; cpu++) {
+			cpus[count++] = cpu;
+		}
+
+		if (*end != ',') {
+			break;
+		}
+
+		text = end + 1;
+	}
+
+	return count;
+}
+
+bool read_small_file(const char* path, char* buffer, size_t size) {
+	FILE* file = NULL;
+
+	if (fopen_s(&file, path, "rb") != 0) {
+		return false;
+	}
+
+	size_t length = fread(buffer, 1, size - 1, file);
+	buffer[length] = '\0';
+	fclose(file);
+
+	return length > 0;
+}
+#endif
+
+void topology_detect(struct Topology* topology) {
+	int max_cpus = sizeof(topology->cpus) / sizeof(int);
+	int node_cpus[64][256];
+	int node_sizes[64];
+	int node_count = 0;
+
+	memset(topology, 0, sizeof(struct Topology));
+	topology->l2_size = 256 * 1024;
+
+#if defined(_WIN32)
+	ULONG highest = 0;
+
+	if (GetNumaHighestNodeNumber(&highest)) {
+		for (ULONG node = 0; node <= highest && node < 64; node++) {
+			ULONGLONG mask = 0;
+			node_sizes[node_count] = 0;
+
+			if (GetNumaNodeProcessorMask((UCHAR)node, &mask)) {
+				for (int cpu = 0; cpu < 64; cpu++) {
+					if (mask & (1ULL << cpu)) {
+						node_cpus[node_count][node_sizes[node_count]++] = cpu;
+					}
+				}
+			}
+
+			if (node_sizes[node_count] > 0) {
+				node_count++;
+			}
+		}
+	}
+
+	DWORD length = 0;
+	GetLogicalProcessorInformation(NULL, &length);
+	SYSTEM_LOGICAL_PROCESSOR_INFORMATION* info = malloc(length);
+
+	if (info != NULL && GetLogicalProcessorInformation(info, &length)) {
+		for (DWORD i = 0; i < length / sizeof(*info); i++) {
+			if (info[i].Relationship == RelationCache && info[i].Cache.Level == 2) {
+				topology->l2_size = info[i].Cache.Size;
+				break;
+			}
+		}
+	}
+
+	free(info);
+#elif defined(__linux__)
+	char text[4096];
+	char path[128];
+
+	for (int node = 0; node < 64; node++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+		if (read_small_file(path, text, sizeof(text)) == false) {
+			continue;
+		}
+
+		node_sizes[node_count] = parse_cpu_list(text, node_cpus[node_count], 256);
+
+		if (node_sizes[node_count] > 0) {
+			node_count++;
+		}
+	}
+
+	for (int index = 0; index < 8; index++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/level", index);
+
+		if (read_small_file(path, text, sizeof(text)) == false || atoi(text) != 2) {
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", index);
+
+		if (read_small_file(path, text, sizeof(text))) {
+			char* unit;
+			size_t size = strtoul(text, &unit, 10);
+			topology->l2_size = size * (*unit == 'M' ? 1024 * 1024 : *unit == 'K' ? 1024 : 1);
+		}
+
+		break;
+	}
+#endif
+
+	// No NUMA information, treat the machine as one node
+	if (node_count == 0) {
+		node_count = 1;
+		node_sizes[0] = SDL_GetCPUCount();
+
+		for (int cpu = 0; cpu < node_sizes[0] && cpu < 256; cpu++) {
+			node_cpus[0][cpu] = cpu;
+		}
+	}
+
+	topology->node_count = node_count;
+
+	for (int round = 0; round < 256 && topology->cpu_count < max_cpus; round++) {
+		for (int node = 0; node < node_count && topology->cpu_count < max_cpus; node++) {
+			if (round < node_sizes[node]) {
+				topology->cpus[topology->cpu_count] = node_cpus[node][round];
+				topology->cpu_nodes[topology->cpu_count] = node;
+				topology->cpu_count++;
+			}
+		}
+	}
+}
+
+// Bytes an instance touches while running
+size_t state_footprint(const struct State* state) {
+	size_t size = sizeof(struct State) + state->memory_size + sizeof(uint64_t) * VIDEO_BUFFER_WORDS;
+
+	if (state->megachip != NULL) {
+		size += sizeof(struct MegaChip);
+	}
+
+	return size;
+}
+
+struct Batch {
+	struct RomCorpus* corpus;
+	uint32_t instances;
+	uint32_t frames;
+	// Instances run in lockstep groups of this many, sized to stay in L2
+	uint32_t group_size;
+	SDL_atomic_t next_instance;
+	SDL_atomic_t ready;
+	SDL_atomic_t start;
+};
+
+struct BatchWorker {
+	struct Batch* batch;
+	int cpu;
+	double seconds;
+	uint64_t instructions;
+	bool failed;
+};
+
+int batch_worker_thread(void* data) {
+	struct BatchWorker* worker = data;
+	struct Batch* batch = worker->batch;
+	struct RomCorpus* corpus = batch->corpus;
+
+	// Pin before allocating, so first touch puts every page on this node.
+	// The same group of states is reused for every instance this worker runs.
+	if (worker->cpu >= 0) {
+		pin_thread(worker->cpu);
+	}
+
+	struct State** states = calloc(batch->group_size, sizeof(struct State*));
+	worker->failed = states == NULL;
+
+	for (uint32_t i = 0; i < batch->group_size && worker->failed == false; i++) {
+		states[i] = state_init();
+		worker->failed = states[i] == NULL;
+	}
+
+	SDL_AtomicAdd(&batch->ready, 1);
+
+	while (SDL_AtomicGet(&batch->start) == 0) {
+		SDL_Delay(0);
+	}
+
+	uint64_t start_time = SDL_GetPerformanceCounter();
+
+	while (worker->failed == false) {
+		uint32_t first = (uint32_t)SDL_AtomicAdd(&batch->next_instance, batch->group_size);
+
+		if (first >= batch->instances) {
+			break;
+		}
+
+		uint32_t count = first + batch->group_size < batch->instances ? batch->group_size : batch->instances - first;
+
+		// ROMs are handed out in the order they finished loading
+		for (uint32_t i = 0; i < count; i++) {
+			int rom = corpus_wait(corpus, (first + i) % corpus->count);
+
+			state_reset(states[i]);
+
+			if (corpus->sizes[rom] == 0 ||
+				load_program(states[i], corpus_rom(corpus, rom), corpus->sizes[rom], corpus->paths[rom]) == false) {
+				// Skipped, the loader already said why
+				states[i]->end_of_program = true;
+			}
+		}
+
+		for (uint32_t frame = 0; frame < batch->frames; frame++) {
+			for (uint32_t i = 0; i < count; i++) {
+				if (states[i]->end_of_program == false) {
+					state_frame(states[i], NULL);
+					worker->instructions += CYCLES_PER_FRAME;
+				}
+			}
+		}
+	}
+
+	worker->seconds = (double)(SDL_GetPerformanceCounter() - start_time) / SDL_GetPerformanceFrequency();
+
+	for (uint32_t i = 0; states != NULL && i < batch->group_size; i++) {
+		if (states[i] != NULL) {
+			state_destroy(states[i]);
+		}
+	}
+
+	free(states);
+
+	return 0;
+}
+
+// Runs all instances over thread_count pinned threads, returns instructions per second
+double batch_run(struct Batch* batch, const struct Topology* topology, int thread_count) {
+	struct BatchWorker* workers = calloc(thread_count, sizeof(struct BatchWorker));
+	SDL_Thread** threads = calloc(thread_count, sizeof(SDL_Thread*));
+
+	if (workers == NULL || threads == NULL) {
+		fprintf(stderr, "Failed to allocate batch workers.\n");
+		free(workers);
+		free(threads);
+		return 0;
+	}
+
+	SDL_AtomicSet(&batch->next_instance, 0);
+	SDL_AtomicSet(&batch->ready, 0);
+	SDL_AtomicSet(&batch->start, 0);
+
+	int started = 0;
+
+	for (int i = 0; i < thread_count; i++) {
+		workers[i].batch = batch;
+		workers[i].cpu = i < topology->cpu_count ? topology->cpus[i] : -1;
+
+		threads[i] = SDL_CreateThread(batch_worker_thread, "batch", &workers[i]);
+
+		if (threads[i] == NULL) {
+			fprintf(stderr, "Failed to create batch thread: %s\n", SDL_GetError());
+		}
+		else {
+			started++;
+		}
+	}
+
+	// Everyone allocates first, then all start together
+	while (SDL_AtomicGet(&batch->ready) < started) {
+		SDL_Delay(1);
+	}
+
+	SDL_AtomicSet(&batch->start, 1);
+
+	double slowest = 0;
+	uint64_t instructions = 0;
+
+	for (int i = 0; i < thread_count; i++) {
+		if (threads[i] == NULL) {
+			continue;
+		}
+
+		SDL_WaitThread(threads[i], NULL);
+
+		if (workers[i].failed) {
+			fprintf(stderr, "Batch worker %d failed to allocate its instances\n", i);
+		}
+
+		if (workers[i].seconds > slowest) {
+			slowest = workers[i].seconds;
+		}
+
+		instructions += workers[i].instructions;
+	}
+
+	free(workers);
+	free(threads);
+
+	return slowest > 0 ? instructions / slowest : 0;
+}
+
+// --batch: runs every ROM given (repeated up to --instances) headless. ROMs
+// are bulk loaded in the background and start running as they arrive.
+bool batch_roms(const char** rom_paths, int rom_count, uint32_t instances, uint32_t frames, int thread_count, bool scaling) {
+	if (rom_count == 0) {
+		fprintf(stderr, "No ROM file provided.\n");
+		return false;
+	}
+
+	struct RomCorpus corpus;
+
+	if (corpus_start(&corpus, rom_paths, rom_count) == false) {
+		return false;
+	}
+
+	struct State* probe = state_init();
+
+	if (probe == NULL) {
+		corpus_destroy(&corpus);
+		return false;
+	}
+
+	struct Topology topology;
+	topology_detect(&topology);
+
+	if (instances < (uint32_t)rom_count) {
+		instances = rom_count;
+	}
+
+	if (thread_count <= 0 || thread_count > topology.cpu_count) {
+		thread_count = topology.cpu_count;
+	}
+
+	// Half of L2, the rest is for the interpreter's own code and stack
+	size_t footprint = state_footprint(probe);
+	struct Batch batch;
+	batch.corpus = &corpus;
+	batch.instances = instances;
+	batch.frames = frames;
+	batch.group_size = (uint32_t)(topology.l2_size / 2 / footprint);
+
+	if (batch.group_size == 0) {
+		batch.group_size = 1;
+	}
+
+	printf("%u instances x %u frames, %d NUMA node(s), %d CPUs, L2 %zuK, %zu bytes per instance, groups of %u\n",
+		instances, frames, topology.node_count, topology.cpu_count, topology.l2_size / 1024, footprint, batch.group_size);
+
+	// Doubling thread counts up to all of them, or just all of them
+	int threads = scaling ? 1 : thread_count;
+	double single = 0;
+
+	while (true) {
+		double rate = batch_run(&batch, &topology, threads);
+
+		if (single == 0) {
+			single = rate / threads;
+		}
+
+		printf("  %3d threads: %10.2f MIPS, speedup %5.2fx, efficiency %5.1f%%\n",
+			threads, rate / 1000000.0, rate / single, rate / single / threads * 100.0);
+
+		if (threads == thread_count) {
+			break;
+		}
+
+		threads = threads * 2 < thread_count ? threads * 2 : thread_count;
+	}
+
+	corpus_destroy(&corpus);
+
+	printf("Loaded %d ROMs in %dms using %s\n", rom_count, SDL_AtomicGet(&corpus.finish_time_ms) - 1,
+		corpus.used_io_uring ? "io_uring" : "reader threads");
+
+	state_destroy(probe);
+
+	return true;
+}
+
+// --kiosk: every ROM is read into one arena up front and each game is kept as
+// a snapshot while it's suspended, so switching is a save and a load rather
+// than a reload. Classic ROMs only, snapshots don't hold MegaChip state.
+struct Kiosk {
+	struct RomCorpus corpus;
+	// Corpus index of each game in menu order, failed ROMs left out
+	int* roms;
+	struct Snapshot* games;
+	int count;
+	int current;
+};
+
+void kiosk_destroy(struct Kiosk* kiosk) {
+	corpus_destroy(&kiosk->corpus);
+	free(kiosk->roms);
+	free(kiosk->games);
+}
+
+// Puts the current game back to how it was just after loading
+void kiosk_restart(struct Kiosk* kiosk, struct State* state) {
+	int rom = kiosk->roms[kiosk->current];
+
+	state_reset(state);
+	load_program(state, corpus_rom(&kiosk->corpus, rom), kiosk->corpus.sizes[rom], kiosk->corpus.paths[rom]);
+}
+
+bool kiosk_init(struct Kiosk* kiosk, const char** paths, int count, struct State* state) {
+	memset(kiosk, 0, sizeof(struct Kiosk));
+
+	if (count == 0) {
+		fprintf(stderr, "No ROM file provided.\n");
+		return false;
+	}
+
+	if (corpus_start(&kiosk->corpus, paths, count) == false) {
+		return false;
+	}
+
+	kiosk->roms = calloc(count, sizeof(int));
+	kiosk->games = malloc(count * sizeof(struct Snapshot));
+
+	if (kiosk->roms == NULL || kiosk->games == NULL) {
+		fprintf(stderr, "Failed to allocate kiosk games.\n");
+		kiosk_destroy(kiosk);
+		return false;
+	}
+
+	// Everything has to be in before the menu order can be built
+	for (int i = 0; i < count; i++) {
+		corpus_wait(&kiosk->corpus, i);
+	}
+
+	for (int i = 0; i < count; i++) {
+		if (kiosk->corpus.sizes[i] == 0) {
+			continue;
+		}
+
+		kiosk->roms[kiosk->count] = i;
+		kiosk->current = kiosk->count;
+		kiosk_restart(kiosk, state);
+		state_save(state, &kiosk->games[kiosk->count]);
+		kiosk->count++;
+	}
+
+	if (kiosk->count == 0) {
+		fprintf(stderr, "None of the kiosk ROMs could be loaded.\n");
+		kiosk_destroy(kiosk);
+		return false;
+	}
+
+	kiosk->current = 0;
+	state_load(state, &kiosk->games[0]);
+
+	printf("Kiosk: %d games, Tab/Shift+Tab to switch, F5 to restart\n", kiosk->count);
+
+	return true;
+}
+
+const char* kiosk_name(const struct Kiosk* kiosk) {
+	return kiosk->corpus.paths[kiosk->roms[kiosk->current]];
+}
+
+// Suspends the running game and resumes the one offset places along the menu
+void kiosk_switch(struct Kiosk* kiosk, struct State* state, int offset) {
+	uint64_t start_time = SDL_GetPerformanceCounter();
+
+	state_save(state, &kiosk->games[kiosk->current]);
+
+	kiosk->current = ((kiosk->current + offset) % kiosk->count + kiosk->count) % kiosk->count;
+	state_load(state, &kiosk->games[kiosk->current]);
+
+	double micros = (double)(SDL_GetPerformanceCounter() - start_time) * 1000000.0 / SDL_GetPerformanceFrequency();
+	printf("Switched to %s in %.1fus\n", kiosk_name(kiosk), micros);
+}
+
+// --rewind: hold Backspace to run the game backwards. Every frame's Snapshot is stored as a run-length encoded XOR
+// against the frame before it, in chunks of REWIND_CHUNK_FRAMES that start
+// with a keyframe (an XOR against zeros). XOR goes both ways, so stepping back
+// a frame is one decode into the current snapshot. Once the chunks in memory
+// go over budget the oldest are handed to a writer thread, which appends them
+// to a spill file. The emulation thread never waits on the disk to record.
+const uint32_t REWIND_CHUNK_FRAMES = 600;
+const int REWIND_SPILL_QUEUE = 64;
+
+enum RewindChunkPlace {
+	REWIND_MEMORY = 0,
+	// Queued for or being written by the writer thread, data still valid
+	REWIND_SPILLING,
+	// On disk, data freed once the emulation thread notices
+	REWIND_DISK
+};
+
+struct RewindChunk {
+	uint32_t first_frame;
+	uint32_t frame_count;
+	// Start of each frame's record in data, plus one for the end
+	uint32_t* offsets;
+	uint8_t* data;
+	size_t capacity;
+	SDL_atomic_t place;
+	// Where the writer put it, valid once place is REWIND_DISK
+	uint64_t file_offset;
+	// Set by the writer when it gave up and put it back to REWIND_MEMORY,
+	// it has to count against the budget again
+	bool spill_failed;
+};
+
+struct Rewind {
+	struct RewindChunk** chunks;
+	uint32_t chunk_count;
+	uint32_t chunk_capacity;
+	// Frames of history, the newest is the state as it is now
+	uint32_t frame_count;
+	// The newest frame, what every new delta is taken against
+	struct Snapshot current;
+	size_t memory_bytes;
+	size_t memory_budget;
+	uint64_t spilled_bytes;
+	// Chunks before this have been checked for freeing after spilling
+	uint32_t next_to_free;
+	// Single producer (emulation thread), single consumer (writer thread)
+	struct RewindChunk* queue[64];
+	SDL_atomic_t queue_head;
+	SDL_atomic_t queue_tail;
+	SDL_atomic_t running;
+	SDL_atomic_t spill_failed;
+	SDL_Thread* writer;
+	const char* path;
+	// Shared by the writer appending and rewind reading back, hence the lock
+	FILE* file;
+	SDL_mutex* file_lock;
+	uint64_t file_size;
+	bool failed;
+};
+
+FORCE_INLINE uint8_t rewind_delta(const uint8_t* data, const uint8_t* previous, size_t i) {
+	return previous != NULL ? data[i] ^ previous[i] : data[i];
+}
+
+// Runs of unchanged bytes are skipped: [uint16 skip][uint16 count][count bytes
+// of XOR]. previous is NULL for keyframes. out needs room for 3x size.
+size_t rewind_encode(const uint8_t* data, const uint8_t* previous, size_t size, uint8_t* out) {
+	size_t length = 0;
+	size_t i = 0;
+
+	while (i < size) {
+		size_t skip_start = i;
+
+		while (i < size && i - skip_start < 0xFFFF && rewind_delta(data, previous, i) == 0) {
+			i++;
+		}
+
+		if (i == size) {
+			break;
+		}
+
+		size_t literal_start = i;
+
+		// Gaps of two unchanged bytes cost less inside the literal than a new header
+		while (i < size && i - literal_start < 0xFFFF &&
+			(rewind_delta(data, previous, i) != 0 ||
+			(i + 2 < size && (rewind_delta(data, previous, i + 1) != 0 || rewind_delta(data, previous, i + 2) != 0)))) {
+			i++;
+		}
+
+		uint16_t header[2] = { (uint16_t)(literal_start - skip_start), (uint16_t)(i - literal_start) };
+		memcpy(&out[length], header, sizeof(header));
+		length += sizeof(header);
+
+		for (size_t j = literal_start; j < i; j++) {
+			out[length++] = rewind_delta(data, previous, j);
+		}
+	}
+
+	return length;
+}
+
+// XORs a record into data, which takes it one frame either way
+void rewind_apply(const uint8_t* record, size_t length, uint8_t* data) {
+	size_t position = 0;
+
+	for (size_t i = 0; i < length;) {
+		uint16_t header[2];
+		memcpy(header, &record[i], sizeof(header));
+		i += sizeof(header);
+
+		position += header[0];
+
+		for (uint16_t j = 0; j < header[1]; j++) {
+			data[position++] ^= record[i++];
+		}
+	}
+}
+
+// fseek takes a long, which is 32 bits on Windows and 32-bit Linux
+bool rewind_seek(FILE* file, uint64_t offset) {
+#if defined(_WIN32)
+	return _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+#else
+	return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+int rewind_writer_thread(void* data) {
+	struct Rewind* rewind = data;
+
+	while (true) {
+		int tail = SDL_AtomicGet(&rewind->queue_tail);
+
+		if (tail == SDL_AtomicGet(&rewind->queue_head)) {
+			if (SDL_AtomicGet(&rewind->running) == 0) {
+				break;
+			}
+
+			SDL_Delay(5);
+			continue;
+		}
+
+		SDL_MemoryBarrierAcquire();
+
+		struct RewindChunk* chunk = rewind->queue[tail % REWIND_SPILL_QUEUE];
+		uint32_t size = chunk->offsets[chunk->frame_count];
+
+		// Append-only: the offsets then the records
+		SDL_LockMutex(rewind->file_lock);
+
+		chunk->file_offset = rewind->file_size;
+
+		bool written = rewind_seek(rewind->file, rewind->file_size) &&
+			fwrite(chunk->offsets, sizeof(uint32_t), chunk->frame_count + 1, rewind->file) == chunk->frame_count + 1 &&
+			fwrite(chunk->data, 1, size, rewind->file) == size &&
+			fflush(rewind->file) == 0;
+
+		if (written) {
+			rewind->file_size += (chunk->frame_count + 1) * sizeof(uint32_t) + size;
+		}
+
+		SDL_UnlockMutex(rewind->file_lock);
+
+		if (written == false) {
+			// Keep it in memory, over budget is better than losing history
+			fprintf(stderr, "Failed to spill rewind history to %s, keeping it in memory.\n", rewind->path);
+			SDL_AtomicSet(&rewind->spill_failed, 1);
+			chunk->spill_failed = true;
+		}
+
+		SDL_MemoryBarrierRelease();
+		SDL_AtomicSet(&chunk->place, written ? REWIND_DISK : REWIND_MEMORY);
+		SDL_AtomicSet(&rewind->queue_tail, tail + 1);
+	}
+
+	return 0;
+}
+
+struct Rewind* rewind_create(const char* path, size_t memory_budget) {
+	struct Rewind* rewind = calloc(1, sizeof(struct Rewind));
+
+	if (rewind == NULL) {
+		fprintf(stderr, "Failed to allocate rewind history.\n");
+		return NULL;
+	}
+
+	rewind->path = path;
+	rewind->memory_budget = memory_budget;
+
+	if (fopen_s(&rewind->file, path, "w+b") != 0) {
+		fprintf(stderr, "Failed to open rewind spill file %s\n", path);
+		free(rewind);
+		return NULL;
+	}
+
+	rewind->file_lock = SDL_CreateMutex();
+	SDL_AtomicSet(&rewind->running, 1);
+
+	if (rewind->file_lock != NULL) {
+		rewind->writer = SDL_CreateThread(rewind_writer_thread, "rewind writer", rewind);
+	}
+
+	// Still works, just all in memory
+	if (rewind->writer == NULL) {
+		fprintf(stderr, "Failed to start rewind writer, history won't spill: %s\n", SDL_GetError());
+	}
+
+	return rewind;
+}
+
+FORCE_INLINE size_t rewind_chunk_bytes(const struct RewindChunk* chunk) {
+	return chunk->capacity + (REWIND_CHUNK_FRAMES + 1) * sizeof(uint32_t);
+}
+
+void rewind_free_chunk_data(struct RewindChunk* chunk) {
+	free(chunk->data);
+	free(chunk->offsets);
+	chunk->data = NULL;
+	chunk->offsets = NULL;
+	chunk->capacity = 0;
+}
+
+// Takes back a chunk the writer failed to spill, which stopped counting
+// against the budget when it was queued
+void rewind_unspill(struct Rewind* rewind, struct RewindChunk* chunk) {
+	if (chunk->spill_failed) {
+		rewind->memory_bytes += rewind_chunk_bytes(chunk);
+		chunk->spill_failed = false;
+	}
+}
+
+void rewind_destroy(struct Rewind* rewind) {
+	if (rewind->writer != NULL) {
+		SDL_AtomicSet(&rewind->running, 0);
+		SDL_WaitThread(rewind->writer, NULL);
+	}
+
+	for (uint32_t i = 0; i < rewind->chunk_count; i++) {
+		free(rewind->chunks[i]->data);
+		free(rewind->chunks[i]->offsets);
+		free(rewind->chunks[i]);
+	}
+
+	free(rewind->chunks);
+
+	if (rewind->file_lock != NULL) {
+		SDL_DestroyMutex(rewind->file_lock);
+	}
+
+	fclose(rewind->file);
+	remove(rewind->path);
+
+	free(rewind);
+}
+
+bool rewind_new_chunk(struct Rewind* rewind) {
+	if (rewind->chunk_count == rewind->chunk_capacity) {
+		uint32_t capacity = rewind->chunk_capacity > 0 ? rewind->chunk_capacity * 2 : 64;
+		struct RewindChunk** chunks = realloc(rewind->chunks, capacity * sizeof(struct RewindChunk*));
+
+		if (chunks == NULL) {
+			return false;
+		}
+
+		rewind->chunks = chunks;
+		rewind->chunk_capacity = capacity;
+	}
+
+	struct RewindChunk* chunk = calloc(1, sizeof(struct RewindChunk));
+
+	if (chunk == NULL) {
+		return false;
+	}
+
+	chunk->offsets = calloc(REWIND_CHUNK_FRAMES + 1, sizeof(uint32_t));
+
+	if (chunk->offsets == NULL) {
+		free(chunk);
+		return false;
+	}
+
+	chunk->first_frame = rewind->frame_count;
+	rewind->memory_bytes += (REWIND_CHUNK_FRAMES + 1) * sizeof(uint32_t);
+	rewind->chunks[rewind->chunk_count++] = chunk;
+
+	return true;
+}
+
+// Hands the oldest chunks still in memory to the writer until back under
+// budget, and frees the ones it's finished with. Handed off chunks stop
+// counting against the budget straight away.
+void rewind_spill(struct Rewind* rewind) {
+	for (; rewind->next_to_free < rewind->chunk_count; rewind->next_to_free++) {
+		struct RewindChunk* chunk = rewind->chunks[rewind->next_to_free];
+		int place = SDL_AtomicGet(&chunk->place);
+
+		if (place == REWIND_SPILLING) {
+			break;
+		}
+
+		if (place == REWIND_DISK && chunk->data != NULL) {
+			rewind_free_chunk_data(chunk);
+		}
+
+		rewind_unspill(rewind, chunk);
+	}
+
+	if (rewind->writer == NULL || SDL_AtomicGet(&rewind->spill_failed) != 0) {
+		return;
+	}
+
+	// Never the chunk being added to
+	for (uint32_t i = 0; i + 1 < rewind->chunk_count && rewind->memory_bytes > rewind->memory_budget; i++) {
+		struct RewindChunk* chunk = rewind->chunks[i];
+		int head = SDL_AtomicGet(&rewind->queue_head);
+
+		if (head - SDL_AtomicGet(&rewind->queue_tail) == REWIND_SPILL_QUEUE) {
+			break;
+		}
+
+		if (chunk->data == NULL || SDL_AtomicGet(&chunk->place) != REWIND_MEMORY) {
+			continue;
+		}
+
+		SDL_AtomicSet(&chunk->place, REWIND_SPILLING);
+		rewind->queue[head % REWIND_SPILL_QUEUE] = chunk;
+
+		SDL_MemoryBarrierRelease();
+		SDL_AtomicSet(&rewind->queue_head, head + 1);
+
+		if (i < rewind->next_to_free) {
+			rewind->next_to_free = i;
+		}
+
+		rewind->memory_bytes -= rewind_chunk_bytes(chunk);
+	}
+}
+
+// After every frame
+void rewind_push(struct Rewind* rewind, const struct State* state) {
+	if (rewind->failed || state->megachip_mode) {
+		return;
+	}
+
+	struct Snapshot snapshot;
+	state_save(state, &snapshot);
+
+	if (rewind->chunk_count == 0 || rewind->chunks[rewind->chunk_count - 1]->frame_count == REWIND_CHUNK_FRAMES) {
+		if (rewind_new_chunk(rewind) == false) {
+			fprintf(stderr, "Failed to allocate rewind history, it stops here.\n");
+			rewind->failed = true;
+			return;
+		}
+	}
+
+	struct RewindChunk* chunk = rewind->chunks[rewind->chunk_count - 1];
+	uint32_t size = chunk->offsets[chunk->frame_count];
+
+	if (chunk->capacity < size + sizeof(struct Snapshot) * 3) {
+		size_t capacity = chunk->capacity * 2 > size + sizeof(struct Snapshot) * 3 ? chunk->capacity * 2 : size + sizeof(struct Snapshot) * 3;
+		uint8_t* data = realloc(chunk->data, capacity);
+
+		if (data == NULL) {
+			fprintf(stderr, "Failed to allocate rewind history, it stops here.\n");
+			rewind->failed = true;
+			return;
+		}
+
+		rewind->memory_bytes += capacity - chunk->capacity;
+		chunk->data = data;
+		chunk->capacity = capacity;
+	}
+
+	// Keyframes against zeros, everything else against the frame before
+	const uint8_t* previous = chunk->frame_count > 0 ? (const uint8_t*)&rewind->current : NULL;
+	size += (uint32_t)rewind_encode((const uint8_t*)&snapshot, previous, sizeof(struct Snapshot), &chunk->data[size]);
+
+	chunk->frame_count++;
+	chunk->offsets[chunk->frame_count] = size;
+	rewind->frame_count++;
+	rewind->current = snapshot;
+
+	rewind_spill(rewind);
+}
+
+// Brings a chunk back into memory, waiting for the writer if it's mid spill
+bool rewind_fetch(struct Rewind* rewind, struct RewindChunk* chunk) {
+	if (SDL_AtomicGet(&chunk->place) == REWIND_MEMORY) {
+		SDL_MemoryBarrierAcquire();
+		rewind_unspill(rewind, chunk);
+		return true;
+	}
+
+	while (SDL_AtomicGet(&chunk->place) == REWIND_SPILLING) {
+		SDL_Delay(1);
+	}
+
+	SDL_MemoryBarrierAcquire();
+
+	if (SDL_AtomicGet(&chunk->place) == REWIND_MEMORY) {
+		rewind_unspill(rewind, chunk);
+		return true;
+	}
+
+	if (chunk->data == NULL) {
+		uint32_t offsets = chunk->frame_count + 1;
+
+		chunk->offsets = calloc(REWIND_CHUNK_FRAMES + 1, sizeof(uint32_t));
+
+		SDL_LockMutex(rewind->file_lock);
+
+		bool read = chunk->offsets != NULL &&
+			rewind_seek(rewind->file, chunk->file_offset) &&
+			fread(chunk->offsets, sizeof(uint32_t), offsets, rewind->file) == offsets &&
+			(chunk->data = malloc(chunk->offsets[chunk->frame_count])) != NULL &&
+			fread(chunk->data, 1, chunk->offsets[chunk->frame_count], rewind->file) == chunk->offsets[chunk->frame_count];
+
+		SDL_UnlockMutex(rewind->file_lock);
+
+		if (read == false) {
+			fprintf(stderr, "Failed to read rewind history back from %s\n", rewind->path);
+			return false;
+		}
+
+		chunk->capacity = chunk->offsets[chunk->frame_count];
+	}
+
+	rewind->memory_bytes += rewind_chunk_bytes(chunk);
+
+	// Being appended to again, the copy on disk is just garbage now
+	SDL_AtomicSet(&chunk->place, REWIND_MEMORY);
+
+	return true;
+}
+
+// Steps state back one frame, returns false when there's no more history
+bool rewind_step_back(struct Rewind* rewind, struct State* state) {
+	if (rewind->frame_count <= 1 || rewind->failed) {
+		return false;
+	}
+
+	struct RewindChunk* chunk = rewind->chunks[rewind->chunk_count - 1];
+
+	if (chunk->frame_count > 1) {
+		uint32_t start = chunk->offsets[chunk->frame_count - 1];
+		rewind_apply(&chunk->data[start], chunk->offsets[chunk->frame_count] - start, (uint8_t*)&rewind->current);
+		chunk->frame_count--;
+	}
+	else {
+		// Only the keyframe left, the frame before is the end of the previous chunk
+		rewind->memory_bytes -= rewind_chunk_bytes(chunk);
+		rewind_free_chunk_data(chunk);
+		free(chunk);
+		rewind->chunk_count--;
+
+		chunk = rewind->chunks[rewind->chunk_count - 1];
+
+		if (rewind_fetch(rewind, chunk) == false) {
+			rewind->failed = true;
+			return false;
+		}
+
+		if (rewind->next_to_free > rewind->chunk_count - 1) {
+			rewind->next_to_free = rewind->chunk_count - 1;
+		}
+
+		memset(&rewind->current, 0, sizeof(rewind->current));
+
+		for (uint32_t i = 0; i < chunk->frame_count; i++) {
+			rewind_apply(&chunk->data[chunk->offsets[i]], chunk->offsets[i + 1] - chunk->offsets[i], (uint8_t*)&rewind->current);
+		}
+	}
+
+	rewind->frame_count--;
+	state_load(state, &rewind->current);
+
+	return true;
+}
+
+void rewind_report(struct Rewind* rewind) {
+	// The writer may still be appending
+	SDL_LockMutex(rewind->file_lock);
+	uint64_t file_size = rewind->file_size;
+	SDL_UnlockMutex(rewind->file_lock);
+
+	printf("Rewind: %u frames of history, %.1fMB in memory, %.1fMB spill file\n",
+		rewind->frame_count, rewind->memory_bytes / 1048576.0, file_size / 1048576.0);
+}
+
+// --fuzz: searches for keypad input that reaches new code or new screens, and
+// keeps any that crash the ROM or leave it stuck. Input movies (the key held
+// each frame) are mutated and spliced AFL-style from a corpus of interesting
+// ones. Every corpus movie keeps snapshots along the way in the shared
+// SnapshotStore, so a candidate starts at the snapshot just before the first
+// frame it changes rather than from power-on.
+const uint32_t FUZZ_SNAPSHOT_INTERVAL = 60;
+// No machine state that hasn't been seen in this long is a soft-lock
+const uint32_t FUZZ_SOFTLOCK_FRAMES = 600;
+// Progress hashes remembered while looking for one, half full at most
+const uint32_t FUZZ_PROGRESS_SLOTS = 2048;
+const uint32_t FUZZ_MAX_CORPUS = 1024;
+const uint32_t FUZZ_MAX_FINDINGS = 64;
+
+enum FuzzFault {
+	FUZZ_OK = 0,
+	FUZZ_PC_OUT_OF_RANGE,
+	FUZZ_STACK_UNDERFLOW,
+	FUZZ_STACK_OVERFLOW,
+	FUZZ_I_OUT_OF_RANGE,
+	FUZZ_UNKNOWN_OPCODE,
+	FUZZ_SOFTLOCK
+};
+
+const char* const FUZZ_FAULT_NAMES[] = {
+	"ok",
+	"pc ran off the end of memory",
+	"return with an empty stack",
+	"stack overflowed into the program",
+	"I out of range",
+	"unknown opcode",
+	"soft-lock"
+};
+
+struct FuzzEntry {
+	// Held key for every frame of the run, 16 for none
+	uint8_t* keys;
+	// Frames it ran before stopping
+	uint32_t length;
+	// Machine before every FUZZ_SNAPSHOT_INTERVAL-th frame
+	struct StoredSnapshot* snapshots;
+	uint32_t snapshot_count;
+};
+
+struct FuzzFinding {
+	uint8_t fault;
+	uint16_t pc;
+};
+
+struct Fuzzer {
+	const char* rom_path;
+	const char* output_path;
+	uint32_t frames;
+	SDL_atomic_t running;
+	// Everything below is shared between workers
+	SDL_mutex* lock;
+	struct SnapshotStore store;
+	struct FuzzEntry* entries;
+	uint32_t entry_count;
+	// Merged COVERAGE_* flags of every run
+	uint8_t* coverage;
+	// Open addressed set of framebuffer hashes seen, 0 is empty
+	uint64_t* screens;
+	uint32_t screen_count;
+	uint32_t screen_capacity;
+	struct FuzzFinding findings[64];
+	uint32_t finding_count;
+	uint64_t runs;
+	uint64_t frames_run;
+};
+
+// What one worker needs to run candidates, none of it shared
+struct FuzzWorker {
+	struct Fuzzer* fuzzer;
+	SDL_Thread* thread;
+	uint32_t rng;
+	struct State* state;
+	uint8_t* keys;
+	// Frame the candidate first differs from its parent
+	uint32_t start;
+	uint32_t parent;
+	struct Snapshot* snapshots;
+	uint64_t* screens;
+	uint32_t screen_count;
+	// Open addressed set of fuzz_progress_hash values, 0 is empty
+	uint64_t progress[2048]; // FUZZ_PROGRESS_SLOTS
+	uint32_t progress_count;
+};
+
+uint32_t fuzz_random(uint32_t* rng) {
+	// xorshift32, same as the interpreter's
+	uint32_t x = *rng;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*rng = x;
+
+	return x;
+}
+
+// What executing the instruction at pc would break, checked first so a bad ROM
+// can't take the fuzzer down with it. Classic machine only.
+uint8_t fuzz_check(const struct State* state) {
+	if (state->pc >= state->memory_size - 1) {
+		return FUZZ_PC_OUT_OF_RANGE;
+	}
+
+	uint16_t opcode = state->memory[state->pc] << 8 | state->memory[state->pc + 1];
+	uint8_t x = (opcode >> 8) & 0xF;
+	size_t bytes = 0;
+
+	if (opcode == 0x00EE && state->sp < STACK_START + 2) {
+		return FUZZ_STACK_UNDERFLOW;
+	}
+
+	if ((opcode >> 12) == 0x2 && (size_t)state->sp + 2 > PROGRAM_START) {
+		return FUZZ_STACK_OVERFLOW;
+	}
+
+	if ((opcode >> 12) == 0xD) {
+		// Worst case, a 16x16 sprite on every plane
+		bytes = ((opcode & 0xF) == 0 ? 32 : (opcode & 0xF)) * state_framebuffer(state)->planes;
+	}
+	else if ((opcode & 0xF0FF) == 0xF033) {
+		bytes = 3;
+	}
+	else if ((opcode & 0xF0FF) == 0xF055 || (opcode & 0xF0FF) == 0xF065) {
+		bytes = x + 1;
+	}
+
+	if (bytes > 0 && state->reg_i + bytes > state->memory_size) {
+		return FUZZ_I_OUT_OF_RANGE;
+	}
+
+	return FUZZ_OK;
+}
+
+// Movies hold a key per frame, recordings and state_frame want transitions
+void fuzz_input(const uint8_t* keys, uint32_t frame, struct FrameInput* input) {
+	uint8_t previous = frame > 0 ? keys[frame - 1] : 16;
+
+	input->count = keys[frame] != previous ? 1 : 0;
+	input->cycles[0] = 0;
+	input->keycodes[0] = keys[frame];
+}
+
+// Keys the instruction at pc looks at: EX9E and EXA1 test VX, FX0A takes any
+uint16_t fuzz_polled_keys(const struct State* state) {
+	uint8_t high = state->memory[state->pc];
+	uint8_t low = state->memory[state->pc + 1];
+
+	if ((high & 0xF0) == 0xE0 && (low == 0x9E || low == 0xA1)) {
+		return 1 << (state->regs_v[high & 0xF] & 0xF);
+	}
+
+	if ((high & 0xF0) == 0xF0 && low == 0x0A) {
+		return 0xFFFF;
+	}
+
+	return 0;
+}
+
+// state_frame, checking every instruction before it runs. Adds the keys the
+// ROM looked at to polled, if it's given.
+uint8_t fuzz_frame(struct State* state, const struct FrameInput* input, uint16_t* polled) {
+	if (input->count > 0) {
+		state->keycode = input->keycodes[0];
+	}
+
+	for (int i = 0; i < CYCLES_PER_FRAME; i++) {
+		uint8_t fault = fuzz_check(state);
+
+		if (fault != FUZZ_OK) {
+			return fault;
+		}
+
+		if (polled != NULL) {
+			*polled |= fuzz_polled_keys(state);
+		}
+
+		uint32_t unknown = state->unknown_opcodes;
+		state_step(state);
+
+		if (state->unknown_opcodes != unknown) {
+			// Leave pc on it for the report
+			state->pc -= 2;
+			return FUZZ_UNKNOWN_OPCODE;
+		}
+	}
+
+	if (state->delay_timer > 0) {
+		state->delay_timer -= 1;
+	}
+
+	if (state->sound_timer > 0) {
+		state->sound_timer -= 1;
+	}
+
+	return FUZZ_OK;
+}
+
+uint64_t fuzz_screen_hash(const struct State* state) {
+	uint64_t hash = state->framebuffer_mode;
+
+	for (size_t i = 0; i < VIDEO_BUFFER_WORDS; i++) {
+		hash = (hash ^ state->video_buffer[i]) * 0x9E3779B97F4A7C15ULL;
+		hash ^= hash >> 29;
+	}
+
+	// 0 marks an empty slot
+	return hash != 0 ? hash : 1;
+}
+
+// Everything but the keypad, for spotting a machine that stopped. Memory
+// counts too, plenty of ROMs keep their progress there rather than in V.
+uint64_t fuzz_progress_hash(const struct State* state, uint64_t screen) {
+	uint64_t registers[3];
+	memcpy(registers, state->regs_v, sizeof(state->regs_v));
+	registers[2] = (uint64_t)state->pc << 48 | (uint64_t)state->sp << 32 | state->reg_i;
+
+	uint64_t hash = screen ^ (uint64_t)state->delay_timer << 8 ^ state->sound_timer;
+
+	for (int i = 0; i < 3; i++) {
+		hash = (hash ^ registers[i]) * 0x9E3779B97F4A7C15ULL;
+		hash ^= hash >> 29;
+	}
+
+	// Fuzzing is classic only, so memory is always MEMORY_SIZE
+	for (size_t i = 0; i < MEMORY_SIZE; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, &state->memory[i], sizeof(word));
+
+		hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+		hash ^= hash >> 29;
+	}
+
+	// 0 marks an empty slot
+	return hash != 0 ? hash : 1;
+}
+
+// Adds hash to the worker's set, false if it was already there. A loop that
+// doesn't line up with frames ends each one somewhere different, so a stuck
+// machine is one that keeps going round the same few states, not one that
+// repeats the last frame.
+bool fuzz_add_progress(struct FuzzWorker* worker, uint64_t hash) {
+	// Full of new states is plenty of progress, start again
+	if (worker->progress_count >= FUZZ_PROGRESS_SLOTS / 2) {
+		memset(worker->progress, 0, sizeof(worker->progress));
+		worker->progress_count = 0;
+	}
+
+	uint32_t slot = (uint32_t)hash & (FUZZ_PROGRESS_SLOTS - 1);
+
+	while (worker->progress[slot] != 0) {
+		if (worker->progress[slot] == hash) {
+			return false;
+		}
+
+		slot = (slot + 1) & (FUZZ_PROGRESS_SLOTS - 1);
+	}
+
+	worker->progress[slot] = hash;
+	worker->progress_count++;
+
+	return true;
+}
+
+// Runs worker->keys from worker->start, which must be on a snapshot. Returns
+// the fault that stopped it, with *length the frames run in total.
+uint8_t fuzz_run(struct FuzzWorker* worker, uint32_t* length) {
+	struct Fuzzer* fuzzer = worker->fuzzer;
+	struct State* state = worker->state;
+	uint32_t still_frames = 0;
+	// Keys the ROM looked at and keys it was given since the last progress
+	uint16_t polled = 0;
+	uint16_t pressed = 0;
+
+	state_load(state, &worker->snapshots[worker->start / FUZZ_SNAPSHOT_INTERVAL]);
+	memset(state->coverage, 0, COVERAGE_SIZE);
+	worker->screen_count = 0;
+	memset(worker->progress, 0, sizeof(worker->progress));
+	worker->progress_count = 0;
+
+	for (uint32_t frame = worker->start; frame < fuzzer->frames; frame++) {
+		if (frame % FUZZ_SNAPSHOT_INTERVAL == 0) {
+			state_save(state, &worker->snapshots[frame / FUZZ_SNAPSHOT_INTERVAL]);
+		}
+
+		struct FrameInput input;
+		fuzz_input(worker->keys, frame, &input);
+
+		uint8_t fault = fuzz_frame(state, &input, &polled);
+
+		if (fault != FUZZ_OK) {
+			*length = frame + 1;
+			return fault;
+		}
+
+		uint64_t screen = fuzz_screen_hash(state);
+		worker->screens[worker->screen_count++] = screen;
+
+		if (worker->keys[frame] < 16) {
+			pressed |= 1 << worker->keys[frame];
+		}
+
+		if (fuzz_add_progress(worker, fuzz_progress_hash(state, screen))) {
+			still_frames = 0;
+			polled = 0;
+			pressed = 0;
+		}
+		else {
+			still_frames++;
+		}
+
+		// Polling with EX9E/EXA1 or blocked on FX0A for keys that never came is
+		// waiting, not stuck
+		bool waiting = (polled != 0 && (polled & pressed) == 0) || low_power_frozen(state);
+
+		if (still_frames >= FUZZ_SOFTLOCK_FRAMES && waiting == false) {
+			*length = frame + 1;
+			return FUZZ_SOFTLOCK;
+		}
+	}
+
+	*length = fuzzer->frames;
+	return FUZZ_OK;
+}
+
+// Picks a parent and mutates a copy of its movie into worker->keys, from
+// worker->start on. Called with the lock held.
+void fuzz_mutate(struct FuzzWorker* worker) {
+	struct Fuzzer* fuzzer = worker->fuzzer;
+	uint32_t frames = fuzzer->frames;
+
+	worker->parent = fuzz_random(&worker->rng) % fuzzer->entry_count;
+
+	const struct FuzzEntry* parent = &fuzzer->entries[worker->parent];
+	uint32_t point = fuzz_random(&worker->rng) % parent->length;
+
+	memcpy(worker->keys, parent->keys, frames);
+
+	// Stacked, like AFL's havoc stage
+	int mutations = 1 + fuzz_random(&worker->rng) % 4;
+
+	for (int i = 0; i < mutations; i++) {
+		uint32_t at = point + fuzz_random(&worker->rng) % (frames - point);
+		uint32_t span = 1 + fuzz_random(&worker->rng) % 120;
+		uint8_t key = fuzz_random(&worker->rng) % 17;
+
+		if (span > frames - at) {
+			span = frames - at;
+		}
+
+		switch (fuzz_random(&worker->rng) % 5) {
+		case 0:
+			// Hold a key
+			memset(&worker->keys[at], key, span);
+			break;
+
+		case 1:
+			// Taps
+			for (uint32_t j = 0; j < span / 8 + 1; j++) {
+				worker->keys[at + fuzz_random(&worker->rng) % span] = fuzz_random(&worker->rng) % 17;
+			}
+
+			break;
+
+		case 2:
+			// Insert, pushing the rest later
+			memmove(&worker->keys[at + span], &worker->keys[at], frames - at - span);
+			memset(&worker->keys[at], key, span);
+			break;
+
+		case 3:
+			// Delete, pulling the rest earlier
+			memmove(&worker->keys[at], &worker->keys[at + span], frames - at - span);
+			memset(&worker->keys[frames - span], 16, span);
+			break;
+
+		default: {
+			// Splice in the tail of another movie
+			const struct FuzzEntry* other = &fuzzer->entries[fuzz_random(&worker->rng) % fuzzer->entry_count];
+			uint32_t from = fuzz_random(&worker->rng) % other->length;
+			uint32_t count = frames - at < frames - from ? frames - at : frames - from;
+
+			memcpy(&worker->keys[at], &other->keys[from], count);
 			break;
+		}
+		}
+	}
+
+	// Back to the snapshot before the first change
+	worker->start = point / FUZZ_SNAPSHOT_INTERVAL * FUZZ_SNAPSHOT_INTERVAL;
+	snapshot_store_get(&fuzzer->store, &parent->snapshots[worker->start / FUZZ_SNAPSHOT_INTERVAL], &worker->snapshots[worker->start / FUZZ_SNAPSHOT_INTERVAL]);
+}
+
+// Adds hash to the screen set, returns whether it's new. Called with the lock held.
+bool fuzz_add_screen(struct Fuzzer* fuzzer, uint64_t hash) {
+	if (fuzzer->screen_count * 2 >= fuzzer->screen_capacity) {
+		uint32_t capacity = fuzzer->screen_capacity * 2;
+		uint64_t* screens = calloc(capacity, sizeof(uint64_t));
+
+		// Stop looking for new screens rather than stop fuzzing
+		if (screens == NULL) {
+			return false;
+		}
+
+		for (uint32_t i = 0; i < fuzzer->screen_capacity; i++) {
+			if (fuzzer->screens[i] != 0) {
+				uint32_t slot = (uint32_t)fuzzer->screens[i] & (capacity - 1);
+
+				while (screens[slot] != 0) {
+					slot = (slot + 1) & (capacity - 1);
+				}
+
+				screens[slot] = fuzzer->screens[i];
+			}
+		}
+
+		free(fuzzer->screens);
+		fuzzer->screens = screens;
+		fuzzer->screen_capacity = capacity;
+	}
+
+	uint32_t slot = (uint32_t)hash & (fuzzer->screen_capacity - 1);
+
+	while (fuzzer->screens[slot] != 0) {
+		if (fuzzer->screens[slot] == hash) {
+			return false;
+		}
+
+		slot = (slot + 1) & (fuzzer->screen_capacity - 1);
+	}
+
+	fuzzer->screens[slot] = hash;
+	fuzzer->screen_count++;
+
+	return true;
+}
+
+// Keeps the worker's last run in the corpus. Called with the lock held.
+bool fuzz_add_entry(struct Fuzzer* fuzzer, struct FuzzWorker* worker, uint32_t length) {
+	struct FuzzEntry* entry = &fuzzer->entries[fuzzer->entry_count];
+	uint32_t count = (length - 1) / FUZZ_SNAPSHOT_INTERVAL + 1;
+
+	entry->keys = malloc(fuzzer->frames);
+	entry->snapshots = malloc(count * sizeof(struct StoredSnapshot));
+
+	if (entry->keys == NULL || entry->snapshots == NULL) {
+		free(entry->keys);
+		free(entry->snapshots);
+		return false;
+	}
+
+	memcpy(entry->keys, worker->keys, fuzzer->frames);
+	entry->length = length;
+	entry->snapshot_count = 0;
+
+	// Up to the start the snapshots are the parent's, so share its pages
+	const struct FuzzEntry* parent = fuzzer->entry_count > 0 ? &fuzzer->entries[worker->parent] : NULL;
+
+	for (uint32_t i = 0; i < count; i++) {
+		struct Snapshot snapshot;
+
+		if (parent != NULL && i * FUZZ_SNAPSHOT_INTERVAL < worker->start) {
+			snapshot_store_get(&fuzzer->store, &parent->snapshots[i], &snapshot);
+		}
+		else {
+			snapshot = worker->snapshots[i];
+		}
+
+		if (snapshot_store_put(&fuzzer->store, &snapshot, &entry->snapshots[i]) == false) {
+			while (entry->snapshot_count > 0) {
+				snapshot_store_release(&fuzzer->store, &entry->snapshots[--entry->snapshot_count]);
+			}
+
+			free(entry->keys);
+			free(entry->snapshots);
+			return false;
+		}
+
+		entry->snapshot_count++;
+	}
+
+	fuzzer->entry_count++;
+
+	return true;
+}
+
+// Replays a movie from power-on into a recording that --play can reproduce
+void fuzz_write_finding(struct Fuzzer* fuzzer, const uint8_t* keys, uint32_t length, uint8_t fault, uint16_t pc, uint32_t number) {
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/%s-%03u.c8r", fuzzer->output_path, fault == FUZZ_SOFTLOCK ? "softlock" : "crash", number);
+
+	struct State* state = state_init();
+
+	if (state == NULL) {
+		return;
+	}
+
+	struct Recorder* recorder = NULL;
+
+	// A crash happens part way through the last frame, which can't be recorded
+	// as it never finishes. The recording stops just before, so playing it
+	// crashes on the first live frame.
+	uint32_t recorded = fault == FUZZ_SOFTLOCK ? length : length - 1;
+
+	if (load_rom(state, fuzzer->rom_path) && (recorder = recorder_open(path, DEFAULT_KEYFRAME_INTERVAL)) != NULL) {
+		for (uint32_t frame = 0; frame < recorded; frame++) {
+			struct FrameInput input;
+			fuzz_input(keys, frame, &input);
+
+			if (recorder_frame(recorder, state, &input) == false) {
+				break;
+			}
+
+			fuzz_frame(state, &input, NULL);
+		}
+
+		if (recorder_close(recorder, state)) {
+			printf("  found %s at 0x%03X after %u frames: %s\n", FUZZ_FAULT_NAMES[fault], pc, length, path);
+		}
+	}
+
+	state_destroy(state);
+}
+
+int fuzz_worker_thread(void* data) {
+	struct FuzzWorker* worker = data;
+	struct Fuzzer* fuzzer = worker->fuzzer;
+
+	while (SDL_AtomicGet(&fuzzer->running)) {
+		SDL_LockMutex(fuzzer->lock);
+		fuzz_mutate(worker);
+		SDL_UnlockMutex(fuzzer->lock);
+
+		uint32_t length;
+		uint8_t fault = fuzz_run(worker, &length);
+		uint16_t pc = worker->state->pc;
+
+		bool interesting = false;
+		bool report = false;
+		uint32_t number = 0;
+
+		SDL_LockMutex(fuzzer->lock);
+
+		// A word of flags at a time, most runs add nothing
+		for (uint32_t address = 0; address < COVERAGE_SIZE; address += sizeof(uint64_t)) {
+			uint64_t run;
+			uint64_t seen;
+			memcpy(&run, &worker->state->coverage[address], sizeof(run));
+			memcpy(&seen, &fuzzer->coverage[address], sizeof(seen));
+
+			if ((run & ~seen) != 0) {
+				seen |= run;
+				memcpy(&fuzzer->coverage[address], &seen, sizeof(seen));
+				interesting = true;
+			}
+		}
+
+		for (uint32_t i = 0; i < worker->screen_count; i++) {
+			interesting = fuzz_add_screen(fuzzer, worker->screens[i]) || interesting;
+		}
+
+		if (fault != FUZZ_OK) {
+			// One of each fault at each address is enough
+			report = true;
+
+			for (uint32_t i = 0; i < fuzzer->finding_count && report; i++) {
+				report = fuzzer->findings[i].fault != fault || fuzzer->findings[i].pc != pc;
+			}
+
+			if (report && fuzzer->finding_count < FUZZ_MAX_FINDINGS) {
+				fuzzer->findings[fuzzer->finding_count].fault = fault;
+				fuzzer->findings[fuzzer->finding_count].pc = pc;
+				number = fuzzer->finding_count++;
+			}
+			else {
+				report = false;
+			}
+		}
+
+		// Crashes would just crash again, soft-locks can still be a way on
+		if (interesting && fault != FUZZ_SOFTLOCK && fault != FUZZ_OK) {
+			interesting = false;
+		}
+
+		if (interesting && fuzzer->entry_count < FUZZ_MAX_CORPUS) {
+			fuzz_add_entry(fuzzer, worker, length);
+		}
+
+		fuzzer->runs++;
+		fuzzer->frames_run += length - worker->start;
+
+		SDL_UnlockMutex(fuzzer->lock);
+
+		if (report) {
+			fuzz_write_finding(fuzzer, worker->keys, length, fault, pc, number);
+		}
+	}
+
+	return 0;
+}
+
+bool fuzz_worker_init(struct FuzzWorker* worker, struct Fuzzer* fuzzer, uint32_t seed) {
+	memset(worker, 0, sizeof(struct FuzzWorker));
+	worker->fuzzer = fuzzer;
+	worker->rng = seed != 0 ? seed : 1;
+	worker->state = state_init();
+
+	if (worker->state == NULL || load_rom(worker->state, fuzzer->rom_path) == false) {
+		return false;
+	}
+
+	worker->state->coverage = malloc(COVERAGE_SIZE);
+	worker->keys = malloc(fuzzer->frames);
+	worker->snapshots = malloc(((fuzzer->frames - 1) / FUZZ_SNAPSHOT_INTERVAL + 1) * sizeof(struct Snapshot));
+	worker->screens = malloc(fuzzer->frames * sizeof(uint64_t));
+
+	if (worker->state->coverage == NULL || worker->keys == NULL || worker->snapshots == NULL || worker->screens == NULL) {
+		fprintf(stderr, "Failed to allocate fuzz worker.\n");
+		return false;
+	}
+
+	return true;
+}
+
+void fuzz_worker_destroy(struct FuzzWorker* worker) {
+	if (worker->state != NULL) {
+		free(worker->state->coverage);
+		worker->state->coverage = NULL;
+		state_destroy(worker->state);
+	}
+
+	free(worker->keys);
+	free(worker->snapshots);
+	free(worker->screens);
+}
+
+void fuzz_report(struct Fuzzer* fuzzer, double seconds) {
+	SDL_LockMutex(fuzzer->lock);
+
+	int executed = 0;
+
+	for (uint32_t address = 0; address < COVERAGE_SIZE; address++) {
+		executed += (fuzzer->coverage[address] & COVERAGE_EXECUTED) != 0;
+	}
+
+	printf("%6.0fs: %llu runs (%.0f/s, %.0f frames/s), corpus %u, %d addresses, %u screens, %u findings\n",
+		seconds, (unsigned long long)fuzzer->runs, fuzzer->runs / seconds, fuzzer->frames_run / seconds,
+		fuzzer->entry_count, executed, fuzzer->screen_count, fuzzer->finding_count);
+
+	SDL_UnlockMutex(fuzzer->lock);
+}
+
+bool fuzz_rom(const char* rom_path, const char* output_path, uint32_t frames, uint32_t seconds, int thread_count) {
+	if (frames == 0) {
+		fprintf(stderr, "--fuzz-frames must be at least 1\n");
+		return false;
+	}
+
+	struct Fuzzer fuzzer;
+	memset(&fuzzer, 0, sizeof(fuzzer));
+	fuzzer.rom_path = rom_path;
+	fuzzer.output_path = output_path;
+	fuzzer.frames = frames;
+	fuzzer.screen_capacity = 1024;
+
+	if (thread_count <= 0) {
+		thread_count = SDL_GetCPUCount();
+	}
+
+	struct FuzzWorker* workers = calloc(thread_count, sizeof(struct FuzzWorker));
+	fuzzer.entries = calloc(FUZZ_MAX_CORPUS, sizeof(struct FuzzEntry));
+	fuzzer.coverage = calloc(COVERAGE_SIZE, 1);
+	fuzzer.screens = calloc(fuzzer.screen_capacity, sizeof(uint64_t));
+	fuzzer.lock = SDL_CreateMutex();
+
+	bool success = workers != NULL && fuzzer.entries != NULL && fuzzer.coverage != NULL && fuzzer.screens != NULL && fuzzer.lock != NULL &&
+		snapshot_store_init(&fuzzer.store);
+
+	if (success == false) {
+		fprintf(stderr, "Failed to allocate fuzzer.\n");
+	}
+
+	for (int i = 0; i < thread_count && success; i++) {
+		success = fuzz_worker_init(&workers[i], &fuzzer, (uint32_t)(i + 1) * 0x9E3779B9u ^ SDL_GetTicks());
+	}
+
+	// Classic only, snapshots don't hold MegaChip state
+	if (success && workers[0].state->memory_size != MEMORY_SIZE) {
+		fprintf(stderr, "MegaChip ROMs can't be fuzzed\n");
+		success = false;
+	}
+
+	if (success) {
+		// Seed the corpus with doing nothing at all
+		struct FuzzWorker* seed = &workers[0];
+		uint32_t length;
+
+		memset(seed->keys, 16, frames);
+		seed->start = 0;
+		state_save(seed->state, &seed->snapshots[0]);
+
+		uint8_t fault = fuzz_run(seed, &length);
+		memcpy(fuzzer.coverage, seed->state->coverage, COVERAGE_SIZE);
+
+		for (uint32_t i = 0; i < seed->screen_count; i++) {
+			fuzz_add_screen(&fuzzer, seed->screens[i]);
+		}
+
+		if (fault != FUZZ_OK) {
+			fuzzer.findings[0].fault = fault;
+			fuzzer.findings[0].pc = seed->state->pc;
+			fuzzer.finding_count = 1;
+			fuzz_write_finding(&fuzzer, seed->keys, length, fault, seed->state->pc, 0);
+		}
+
+		success = fuzz_add_entry(&fuzzer, seed, length);
+	}
 
-		case 0x18:
-			state->sound_timer = state->regs_v[nibble2];
-			break;
+	if (success) {
+		printf("Fuzzing %s for %us on %d threads, %u frames per run\n", rom_path, seconds, thread_count, frames);
 
-		case 0x1E:
-			state->reg_i += state->regs_v[nibble2];
-			break;
+		SDL_AtomicSet(&fuzzer.running, 1);
 
-		case 0x29:
-			state->reg_i = FONT_START + state->regs_v[nibble2];
-			break;
+		for (int i = 0; i < thread_count; i++) {
+			workers[i].thread = SDL_CreateThread(fuzz_worker_thread, "fuzz worker", &workers[i]);
+		}
 
-		case 0x33:
-			instruction_decimal_digits(state, state->regs_v[nibble2]);
-			break;
+		uint64_t start_time = SDL_GetPerformanceCounter();
+		double elapsed = 0;
 
-		case 0x55:
-			memcpy(&state->memory[state->reg_i], state->regs_v, nibble2 + 1);
-			break;
+		while (elapsed < seconds) {
+			SDL_Delay(1000);
+			elapsed = (double)(SDL_GetPerformanceCounter() - start_time) / SDL_GetPerformanceFrequency();
+			fuzz_report(&fuzzer, elapsed);
+		}
 
-		case 0x65:
-			memcpy(state->regs_v, &state->memory[state->reg_i], nibble2 + 1);
-			break;
+		SDL_AtomicSet(&fuzzer.running, 0);
 
-		default: 
-			printf("Unknown 0xF ending 0x%04X\n", opcode);
-			break;
+		for (int i = 0; i < thread_count; i++) {
+			if (workers[i].thread != NULL) {
+				SDL_WaitThread(workers[i].thread, NULL);
+			}
 		}
 
-		break;
+		printf("Corpus snapshots take %.0f bytes each\n", snapshot_store_bytes_per_snapshot(&fuzzer.store));
+	}
 
-	default:
-		printf("Unknown opcode: 0x%04X\n", opcode);
-		break;
+	for (int i = 0; workers != NULL && i < thread_count; i++) {
+		fuzz_worker_destroy(&workers[i]);
 	}
 
-	if (should_step == true) {
-		state->pc += 2;
+	for (uint32_t i = 0; i < fuzzer.entry_count; i++) {
+		free(fuzzer.entries[i].keys);
+		free(fuzzer.entries[i].snapshots);
+	}
+
+	if (fuzzer.lock != NULL) {
+		SDL_DestroyMutex(fuzzer.lock);
 	}
+
+	snapshot_store_destroy(&fuzzer.store);
+	free(fuzzer.screens);
+	free(fuzzer.coverage);
+	free(fuzzer.entries);
+	free(workers);
+
+	return success;
 }
 
 // TODO: Cleanup
@@ -583,20 +8495,361 @@ int get_chip8_keycode_from_sdl(SDL_Keycode keycode) {
 	}
 }
 
-int main(int argc, char* argv[]) {
-	if (argc < 2) {
+struct Options {
+	const char* rom_path;
+	// Every positional argument, for --batch
+	const char** rom_paths;
+	int rom_count;
+	bool batch;
+	bool scaling;
+	uint32_t instances;
+	const char* record_path;
+	const char* play_path;
+	const char* verify_path;
+	const char* bench_path;
+	uint32_t bench_frames;
+	const char* coverage_path;
+	const char* symbols_path;
+	const char* scan_steps;
+	const char* screenshots_path;
+	uint32_t screenshot_every;
+	uint32_t screenshot_frames;
+	const char* diff_path;
+	const char* diff_output_path;
+	const char* fuzz_path;
+	uint32_t fuzz_frames;
+	uint32_t fuzz_seconds;
+	bool monitor;
+	bool realtime;
+	bool kiosk;
+	bool low_power;
+	bool latency;
+	bool host_calls;
+	const char* rewind_path;
+	uint32_t rewind_memory;
+	int filters;
+	int emulation_core;
+	int audio_core;
+	uint32_t keyframe_interval;
+	uint32_t seek_frame;
+	int threads;
+};
+
+void print_usage() {
+	fprintf(stderr,
+		"Usage: chip8 [options] <rom>\n"
+		"       chip8 --play <recording> [--seek <frame>] [options]\n"
+		"       chip8 --verify <recording> [--threads <n>]\n"
+		"       chip8 --bench <rom> [--bench-frames <n>]\n"
+		"       chip8 --coverage <out> [--symbols <map>] (--play <recording> | <rom>)\n"
+		"       chip8 --scan <frame:predicate,...> (--play <recording> | <rom>)\n"
+		"       chip8 --screenshots <dir> [--screenshot-every <n>] [--screenshot-frames <n>] (--play <recording> | <rom>)\n"
+		"       chip8 --diff <golden.png> [--diff-out <diff.png>] <screenshot.png>\n"
+		"       chip8 --fuzz <dir> [--fuzz-seconds <n>] [--fuzz-frames <n>] [--threads <n>] <rom>\n"
+		"       chip8 --batch [--instances <n>] [--threads <n>] [--scaling] <rom>...\n"
+		"       chip8 --kiosk [options] <rom>...\n"
+		"\n"
+		"  --record <file>            Record the session (keyframes + inputs)\n"
+		"  --keyframe-interval <n>    Frames between recorded keyframes (default %u)\n"
+		"  --play <file>              Replay a recording, then continue live\n"
+		"  --seek <frame>             Start playback at this frame\n"
+		"  --verify <file>            Replay every recorded segment in parallel and check it\n"
+		"  --threads <n>              Worker threads for batch tools (default: all cores)\n"
+		"  --bench <rom>              Measure headless emulation throughput\n"
+		"  --filter <list>            Comma separated display filters: scale2x, scale3x, scanlines, crt\n"
+		"  --bench-frames <n>         Frames per benchmark run, batch instance or coverage run (default 100000)\n"
+		"  --coverage <file>          Write executed addresses and skip branches as lcov (or .json)\n"
+		"  --symbols <file>           Address to source line map for --coverage\n"
+		"  --scan <steps>             Find variables in memory: changed, unchanged, increased, decreased or =N at each frame\n"
+		"  --screenshots <dir>        Save frames of a headless run as PNGs here (F12 saves one when playing)\n"
+		"  --screenshot-every <n>     Frames between --screenshots (default 60)\n"
+		"  --screenshot-frames <n>    Frames to run a ROM for with --screenshots (default 600)\n"
+		"  --diff <file>              Compare a screenshot against this golden one, exits with 1 if they differ\n"
+		"  --diff-out <file>          Write the --diff result as an image, differences in red and green\n"
+		"  --fuzz <dir>               Search for input that crashes or soft-locks the ROM, saving recordings here\n"
+		"  --fuzz-seconds <n>         How long to fuzz for (default 60)\n"
+		"  --fuzz-frames <n>          Frames per fuzz run (default 1800)\n"
+		"  --batch                    Run every ROM headless on all cores, NUMA and L2 aware\n"
+		"  --instances <n>            Total batch instances, ROMs are repeated to fill (default: one each)\n"
+		"  --scaling                  Report batch throughput from 1 thread up to --threads\n"
+		"  --kiosk                    Preload every ROM and switch between them with Tab\n"
+		"  --monitor                  Print registers once a second from another thread\n"
+		"  --low-power                Sleep on events, skip unchanged frames, report CPU use\n"
+		"  --latency                  Trace key presses through to the screen, report on exit\n"
+		"  --host-calls               Let the ROM use 0FNN timers, register logging and markers\n"
+		"  --rewind <file>            Hold Backspace to rewind, older history spills to this file\n"
+		"  --rewind-memory <MB>       History kept in memory before spilling (default 16)\n"
+		"  --realtime                 Pin threads, lock memory and report frame deadline misses\n"
+		"  --emulation-core <n>       Core for the emulation thread (default: last)\n"
+		"  --audio-core <n>           Core for the audio thread (default: second to last)\n",
+		DEFAULT_KEYFRAME_INTERVAL);
+}
+
+bool parse_options(int argc, char* argv[], struct Options* options) {
+	memset(options, 0, sizeof(struct Options));
+	options->rom_paths = calloc(argc, sizeof(const char*));
+
+	if (options->rom_paths == NULL) {
+		fprintf(stderr, "Failed to allocate options.\n");
+		return false;
+	}
+
+	options->keyframe_interval = DEFAULT_KEYFRAME_INTERVAL;
+	options->bench_frames = 100000;
+	options->rewind_memory = 16;
+	options->fuzz_frames = 1800;
+	options->fuzz_seconds = 60;
+	options->screenshot_every = 60;
+	options->screenshot_frames = 600;
+	options->emulation_core = SDL_GetCPUCount() - 1;
+	options->audio_core = SDL_GetCPUCount() > 1 ? SDL_GetCPUCount() - 2 : 0;
+
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+
+		if (arg[0] != '-') {
+			options->rom_path = arg;
+			options->rom_paths[options->rom_count++] = arg;
+			continue;
+		}
+
+		// Flags
+		if (strcmp(arg, "--monitor") == 0) {
+			options->monitor = true;
+			continue;
+		}
+
+		if (strcmp(arg, "--realtime") == 0) {
+			options->realtime = true;
+			continue;
+		}
+
+		if (strcmp(arg, "--batch") == 0) {
+			options->batch = true;
+			continue;
+		}
+
+		if (strcmp(arg, "--kiosk") == 0) {
+			options->kiosk = true;
+			continue;
+		}
+
+		if (strcmp(arg, "--low-power") == 0) {
+			options->low_power = true;
+			continue;
+		}
+
+		if (strcmp(arg, "--latency") == 0) {
+			options->latency = true;
+			continue;
+		}
+
+		if (strcmp(arg, "--host-calls") == 0) {
+			options->host_calls = true;
+			continue;
+		}
+
+		if (strcmp(arg, "--scaling") == 0) {
+			options->scaling = true;
+			continue;
+		}
+
+		// Everything else takes a value
+
+		if (value == NULL) {
+			fprintf(stderr, "Missing value for %s\n", arg);
+			return false;
+		}
+
+		if (strcmp(arg, "--record") == 0) {
+			options->record_path = value;
+		}
+		else if (strcmp(arg, "--keyframe-interval") == 0) {
+			options->keyframe_interval = (uint32_t)strtoul(value, NULL, 10);
+		}
+		else if (strcmp(arg, "--play") == 0) {
+			options->play_path = value;
+		}
+		else if (strcmp(arg, "--seek") == 0) {
+			options->seek_frame = (uint32_t)strtoul(value, NULL, 10);
+		}
+		else if (strcmp(arg, "--verify") == 0) {
+			options->verify_path = value;
+		}
+		else if (strcmp(arg, "--threads") == 0) {
+			options->threads = atoi(value);
+		}
+		else if (strcmp(arg, "--bench") == 0) {
+			options->bench_path = value;
+		}
+		else if (strcmp(arg, "--filter") == 0) {
+			options->filters = parse_filters(value);
+
+			if (options->filters < 0) {
+				return false;
+			}
+		}
+		else if (strcmp(arg, "--coverage") == 0) {
+			options->coverage_path = value;
+		}
+		else if (strcmp(arg, "--symbols") == 0) {
+			options->symbols_path = value;
+		}
+		else if (strcmp(arg, "--scan") == 0) {
+			options->scan_steps = value;
+		}
+		else if (strcmp(arg, "--screenshots") == 0) {
+			options->screenshots_path = value;
+		}
+		else if (strcmp(arg, "--screenshot-every") == 0) {
+			options->screenshot_every = (uint32_t)strtoul(value, NULL, 10);
+		}
+		else if (strcmp(arg, "--screenshot-frames") == 0) {
+			options->screenshot_frames = (uint32_t)strtoul(value, NULL, 10);
+		}
+		else if (strcmp(arg, "--diff") == 0) {
+			options->diff_path = value;
+		}
+		else if (strcmp(arg, "--diff-out") == 0) {
+			options->diff_output_path = value;
+		}
+		else if (strcmp(arg, "--fuzz") == 0) {
+			options->fuzz_path = value;
+		}
+		else if (strcmp(arg, "--fuzz-frames") == 0) {
+			options->fuzz_frames = (uint32_t)strtoul(value, NULL, 10);
+		}
+		else if (strcmp(arg, "--fuzz-seconds") == 0) {
+			options->fuzz_seconds = (uint32_t)strtoul(value, NULL, 10);
+		}
+		else if (strcmp(arg, "--rewind") == 0) {
+			options->rewind_path = value;
+		}
+		else if (strcmp(arg, "--rewind-memory") == 0) {
+			options->rewind_memory = (uint32_t)strtoul(value, NULL, 10);
+		}
+		else if (strcmp(arg, "--instances") == 0) {
+			options->instances = (uint32_t)strtoul(value, NULL, 10);
+		}
+		else if (strcmp(arg, "--emulation-core") == 0) {
+			options->emulation_core = atoi(value);
+		}
+		else if (strcmp(arg, "--audio-core") == 0) {
+			options->audio_core = atoi(value);
+		}
+		else if (strcmp(arg, "--bench-frames") == 0) {
+			options->bench_frames = (uint32_t)strtoul(value, NULL, 10);
+		}
+		else {
+			fprintf(stderr, "Unknown option %s\n", arg);
+			return false;
+		}
+
+		i++;
+	}
+
+	if (options->rom_path == NULL && options->play_path == NULL && options->verify_path == NULL && options->bench_path == NULL) {
 		fprintf(stderr, "No ROM file provided.\n");
+		return false;
+	}
+
+	if (options->low_power && options->realtime) {
+		fprintf(stderr, "--low-power and --realtime pull in opposite directions, pick one\n");
+		return false;
+	}
+
+	// A recording's keys never arrive as events, so a ROM waiting on FX0A
+	// would sleep forever
+	if (options->low_power && options->play_path != NULL) {
+		fprintf(stderr, "--low-power can't be used with --play\n");
+		return false;
+	}
+
+	// Switching games would make the recording unplayable
+	if (options->kiosk && (options->record_path != NULL || options->play_path != NULL)) {
+		fprintf(stderr, "--kiosk can't be used with --record or --play\n");
+		return false;
+	}
+
+	// Same again for going back in time
+	if (options->rewind_path != NULL && (options->kiosk || options->record_path != NULL || options->play_path != NULL)) {
+		fprintf(stderr, "--rewind can't be used with --kiosk, --record or --play\n");
+		return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+	struct Options options;
+
+	if (parse_options(argc, argv, &options) == false) {
+		print_usage();
 		return 1;
 	}
 
-	const char* rom_path = argv[1];
-		
+	// Headless tools
+	if (options.verify_path != NULL) {
+		return verify_recording(options.verify_path, options.threads) ? 0 : 1;
+	}
+
+	if (options.bench_path != NULL) {
+		if (bench_rom(options.bench_path, options.bench_frames) == false || bench_uploads(options.bench_path) == false) {
+			return 1;
+		}
+
+		return options.filters == 0 || bench_filters(options.bench_path, options.filters) ? 0 : 1;
+	}
+
+	if (options.coverage_path != NULL) {
+		return coverage_run(options.rom_path, options.play_path, options.symbols_path, options.coverage_path, options.bench_frames) ? 0 : 1;
+	}
+
+	if (options.scan_steps != NULL) {
+		return scan_run(options.rom_path, options.play_path, options.scan_steps) ? 0 : 1;
+	}
+
+	if (options.screenshots_path != NULL) {
+		return screenshots_run(options.rom_path, options.play_path, options.screenshots_path,
+			options.screenshot_frames, options.screenshot_every) ? 0 : 1;
+	}
+
+	if (options.diff_path != NULL) {
+		bool identical = false;
+		return diff_screenshots(options.diff_path, options.rom_path, options.diff_output_path, &identical) && identical ? 0 : 1;
+	}
+
+	if (options.fuzz_path != NULL) {
+		return fuzz_rom(options.rom_path, options.fuzz_path, options.fuzz_frames, options.fuzz_seconds, options.threads) ? 0 : 1;
+	}
+
+	if (options.batch) {
+		return batch_roms(options.rom_paths, options.rom_count, options.instances, options.bench_frames, options.threads, options.scaling) ? 0 : 1;
+	}
+
 	SDL_Window* window = NULL;
 	SDL_Renderer* renderer = NULL;
-	SDL_Texture* video_texture = NULL;
 	SDL_AudioDeviceID audio_device = 0;
+	struct Display display;
+	struct AudioRing* audio_ring = NULL;
+
+	if (options.realtime) {
+		audio_ring = calloc(1, sizeof(struct AudioRing));
+
+		if (audio_ring == NULL) {
+			fprintf(stderr, "Failed to allocate audio ring.\n");
+			return 1;
+		}
 
-	if (init_sdl(&window, &renderer, &video_texture, &audio_device) == false) {
+		audio_ring->core = options.audio_core;
+	}
+
+	if (init_sdl(&window, &renderer, &audio_device, audio_ring != NULL ? audio_ring_callback : NULL, audio_ring) == false) {
+		return 1;
+	}
+
+	if (display_init(&display, renderer, options.filters) == false) {
 		return 1;
 	}
 
@@ -608,26 +8861,170 @@ int main(int argc, char* argv[]) {
 		return 1;
 	}
 
-	if (load_rom(state, rom_path) == false) {
+	struct Recording* playback = NULL;
+	struct Recorder* recorder = NULL;
+	uint32_t frame = 0;
+	struct Kiosk kiosk;
+
+	if (options.kiosk) {
+		if (kiosk_init(&kiosk, options.rom_paths, options.rom_count, state) == false) {
+			return 1;
+		}
+
+		SDL_SetWindowTitle(window, kiosk_name(&kiosk));
+	}
+	else if (options.play_path != NULL) {
+		playback = recording_open(options.play_path);
+
+		if (playback == NULL || recording_seek(playback, state, options.seek_frame) == false) {
+			return 1;
+		}
+
+		frame = options.seek_frame;
+	}
+	else if (load_rom(state, options.rom_path) == false) {
 		return 1;
 	}
 
+	if (options.record_path != NULL) {
+		recorder = recorder_open(options.record_path, options.keyframe_interval);
+
+		if (recorder == NULL) {
+			return 1;
+		}
+	}
+
+	struct Observer* observer = NULL;
+	struct Monitor monitor;
+	SDL_Thread* monitor_thread_handle = NULL;
+
+	if (options.monitor) {
+		observer = observer_create();
+
+		if (observer == NULL) {
+			return 1;
+		}
+
+		monitor.observer = observer;
+		SDL_AtomicSet(&monitor.running, 1);
+		monitor_thread_handle = SDL_CreateThread(monitor_thread, "monitor", &monitor);
+	}
+
+	struct InputQueue input_queue;
+	memset(&input_queue, 0, sizeof(input_queue));
+
+	if (options.host_calls) {
+		state->host_calls = calloc(1, sizeof(struct HostCalls));
+
+		if (state->host_calls == NULL) {
+			fprintf(stderr, "Failed to allocate host calls.\n");
+			return 1;
+		}
+	}
+
+	struct LatencyTracker* latency = NULL;
+
+	if (options.latency) {
+		latency = latency_create(state);
+
+		if (latency == NULL) {
+			return 1;
+		}
+	}
+
+	struct Realtime realtime;
+	memset(&realtime, 0, sizeof(realtime));
+
+	if (options.realtime) {
+		realtime.emulation_core = options.emulation_core;
+		realtime.audio_core = options.audio_core;
+		realtime_init(&realtime, state, &display, audio_ring);
+	}
+
+	struct LowPower power;
+
+	if (options.low_power) {
+		low_power_init(&power);
+	}
+
+	struct Rewind* rewind = NULL;
+	bool rewinding = false;
+
+	if (options.rewind_path != NULL) {
+		rewind = rewind_create(options.rewind_path, (size_t)options.rewind_memory * 1048576);
+
+		if (rewind == NULL) {
+			return 1;
+		}
+
+		rewind_push(rewind, state);
+	}
+
 	uint32_t last_time = SDL_GetTicks();
 
+	struct Scheduler scheduler;
+	scheduler_init(&scheduler);
+
 	bool is_running = true;
 
 	while (is_running) {
 		SDL_Event event;
 
+		// Keys are queued with their timestamps and applied inside the next frame
 		while (SDL_PollEvent(&event)) {
 			switch (event.type) {
 			case SDL_KEYDOWN:
-				state->keycode = get_chip8_keycode_from_sdl(event.key.keysym.sym);
+				if (rewind != NULL && event.key.keysym.sym == SDLK_BACKSPACE) {
+					rewinding = true;
+					break;
+				}
+
+				if (event.key.keysym.sym == SDLK_F12) {
+					char path[64];
+					snprintf(path, sizeof(path), "chip8-%06u.png", frame);
+
+					if (screenshot_save(state, path)) {
+						printf("Saved %s\n", path);
+					}
+
+					break;
+				}
+
+				if (options.kiosk && (event.key.keysym.sym == SDLK_TAB || event.key.keysym.sym == SDLK_F5)) {
+					if (event.key.keysym.sym == SDLK_F5) {
+						kiosk_restart(&kiosk, state);
+					}
+					else {
+						kiosk_switch(&kiosk, state, (event.key.keysym.mod & KMOD_SHIFT) ? -1 : 1);
+						SDL_SetWindowTitle(window, kiosk_name(&kiosk));
+					}
+
+					// Whatever the last game was beeping
+					if (audio_ring == NULL) {
+						SDL_ClearQueuedAudio(audio_device);
+					}
+
+					break;
+				}
+
+				if (event.key.repeat == 0) {
+					input_queue_push(&input_queue, event.key.timestamp, get_chip8_keycode_from_sdl(event.key.keysym.sym));
+
+					if (latency != NULL) {
+						latency_key_event(latency, get_chip8_keycode_from_sdl(event.key.keysym.sym), event.key.timestamp);
+					}
+				}
+
 				break;
 
 			case SDL_KEYUP:
+				if (rewind != NULL && event.key.keysym.sym == SDLK_BACKSPACE) {
+					rewinding = false;
+					break;
+				}
+
 				// Signifies no key is being pressed
-				state->keycode = 16;
+				input_queue_push(&input_queue, event.key.timestamp, 16);
 				break;
 
 			case SDL_QUIT:
@@ -644,74 +9041,184 @@ int main(int argc, char* argv[]) {
 		}
 
 		// Emulation
+		if (options.realtime) {
+			realtime_wait(&realtime);
+		}
+
 		uint32_t current_time = SDL_GetTicks();
 		uint32_t elapsed_time = current_time - last_time;
 
-		if (elapsed_time >= FRAME_TIME) {
-			if (state->delay_timer > 0) {
-				state->delay_timer -= 1;
+		if (options.low_power) {
+			if (low_power_wait(&power, state, &current_time) == false) {
+				continue;
+			}
+
+			elapsed_time = current_time - last_time;
+		}
+		else if (options.realtime == false && elapsed_time < FRAME_TIME) {
+			SDL_Delay(1);
+			continue;
+		}
+
+		struct FrameInput input;
+		input_queue_take_frame(&input_queue, last_time, current_time, &input);
+
+		last_time = current_time;
+
+		// Playing on from here drops everything after it
+		if (rewinding) {
+			if (rewind_step_back(rewind, state)) {
+				frame--;
+			}
+
+			if (display_render(&display, state) == false) {
+				break;
 			}
 
-			if (state->sound_timer > 0) {
-				state->sound_timer -= 1;
+			if (options.realtime) {
+				realtime_frame_done(&realtime);
 			}
 
-			last_time = current_time;
+			continue;
 		}
 
-		//printf("%i\n", state->sound_timer);
+		// Recorded input overrides the keyboard until the recording runs out
+		if (playback != NULL && frame < playback->frame_count) {
+			recording_input(playback, frame, &input);
+		}
 
-		state_step(state);
+		if (recorder != NULL && recorder_frame(recorder, state, &input) == false) {
+			break;
+		}
+
+		if (latency != NULL) {
+			latency_frame_input(latency, state, &input);
+		}
+
+		state_frame_scheduled(state, &scheduler, &input);
+
+		if (latency != NULL) {
+			latency_frame_done(latency);
+		}
+
+		if (state->host_calls != NULL) {
+			host_calls_drain(state->host_calls, frame);
+		}
+
+		if (observer != NULL) {
+			observer_publish(observer, state, frame);
+		}
+
+		frame++;
+
+		if (rewind != NULL) {
+			rewind_push(rewind, state);
+		}
 
 		if (state->end_of_program) {
 			is_running = false;
 			break;
 		}
 
+		bool present = true;
+
+		if (options.low_power) {
+			bool sound = state->sound_timer > 0 || (state->megachip != NULL && state->megachip->sample_playing);
+
+			present = low_power_frame_done(&power, state, audio_device, sound);
+			low_power_report(&power, false);
+		}
+
 		// Sound
-		if (state->sound_timer > 0) {
+		if (state->megachip != NULL && state->megachip->sample_playing) {
+			int16_t samples[AUDIO_SAMPLE_RATE / 60];
+			megachip_mix_audio(state, samples, AUDIO_SAMPLE_RATE / 60);
+
+			audio_output(audio_device, audio_ring, samples, AUDIO_SAMPLE_RATE / 60);
+		}
+		else if (state->sound_timer > 0) {
 			if (elapsed_time > 0) {
 				for (int i = 0; i < elapsed_time; i++) {
 					int16_t sample = sin(i * 0.05) * 5000;
 
-					SDL_QueueAudio(audio_device, &sample, sizeof(int16_t));
+					audio_output(audio_device, audio_ring, &sample, 1);
 				}
 			}
 		}
 
 		// Rendering
-		uint32_t* video_buffer_sdl = convert_video_to_sdl(state->video_buffer);
+		if (present) {
+			if (display_render(&display, state) == false) {
+				break;
+			}
+
+			if (latency != NULL) {
+				latency_presented(latency);
+			}
+		}
+
+		if (options.realtime) {
+			realtime_frame_done(&realtime);
+		}
+	}
+
+	if (options.realtime) {
+		realtime_report(&realtime);
+	}
 
-		if (video_buffer_sdl) {
-			void* pixels;
-			int pitch;
-			SDL_LockTexture(video_texture, NULL, &pixels, &pitch);
+	if (options.low_power) {
+		low_power_report(&power, true);
+	}
 
-			memcpy(pixels, video_buffer_sdl, 64 * 32 * sizeof(uint32_t));
+	if (latency != NULL) {
+		latency_report(latency);
+		latency_destroy(latency, state);
+	}
 
-			SDL_UnlockTexture(video_texture);
+	if (rewind != NULL) {
+		rewind_report(rewind);
+		rewind_destroy(rewind);
+	}
 
-			SDL_Rect texture_rect;
-			texture_rect.x = 0;
-			texture_rect.y = 0;
-			texture_rect.w = WINDOW_WIDTH;
-			texture_rect.h = WINDOW_HEIGHT;
+	if (recorder != NULL) {
+		recorder_close(recorder, state);
+	}
 
-			SDL_RenderCopy(renderer, video_texture, NULL, &texture_rect);
+	if (playback != NULL) {
+		recording_close(playback);
+	}
 
-			free(video_buffer_sdl);
-		}
+	if (options.kiosk) {
+		kiosk_destroy(&kiosk);
+	}
 
-		SDL_RenderPresent(renderer);
+	if (monitor_thread_handle != NULL) {
+		SDL_AtomicSet(&monitor.running, 0);
+		SDL_WaitThread(monitor_thread_handle, NULL);
+	}
+
+	if (observer != NULL) {
+		observer_destroy(observer);
+	}
+
+	if (state->host_calls != NULL) {
+		host_calls_drain(state->host_calls, frame);
+		printf("%u frame marks in %u frames\n", state->host_calls->marks, frame);
 	}
 
+	free(state->host_calls);
 	state_destroy(state);
 
+	// Stops the callback before the ring goes away
 	SDL_CloseAudioDevice(audio_device);
-	SDL_DestroyTexture(video_texture);
+	free(audio_ring);
+
+	display_destroy(&display);
+
 	SDL_DestroyRenderer(renderer);
 	SDL_DestroyWindow(window);
 	SDL_Quit();
 
 	return 0;
-}
\ No newline at end of file
+}
+#endif